@@ -0,0 +1,57 @@
+
+#include "arena.hpp"
+
+namespace NBT {
+
+
+void *Arena::allocateSlow(size_t size, size_t align)
+{
+	// Oversized requests get a block of their own
+	size_t data_size = size + align > block_size ? size + align : block_size;
+	Block *b = static_cast<Block *>(::operator new(headerSize() + data_size));
+	b->next = head;
+	b->size = data_size;
+	head = b;
+	pos = reinterpret_cast<char *>(b) + headerSize();
+	end = pos + data_size;
+	char *p = alignUp(pos, align);
+	pos = p + size;
+	return p;
+}
+
+
+void Arena::release(Block *keep)
+{
+	Block *b = head;
+	while (b) {
+		Block *next = b->next;
+		if (b != keep)
+			::operator delete(b);
+		b = next;
+	}
+	head = keep;
+	pos = end = nullptr;
+}
+
+
+void Arena::reset()
+{
+	Block *keep = head;
+	if (keep) {
+		release(keep);
+		keep->next = nullptr;
+		pos = reinterpret_cast<char *>(keep) + headerSize();
+		end = pos + keep->size;
+	}
+}
+
+
+size_t Arena::capacity() const
+{
+	size_t size = 0;
+	for (Block *b = head; b; b = b->next)
+		size += b->size;
+	return size;
+}
+
+} // namespace NBT
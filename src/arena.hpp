@@ -0,0 +1,106 @@
+#ifndef NBT_ARENA_HEADER
+#define NBT_ARENA_HEADER
+
+#include <cstddef>
+#include <new>
+
+namespace NBT {
+
+// Monotonic (bump) allocator.  Memory is only released all at once, by
+// reset() or by destroying the arena.
+class Arena {
+public:
+	Arena(size_t block_size = 64 * 1024) :
+		head(nullptr), pos(nullptr), end(nullptr),
+		block_size(block_size)
+	{}
+	Arena(const Arena &) = delete;
+	Arena & operator = (const Arena &) = delete;
+	~Arena() { release(nullptr); }
+
+	void *allocate(size_t size, size_t align = alignof(std::max_align_t))
+	{
+		char *p = alignUp(pos, align);
+		if (p && p <= end && size <= static_cast<size_t>(end - p)) {
+			pos = p + size;
+			return p;
+		}
+		return allocateSlow(size, align);
+	}
+
+	// Frees everything but the most recent block, which is kept for reuse
+	void reset();
+
+	// Total size of the blocks currently held
+	size_t capacity() const;
+
+private:
+	struct Block {
+		Block *next;
+		size_t size;
+	};
+
+	// Size of a block's header, rounded up so that the data stays aligned
+	static size_t headerSize()
+	{
+		return (sizeof(Block) + alignof(std::max_align_t) - 1) &
+			~(alignof(std::max_align_t) - 1);
+	}
+
+	static char *alignUp(char *p, size_t align)
+	{
+		return reinterpret_cast<char *>(
+			(reinterpret_cast<size_t>(p) + align - 1) & ~(align - 1));
+	}
+
+	void *allocateSlow(size_t size, size_t align);
+	void release(Block *keep);
+
+	Block *head;
+	char *pos;
+	char *end;
+	size_t block_size;
+};
+
+
+// Standard allocator that draws from an Arena, or from the heap if it has
+// none.  Copies of a container always go to the heap, so that they don't
+// depend on the lifetime of the original's arena.
+template <typename T>
+struct ArenaAllocator {
+	typedef T value_type;
+
+	ArenaAllocator(Arena *arena = nullptr) noexcept : arena(arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U> &other) noexcept :
+		arena(other.arena) {}
+
+	T *allocate(size_t n)
+	{
+		if (arena)
+			return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t) noexcept
+	{
+		if (!arena)
+			::operator delete(p);
+	}
+
+	ArenaAllocator select_on_container_copy_construction() const
+		{ return ArenaAllocator(); }
+
+	Arena *arena;
+};
+
+template <typename T, typename U>
+inline bool operator == (const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+	{ return a.arena == b.arena; }
+template <typename T, typename U>
+inline bool operator != (const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+	{ return a.arena != b.arena; }
+
+} // namespace NBT
+
+#endif // NBT_ARENA_HEADER
@@ -0,0 +1,639 @@
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+#include "nbt.hpp"
+#include "compression.hpp"
+#include "reader.hpp"
+#include "bitfield.hpp"
+#include "schema.hpp"
+#include "diff.hpp"
+#include "snbt.hpp"
+
+// Benchmarks for the library, printed as JSON on stdout.  Each benchmark is
+// warmed up, then timed in a number of samples, each of which runs enough
+// iterations to last about a millisecond.  Statistics are per iteration.
+// Compression benchmarks also give the ratio of compressed to original size,
+// and chunk/patch_apply that of the patch to the chunk.
+//
+// Options:
+//   --filter <text>   Only run benchmarks whose name contains text
+//   --samples <n>     Number of timed samples (default 31)
+
+
+/**************
+ * Statistics *
+ **************/
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result {
+	std::string name;
+	size_t bytes;  // Processed per iteration, for throughput
+	size_t iterations;
+	double min, median, mean, p10, p90, p99;  // Nanoseconds
+	double ratio;  // Compressed or patch over original size
+};
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+	double pos = p * (sorted.size() - 1);
+	size_t lo = pos;
+	size_t hi = std::min(lo + 1, sorted.size() - 1);
+	return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+static double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Keeps the optimizer from dropping results
+static volatile size_t sink;
+
+static Result measure(const std::string &name, size_t bytes, size_t samples,
+		const std::function<size_t()> &f)
+{
+	// Warm up for a while, and work out how many iterations make a sample
+	size_t batch = 1;
+	Clock::time_point start = Clock::now();
+	while (true) {
+		Clock::time_point t = Clock::now();
+		for (size_t i = 0; i < batch; i++)
+			sink = f();
+		double elapsed = secondsSince(t);
+		if (elapsed >= 1e-3 && secondsSince(start) >= 0.1)
+			break;
+		if (elapsed < 1e-3)
+			batch *= 2;
+	}
+
+	std::vector<double> times;
+	for (size_t s = 0; s < samples; s++) {
+		Clock::time_point t = Clock::now();
+		for (size_t i = 0; i < batch; i++)
+			sink = f();
+		times.push_back(secondsSince(t) * 1e9 / batch);
+	}
+	std::sort(times.begin(), times.end());
+	double total = 0;
+	for (double t : times)
+		total += t;
+
+	Result r;
+	r.name = name;
+	r.bytes = bytes;
+	r.iterations = batch * samples;
+	r.min = times.front();
+	r.median = percentile(times, 0.5);
+	r.mean = total / times.size();
+	r.p10 = percentile(times, 0.1);
+	r.p90 = percentile(times, 0.9);
+	r.p99 = percentile(times, 0.99);
+	r.ratio = 0;
+	return r;
+}
+
+
+/**************
+ * Generators *
+ **************/
+
+// Deterministic, so that runs are comparable
+class Random {
+public:
+	Random(NBT::ULong seed = 0x9E3779B97F4A7C15ULL) : state(seed) {}
+	NBT::ULong next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+	NBT::UInt below(NBT::UInt n) { return next() % n; }
+private:
+	NBT::ULong state;
+};
+
+
+static std::string randomName(Random &rng, size_t len)
+{
+	std::string s(len, 'a');
+	for (char &c : s)
+		c = 'a' + rng.below(26);
+	return s;
+}
+
+
+// A chain of compounds, each with a few scalars
+static NBT::Tag nestedCompounds(int depth)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	NBT::Tag *t = &root;
+	for (int i = 0; i < depth; i++) {
+		(*t)["id"] = (NBT::Int) i;
+		(*t)["name"] = std::string("level");
+		(*t)["child"] = NBT::TagType::Compound;
+		t = &(*t)["child"];
+	}
+	return root;
+}
+
+
+// Shaped like an Anvil chunk: sections with palettes and packed block
+// states, heightmaps, and entities with position lists.
+static NBT::Tag chunkLike(Random &rng)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	root["DataVersion"] = (NBT::Int) 3465;
+	root["xPos"] = (NBT::Int) 3;
+	root["zPos"] = (NBT::Int) -7;
+	root["Status"] = std::string("minecraft:full");
+	root["sections"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+	for (int y = -4; y < 20; y++) {
+		NBT::Tag section = NBT::TagType::Compound;
+		section["Y"] = (NBT::Byte) y;
+		NBT::Tag &states = section["block_states"] = NBT::TagType::Compound;
+		states["palette"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+		for (int i = 0; i < 12; i++) {
+			NBT::Tag entry = NBT::TagType::Compound;
+			entry["Name"] = "minecraft:" + randomName(rng, 8);
+			if (i % 3 == 0) {
+				entry["Properties"] = NBT::TagType::Compound;
+				entry["Properties"]["facing"] = std::string("north");
+			}
+			states["palette"] += std::move(entry);
+		}
+		std::vector<NBT::UShort> ids(4096);
+		for (NBT::UShort &id : ids)
+			id = rng.below(12);
+		std::vector<NBT::Long> packed(NBT::packedSize(4096, 4, false));
+		NBT::packBits(ids.data(), ids.size(), 4, false, packed.data(),
+				packed.size());
+		states["data"] = NBT::Tag(NBT::TagType::LongArray);
+		states["data"].append(packed.data(), packed.size());
+		section["BlockLight"] = NBT::Tag(NBT::TagType::ByteArray, 2048);
+		root["sections"] += std::move(section);
+	}
+	root["Heightmaps"] = NBT::TagType::Compound;
+	std::vector<NBT::Long> heights(37);
+	for (NBT::Long &h : heights)
+		h = rng.next();
+	root["Heightmaps"]["WORLD_SURFACE"] = NBT::Tag(NBT::TagType::LongArray);
+	root["Heightmaps"]["WORLD_SURFACE"].append(heights.data(), heights.size());
+	root["entities"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+	for (int i = 0; i < 20; i++) {
+		NBT::Tag e = NBT::TagType::Compound;
+		e["id"] = std::string("minecraft:zombie");
+		e["Pos"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Double);
+		for (int j = 0; j < 3; j++)
+			e["Pos"] += NBT::Tag((double) rng.below(1000) / 7);
+		e["Rotation"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Float);
+		for (int j = 0; j < 2; j++)
+			e["Rotation"] += NBT::Tag((float) rng.below(360));
+		e["Health"] = 20.0f;
+		root["entities"] += std::move(e);
+	}
+	return root;
+}
+
+
+static NBT::Tag largeByteArray(size_t size)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	root["data"] = NBT::Tag(NBT::TagType::ByteArray, size);
+	return root;
+}
+
+
+static NBT::Tag manyStrings(Random &rng, size_t count)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	for (size_t i = 0; i < count; i++)
+		root[randomName(rng, 6) + std::to_string(i)] = randomName(rng, 10);
+	return root;
+}
+
+
+static NBT::Tag intArray(size_t count)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	root["ints"] = NBT::Tag(NBT::TagType::IntArray);
+	for (size_t i = 0; i < count; i++)
+		root["ints"] += (NBT::Int) i - 10;
+	return root;
+}
+
+
+static NBT::Tag floatList(size_t count)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	root["floats"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Float);
+	for (size_t i = 0; i < count; i++)
+		root["floats"] += NBT::Tag((float) i / 2);
+	return root;
+}
+
+
+// A player inventory, bound through a schema
+struct Item {
+	std::string id;
+	NBT::Byte count;
+	NBT::Byte slot;
+	NBT::Tag tag;
+};
+
+struct Inventory {
+	std::vector<Item> items;
+	std::vector<double> pos;
+	float health;
+};
+
+NBT_SCHEMA(Item,
+	NBT_FIELD(id, "id"),
+	NBT_FIELD(count, "Count"),
+	NBT_FIELD(slot, "Slot"),
+	NBT_FIELD(tag, "tag"))
+
+NBT_SCHEMA(Inventory,
+	NBT_FIELD(items, "Inventory"),
+	NBT_FIELD(pos, "Pos"),
+	NBT_FIELD(health, "Health"))
+
+static NBT::Tag inventory(Random &rng)
+{
+	NBT::Tag root = NBT::TagType::Compound;
+	root["Inventory"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+	for (int i = 0; i < 36; i++) {
+		NBT::Tag item = NBT::TagType::Compound;
+		item["id"] = "minecraft:" + randomName(rng, 10);
+		item["Count"] = (NBT::Byte) (1 + rng.below(64));
+		item["Slot"] = (NBT::Byte) i;
+		if (i % 4 == 0) {
+			item["tag"] = NBT::TagType::Compound;
+			item["tag"]["Damage"] = (NBT::Int) rng.below(100);
+		}
+		root["Inventory"] += std::move(item);
+	}
+	root["Pos"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Double);
+	for (int i = 0; i < 3; i++)
+		root["Pos"] += NBT::Tag((double) rng.below(1000));
+	root["Health"] = 20.0f;
+	return root;
+}
+
+
+/*********
+ * Suite *
+ *********/
+
+struct Shape {
+	std::string name;
+	NBT::Tag tag;
+};
+
+int main(int argc, char **argv)
+{
+	std::string filter;
+	size_t samples = 31;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+			samples = std::max(1, atoi(argv[++i]));
+		} else {
+			std::cerr << "Usage: " << argv[0]
+				<< " [--filter <text>] [--samples <n>]" << std::endl;
+			return 1;
+		}
+	}
+
+	Random rng;
+	std::vector<Shape> shapes;
+	shapes.push_back(Shape{"nested_compounds", nestedCompounds(100)});
+	shapes.push_back(Shape{"chunk", chunkLike(rng)});
+	shapes.push_back(Shape{"large_byte_array", largeByteArray(1 << 20)});
+	shapes.push_back(Shape{"many_strings", manyStrings(rng, 10000)});
+	shapes.push_back(Shape{"int_array", intArray(1000)});
+	shapes.push_back(Shape{"float_list", floatList(1000)});
+	shapes.push_back(Shape{"inventory", inventory(rng)});
+
+	std::vector<Result> results;
+	auto chunk_size = [] (const NBT::Tag &t) { return t.write().size(); };
+	auto run = [&] (const std::string &name, size_t bytes,
+			const std::function<size_t()> &f) {
+		if (name.find(filter) == std::string::npos)
+			return;
+		std::cerr << name << "..." << std::endl;
+		results.push_back(measure(name, bytes, samples, f));
+	};
+
+	for (Shape &shape : shapes) {
+		const std::string data = shape.tag.write();
+		const NBT::UByte *bytes = reinterpret_cast<const NBT::UByte *>(
+				data.data());
+		const size_t size = data.size();
+		const NBT::Tag &tag = shape.tag;
+
+		std::string out;
+		run(shape.name + "/write", size, [&] {
+			out.clear();
+			tag.write(out);
+			return out.size();
+		});
+		run(shape.name + "/read", size, [&] {
+			NBT::Tag t;
+			return (size_t) t.read(bytes, size).offset;
+		});
+		NBT::ReadOptions borrow;
+		borrow.borrow = true;
+		run(shape.name + "/read_borrowed", size, [&] {
+			NBT::Tag t;
+			return (size_t) t.read(bytes, size, true, borrow).offset;
+		});
+		NBT::Document doc;
+		run(shape.name + "/read_document", size, [&] {
+			return (size_t) doc.read(bytes, size).offset;
+		});
+		NBT::ReadOptions lazy;
+		lazy.lazy = true;
+		run(shape.name + "/read_lazy", size, [&] {
+			NBT::Tag t;
+			return (size_t) t.read(bytes, size, true, lazy).offset;
+		});
+		NBT::Visitor visitor;
+		run(shape.name + "/visit", size, [&] {
+			return (size_t) NBT::visit(bytes, size, visitor).offset;
+		});
+		run(shape.name + "/skip", size, [&] {
+			return (size_t) NBT::skip(bytes, size,
+					NBT::TagType::Compound).offset;
+		});
+		run(shape.name + "/copy", size, [&] {
+			NBT::Tag t = tag;
+			return (size_t) t.type;
+		});
+	}
+
+	// Decoding straight into structs, against building a tree
+	const std::string inv = shapes.back().tag.write();
+	Inventory decoded;
+	run("inventory/schema_decode", inv.size(), [&] {
+		return (size_t) NBT::decode(reinterpret_cast<const NBT::UByte *>(
+				inv.data()), inv.size(), decoded).offset;
+	});
+	std::string encoded;
+	run("inventory/schema_encode", inv.size(), [&] {
+		encoded.clear();
+		NBT::encode(encoded, decoded);
+		return encoded.size();
+	});
+
+	// Diffing two versions of a chunk that differ in a few places
+	const NBT::Tag &old_chunk = shapes[1].tag;
+	NBT::Tag new_chunk = old_chunk;
+	NBT::LongArray states = new_chunk["sections"][5]["block_states"]["data"];
+	states.value[17] ^= 0xF0;
+	new_chunk["entities"][3]["Health"] = 4.5f;
+	new_chunk["entities"][7]["Pos"].span<double>()[1] += 1;
+	run("chunk/diff", chunk_size(old_chunk), [&] {
+		return NBT::diff(old_chunk, new_chunk).entries.size();
+	});
+	NBT::HashCache old_hashes;
+	run("chunk/diff_cached", chunk_size(old_chunk), [&] {
+		return NBT::diff(old_chunk, new_chunk, &old_hashes).entries.size();
+	});
+	NBT::Patch patch = NBT::diff(old_chunk, new_chunk);
+	NBT::Tag patched;
+	run("chunk/patch_apply", chunk_size(old_chunk), [&] {
+		patched = old_chunk;
+		return (size_t) patch.apply(patched);
+	});
+	if (!results.empty() && results.back().name == "chunk/patch_apply")
+		results.back().ratio = (double) patch.write().size() /
+				chunk_size(old_chunk);
+
+	// SNBT, against the debug dump; sizes are of the text
+	const std::string snbt = NBT::toSNBT(old_chunk);
+	run("chunk/dump", snbt.size(), [&] {
+		return old_chunk.dump("").size();
+	});
+	std::string text;
+	run("chunk/snbt_write", snbt.size(), [&] {
+		text.clear();
+		NBT::writeSNBT(text, old_chunk);
+		return text.size();
+	});
+	run("chunk/snbt_read", snbt.size(), [&] {
+		NBT::Tag t;
+		return (size_t) NBT::readSNBT(snbt, t).offset;
+	});
+
+	// Framed in a reused packet buffer, after a small header
+	const std::string header(5, '\0');
+	std::string frame;
+	run("chunk/write_at", chunk_size(old_chunk), [&] {
+		frame.assign(header);
+		return old_chunk.writeAt(frame, frame.size(),
+				NBT::RootName::Nameless);
+	});
+	run("chunk/read_at", chunk_size(old_chunk), [&] {
+		NBT::Tag t;
+		return (size_t) t.readAt(reinterpret_cast<const NBT::UByte *>(
+				frame.data()), frame.size(), header.size(),
+				NBT::RootName::Nameless).offset;
+	});
+
+	// Bedrock's formats; sizes are of the encoded data
+	const std::string java = old_chunk.write();
+	const std::string le = old_chunk.write<NBT::LittleEndian>();
+	const std::string net = old_chunk.write<NBT::NetworkLittleEndian>();
+	run("chunk/le_write", le.size(), [&] {
+		text.clear();
+		old_chunk.write<NBT::LittleEndian>(text);
+		return text.size();
+	});
+	run("chunk/le_read", le.size(), [&] {
+		NBT::Tag t;
+		return (size_t) t.read<NBT::LittleEndian>(reinterpret_cast<
+				const NBT::UByte *>(le.data()), le.size()).offset;
+	});
+	run("chunk/net_write", net.size(), [&] {
+		text.clear();
+		old_chunk.write<NBT::NetworkLittleEndian>(text);
+		return text.size();
+	});
+	run("chunk/net_read", net.size(), [&] {
+		NBT::Tag t;
+		return (size_t) t.read<NBT::NetworkLittleEndian>(reinterpret_cast<
+				const NBT::UByte *>(net.data()), net.size()).offset;
+	});
+	run("chunk/transcode_le", java.size(), [&] {
+		text.clear();
+		NBT::transcode<NBT::BigEndian, NBT::LittleEndian>(reinterpret_cast<
+				const NBT::UByte *>(java.data()), java.size(), text);
+		return text.size();
+	});
+	run("chunk/transcode_net", java.size(), [&] {
+		text.clear();
+		NBT::transcode<NBT::BigEndian, NBT::NetworkLittleEndian>(
+				reinterpret_cast<const NBT::UByte *>(java.data()),
+				java.size(), text);
+		return text.size();
+	});
+
+	// Compression of chunk-shaped data, in every format that's built in,
+	// with the compression ratio of each level
+	const std::string chunk = old_chunk.write();
+	NBT::Compressor compressor;
+	NBT::Decompressor decompressor;
+	std::string packed, unpacked;
+	struct Codec {
+		const char *name;
+		NBT::CompressionFormat format;
+		std::vector<int> levels;
+	};
+	const Codec codecs[] = {
+		{"zlib", NBT::CompressionFormat::ZLib, {1, 6, 9}},
+		{"gzip", NBT::CompressionFormat::GZip, {6}},
+		{"zstd", NBT::CompressionFormat::Zstd, {1, 3, 19}},
+		{"lz4", NBT::CompressionFormat::LZ4, {Z_DEFAULT_COMPRESSION}},
+	};
+	for (const Codec &codec : codecs) {
+		if (!NBT::compressionSupported(codec.format))
+			continue;
+		for (int level : codec.levels) {
+			std::string name = std::string("compress/") + codec.name;
+			if (level != Z_DEFAULT_COMPRESSION)
+				name += "_" + std::to_string(level);
+			compressor.reset(level, codec.format);
+			run(name, chunk.size(), [&] {
+				packed.clear();
+				compressor.compress(&packed, chunk.data(), chunk.size());
+				return packed.size();
+			});
+			if (!results.empty() && results.back().name == name)
+				results.back().ratio = (double) packed.size() / chunk.size();
+		}
+		// Decompressed from the default level
+		compressor.reset(Z_DEFAULT_COMPRESSION, codec.format);
+		packed.clear();
+		compressor.compress(&packed, chunk.data(), chunk.size());
+		run(std::string("decompress/") + codec.name, chunk.size(), [&] {
+			unpacked.clear();
+			decompressor.decompress(&unpacked, packed.data(), packed.size());
+			return unpacked.size();
+		});
+	}
+	// Without reusing a context, to show what reuse saves
+	run("compress/zlib_oneshot", chunk.size(), [&] {
+		packed.clear();
+		NBT::compress(&packed, chunk.data(), chunk.size());
+		return packed.size();
+	});
+	compressor.reset(Z_DEFAULT_COMPRESSION, NBT::CompressionFormat::ZLib);
+	packed.clear();
+	compressor.compress(&packed, chunk.data(), chunk.size());
+	run("roundtrip/zlib_read", chunk.size(), [&] {
+		unpacked.clear();
+		decompressor.decompress(&unpacked, packed.data(), packed.size());
+		NBT::Tag t;
+		return (size_t) t.read(reinterpret_cast<const NBT::UByte *>(
+				unpacked.data()), unpacked.size()).offset;
+	});
+	// The same, parsed as it's inflated; that needs the root's type
+	std::string typed;
+	const std::string framed = old_chunk.write(true);
+	compressor.compress(&typed, framed.data(), framed.size());
+	run("roundtrip/zlib_stream_read", chunk.size(), [&] {
+		NBT::InflateSource src(decompressor, typed.data(), typed.size());
+		NBT::Tag t;
+		NBT::ReadResult res = t.read(src, NBT::RootName::Nameless);
+		src.finish();
+		return (size_t) res.offset;
+	});
+
+	// Small compound lookups and iteration, against std::map
+	const char *keys[] = {"x", "y", "z", "id", "Count", "Slot", "Damage", "tag"};
+	std::map<std::string, NBT::Tag> map;
+	NBT::Compound flat;
+	for (size_t i = 0; i < 8; i++) {
+		map[keys[i]] = (NBT::Int) i;
+		flat[keys[i]] = (NBT::Int) i;
+	}
+	run("compound/lookup_map", 0, [&] {
+		size_t sum = 0;
+		for (const char *k : keys) {
+			sum += (NBT::Int) map.find(k)->second;
+			for (auto &it : map)
+				sum += it.second.type == NBT::TagType::Int;
+		}
+		return sum;
+	});
+	run("compound/lookup", 0, [&] {
+		size_t sum = 0;
+		for (const char *k : keys) {
+			sum += (NBT::Int) flat.find(k)->second;
+			for (auto &it : flat)
+				sum += it.second.type == NBT::TagType::Int;
+		}
+		return sum;
+	});
+
+	// Block state unpacking, the hottest loop of chunk decoding
+	std::vector<NBT::UShort> ids(4096);
+	for (NBT::UInt bits : {4, 5, 9, 15}) {
+		for (int spanning = 0; spanning < 2; spanning++) {
+			std::vector<NBT::Long> states(NBT::packedSize(4096, bits, spanning));
+			for (NBT::Long &l : states)
+				l = rng.next();
+			run("bitfield/unpack_" + std::to_string(bits) +
+					(spanning ? "_spanning" : ""),
+					states.size() * sizeof(NBT::Long), [&] {
+				NBT::unpackBits(states.data(), states.size(), bits,
+						spanning, ids.data(), ids.size());
+				return (size_t) ids[4095];
+			});
+		}
+	}
+
+	printf("{\n\t\"optimized\": %s,\n\t\"samples\": %zu,\n"
+			"\t\"backends\": [\"zlib\"%s%s%s],\n\t\"results\": [",
+#ifdef __OPTIMIZE__
+			"true",
+#else
+			"false",
+#endif
+			samples,
+#ifdef NBT_HAVE_LIBDEFLATE
+			", \"libdeflate\"",
+#else
+			"",
+#endif
+			NBT::compressionSupported(NBT::CompressionFormat::Zstd) ?
+					", \"zstd\"" : "",
+			NBT::compressionSupported(NBT::CompressionFormat::LZ4) ?
+					", \"lz4\"" : "");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		printf("%s\n\t\t{\"name\": \"%s\", \"bytes\": %zu, \"iterations\": %zu, "
+				"\"min_ns\": %.1f, \"median_ns\": %.1f, \"mean_ns\": %.1f, "
+				"\"p10_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+				"\"mb_per_s\": %.1f",
+				i ? "," : "", r.name.c_str(), r.bytes, r.iterations,
+				r.min, r.median, r.mean, r.p10, r.p90, r.p99,
+				r.bytes / r.median * 1e9 / (1 << 20));
+		if (r.ratio)
+			printf(", \"ratio\": %.4g", r.ratio);
+		printf("}");
+	}
+	printf("\n\t]\n}\n");
+	return 0;
+}
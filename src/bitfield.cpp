@@ -0,0 +1,140 @@
+
+#include <cstring>
+
+#include "bitfield.hpp"
+
+namespace NBT {
+
+// Each width gets its own instantiation, so that the shifts and masks are
+// constants and the inner loops can be unrolled.
+
+template <unsigned Bits>
+static void unpackAligned(const ULong *data, UShort *out, size_t count)
+{
+	const unsigned per = 64 / Bits;
+	const ULong mask = (1ULL << Bits) - 1;
+	size_t full = count / per;
+	for (size_t i = 0; i < full; i++) {
+		ULong w = data[i];
+		for (unsigned j = 0; j < per; j++) {
+			out[j] = w & mask;
+			w >>= Bits;
+		}
+		out += per;
+	}
+	ULong w = count % per ? data[full] : 0;
+	for (unsigned j = 0; j < count % per; j++) {
+		out[j] = w & mask;
+		w >>= Bits;
+	}
+}
+
+
+// Entries are shifted out of the current long, refilling from the next one
+// when an entry runs across the boundary.
+template <unsigned Bits>
+static void unpackSpanning(const ULong *data, UShort *out, size_t count)
+{
+	const ULong mask = (1ULL << Bits) - 1;
+	ULong cur = count ? *data++ : 0;
+	unsigned avail = 64;
+	for (size_t i = 0; i < count; i++) {
+		if (avail >= Bits) {
+			out[i] = cur & mask;
+			cur >>= Bits;
+			avail -= Bits;
+		} else {
+			ULong next = *data++;
+			out[i] = (cur | next << avail) & mask;
+			cur = next >> (Bits - avail);
+			avail += 64 - Bits;
+		}
+	}
+}
+
+
+template <unsigned Bits>
+static void packAligned(const UShort *in, size_t count, ULong *data)
+{
+	const unsigned per = 64 / Bits;
+	const ULong mask = (1ULL << Bits) - 1;
+	size_t words = (count + per - 1) / per;
+	for (size_t i = 0; i < words; i++) {
+		unsigned n = i + 1 < words || count % per == 0 ? per : count % per;
+		ULong w = 0;
+		for (unsigned j = 0; j < n; j++)
+			w |= (in[j] & mask) << (j * Bits);
+		data[i] = w;
+		in += per;
+	}
+}
+
+
+template <unsigned Bits>
+static void packSpanning(const UShort *in, size_t count, ULong *data)
+{
+	const ULong mask = (1ULL << Bits) - 1;
+	memset(data, 0, (count * Bits + 63) / 64 * sizeof(ULong));
+	for (size_t i = 0; i < count; i++) {
+		size_t bit = i * Bits, word = bit / 64;
+		unsigned off = bit % 64;
+		ULong v = in[i] & mask;
+		data[word] |= v << off;
+		if (off + Bits > 64)
+			data[word + 1] |= v >> (64 - off);
+	}
+}
+
+
+typedef void (*Unpacker)(const ULong *, UShort *, size_t);
+typedef void (*Packer)(const UShort *, size_t, ULong *);
+
+#define NBT_BITFIELD_TABLE(name) { nullptr, \
+	name<1>,  name<2>,  name<3>,  name<4>,  name<5>,  name<6>,  name<7>, \
+	name<8>,  name<9>,  name<10>, name<11>, name<12>, name<13>, name<14>, \
+	name<15>, name<16> }
+
+static const Unpacker unpackers[2][17] = {
+	NBT_BITFIELD_TABLE(unpackAligned),
+	NBT_BITFIELD_TABLE(unpackSpanning),
+};
+
+static const Packer packers[2][17] = {
+	NBT_BITFIELD_TABLE(packAligned),
+	NBT_BITFIELD_TABLE(packSpanning),
+};
+
+#undef NBT_BITFIELD_TABLE
+
+
+size_t packedSize(size_t count, UInt bits, bool spanning)
+{
+	if (bits == 0 || bits > 16)
+		return 0;
+	if (spanning)
+		return (count * bits + 63) / 64;
+	return (count + 64 / bits - 1) / (64 / bits);
+}
+
+
+bool unpackBits(const Long *data, size_t size, UInt bits, bool spanning,
+		UShort *out, size_t count)
+{
+	if (bits == 0 || bits > 16 || size < packedSize(count, bits, spanning))
+		return false;
+	unpackers[spanning][bits](reinterpret_cast<const ULong *>(data),
+			out, count);
+	return true;
+}
+
+
+bool packBits(const UShort *in, size_t count, UInt bits, bool spanning,
+		Long *data, size_t size)
+{
+	if (bits == 0 || bits > 16 || size < packedSize(count, bits, spanning))
+		return false;
+	packers[spanning][bits](in, count, reinterpret_cast<ULong *>(data));
+	return true;
+}
+
+} // namespace NBT
@@ -0,0 +1,29 @@
+#ifndef NBT_BITFIELD_HEADER
+#define NBT_BITFIELD_HEADER
+
+#include <cstddef>
+
+#include "nbt.hpp"
+
+namespace NBT {
+
+// Fixed-width entries packed into a LongArray, as used for block states and
+// heightmaps.  Entries start at the least significant bit of each long.
+// Spanning layouts (before Minecraft 1.16) let an entry continue into the
+// next long; non-spanning layouts leave the unused high bits of each long
+// empty instead.  Widths of 1 to 16 bits are supported.
+
+// Number of longs needed for count entries
+extern size_t packedSize(size_t count, UInt bits, bool spanning);
+
+// These return false if the width isn't supported or if size (in longs)
+// is too small for count entries.
+extern bool unpackBits(const Long *data, size_t size, UInt bits,
+		bool spanning, UShort *out, size_t count);
+// Entries are truncated to the width
+extern bool packBits(const UShort *in, size_t count, UInt bits,
+		bool spanning, Long *data, size_t size);
+
+} // namespace NBT
+
+#endif // NBT_BITFIELD_HEADER
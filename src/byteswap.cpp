@@ -0,0 +1,169 @@
+
+#include <cstdint>
+#include <cstring>
+
+#include "byteswap.hpp"
+#include "endian.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+		(defined(__x86_64__) || defined(__i386__))
+	#define NBT_X86_SIMD
+	#include <immintrin.h>
+#endif
+
+namespace NBT {
+
+typedef uint8_t UByte;
+
+// Processes as many whole vectors as possible and returns the number of
+// bytes handled; the remainder is left to the scalar code.
+typedef size_t (*ShuffleFunc)(UByte * dst, const UByte * src, size_t size,
+		const UByte * mask);
+
+
+/***********
+ * Kernels *
+ ***********/
+
+static size_t shuffleNone(UByte *, const UByte *, size_t, const UByte *)
+{
+	return 0;
+}
+
+#ifdef NBT_X86_SIMD
+
+// Byte-reversal masks for each element width, repeated for both 128-bit
+// lanes of an AVX2 register.
+alignas(32) static const UByte mask16[32] = {
+	1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+};
+alignas(32) static const UByte mask32[32] = {
+	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+};
+alignas(32) static const UByte mask64[32] = {
+	7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+	7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+};
+
+__attribute__((target("ssse3")))
+static size_t shuffleSSSE3(UByte *dst, const UByte *src, size_t size,
+		const UByte *mask)
+{
+	const __m128i m = _mm_load_si128(reinterpret_cast<const __m128i *>(mask));
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+				_mm_shuffle_epi8(v, m));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t shuffleAVX2(UByte *dst, const UByte *src, size_t size,
+		const UByte *mask)
+{
+	const __m256i m = _mm256_load_si256(reinterpret_cast<const __m256i *>(mask));
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 32));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+				_mm256_shuffle_epi8(a, m));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32),
+				_mm256_shuffle_epi8(b, m));
+	}
+	for (; i + 32 <= size; i += 32) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+				_mm256_shuffle_epi8(a, m));
+	}
+	return i + shuffleSSSE3(dst + i, src + i, size - i, mask);
+}
+
+#endif // NBT_X86_SIMD
+
+
+static ShuffleFunc selectShuffle()
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	// Nothing to swap; the scalar code degenerates to a copy.
+	return shuffleNone;
+#elif defined(NBT_X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return shuffleAVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return shuffleSSSE3;
+	return shuffleNone;
+#else
+	return shuffleNone;
+#endif
+}
+
+// Selected on first use rather than during static initialization, which
+// other files' static initializers might run ahead of
+static ShuffleFunc shuffle()
+{
+	static const ShuffleFunc kernel = selectShuffle();
+	return kernel;
+}
+
+
+/**************
+ * Interfaces *
+ **************/
+
+// Scalar conversion of whatever the vector kernel left over.  Goes through
+// memcpy since neither buffer has to be aligned.
+#define NBT_BULK_CONVERTER(bits, type, func, mask) \
+	void copyBE##bits(void * dst, const void * src, size_t count) \
+	{ \
+		UByte * d = static_cast<UByte *>(dst); \
+		const UByte * s = static_cast<const UByte *>(src); \
+		size_t size = count * sizeof(type); \
+		size_t i = shuffle()(d, s, size, mask); \
+		for (; i < size; i += sizeof(type)) { \
+			type x; \
+			memcpy(&x, s + i, sizeof(x)); \
+			x = func(x); \
+			memcpy(d + i, &x, sizeof(x)); \
+		} \
+	}
+
+#ifdef NBT_X86_SIMD
+NBT_BULK_CONVERTER(16, uint16_t, be16toh, mask16)
+NBT_BULK_CONVERTER(32, uint32_t, be32toh, mask32)
+NBT_BULK_CONVERTER(64, uint64_t, be64toh, mask64)
+#else
+NBT_BULK_CONVERTER(16, uint16_t, be16toh, nullptr)
+NBT_BULK_CONVERTER(32, uint32_t, be32toh, nullptr)
+NBT_BULK_CONVERTER(64, uint64_t, be64toh, nullptr)
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define NBT_LE_CONVERTER(bits, type, func) \
+	void copyLE##bits(void * dst, const void * src, size_t count) \
+	{ \
+		UByte * d = static_cast<UByte *>(dst); \
+		const UByte * s = static_cast<const UByte *>(src); \
+		for (size_t i = 0; i < count * sizeof(type); i += sizeof(type)) { \
+			type x; \
+			memcpy(&x, s + i, sizeof(x)); \
+			x = func(x); \
+			memcpy(d + i, &x, sizeof(x)); \
+		} \
+	}
+#else
+#define NBT_LE_CONVERTER(bits, type, func) \
+	void copyLE##bits(void * dst, const void * src, size_t count) \
+		{ memmove(dst, src, count * sizeof(type)); }
+#endif
+
+NBT_LE_CONVERTER(16, uint16_t, le16toh)
+NBT_LE_CONVERTER(32, uint32_t, le32toh)
+NBT_LE_CONVERTER(64, uint64_t, le64toh)
+
+} // namespace NBT
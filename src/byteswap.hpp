@@ -0,0 +1,25 @@
+#ifndef NBT_BYTESWAP_HEADER
+#define NBT_BYTESWAP_HEADER
+
+#include <cstddef>
+
+namespace NBT {
+
+// Copy count 16, 32, or 64-bit values from src to dst, converting them
+// between big-endian and host byte order (the conversion is the same in
+// both directions).  Neither buffer needs to be aligned, and dst may be
+// the same as src.  On x86 the fastest shuffle kernel the CPU supports is
+// picked at startup.
+extern void copyBE16(void * dst, const void * src, size_t count);
+extern void copyBE32(void * dst, const void * src, size_t count);
+extern void copyBE64(void * dst, const void * src, size_t count);
+
+// The same for little-endian data, which is a plain copy on little-endian
+// hosts.
+extern void copyLE16(void * dst, const void * src, size_t count);
+extern void copyLE32(void * dst, const void * src, size_t count);
+extern void copyLE64(void * dst, const void * src, size_t count);
+
+} // namespace NBT
+
+#endif // NBT_BYTESWAP_HEADER
@@ -0,0 +1,309 @@
+
+#include <cstring>
+#include <algorithm>
+
+#include "nbt.hpp"
+
+namespace NBT {
+
+/********************
+ * Con/De-structors *
+ ********************/
+
+Compound::Compound(const allocator_type &alloc) :
+	items(nullptr),
+	num_items(0),
+	max_items(0),
+	index(nullptr),
+	index_size(0),
+	alloc(alloc)
+{}
+
+
+Compound::Compound(const Compound &other) :
+	Compound()
+{
+	reserve(other.num_items);
+	for (UInt i = 0; i < other.num_items; i++) {
+		new (&items[i]) Entry(other.items[i]);
+		num_items++;
+	}
+	updateIndex();
+}
+
+
+Compound::Compound(Compound &&other) noexcept :
+	items(other.items),
+	num_items(other.num_items),
+	max_items(other.max_items),
+	index(other.index),
+	index_size(other.index_size),
+	alloc(other.alloc)
+{
+	other.items = nullptr;
+	other.num_items = other.max_items = 0;
+	other.index = nullptr;
+	other.index_size = 0;
+}
+
+
+Compound::~Compound()
+{
+	clear();
+	alloc.deallocate(items, max_items);
+}
+
+
+/*************
+ * Operators *
+ *************/
+
+Compound & Compound::operator = (const Compound &other)
+{
+	if (this == &other)
+		return *this;
+	clear();
+	reserve(other.num_items);
+	for (UInt i = 0; i < other.num_items; i++) {
+		new (&items[i]) Entry(other.items[i]);
+		num_items++;
+	}
+	updateIndex();
+	return *this;
+}
+
+
+Compound & Compound::operator = (Compound &&other)
+{
+	if (this == &other)
+		return *this;
+	clear();
+	if (alloc != other.alloc) {
+		// Can't take over memory from another arena
+		reserve(other.num_items);
+		for (UInt i = 0; i < other.num_items; i++) {
+			new (&items[i]) Entry(std::move(other.items[i]));
+			num_items++;
+		}
+		other.clear();
+		updateIndex();
+		return *this;
+	}
+	alloc.deallocate(items, max_items);
+	items = other.items;
+	num_items = other.num_items;
+	max_items = other.max_items;
+	index = other.index;
+	index_size = other.index_size;
+	other.items = nullptr;
+	other.num_items = other.max_items = 0;
+	other.index = nullptr;
+	other.index_size = 0;
+	return *this;
+}
+
+
+/**********
+ * Lookup *
+ **********/
+
+Compound::Entry *Compound::lookup(const char *k, size_t len) const
+{
+	if (!index) {
+		for (UInt i = 0; i < num_items; i++) {
+			if (items[i].first.equals(k, len))
+				return &items[i];
+		}
+		return items + num_items;
+	}
+	UInt hash = hashKey(k, len);
+	UInt mask = index_size - 1;
+	for (UInt i = hash & mask; index[i].pos; i = (i + 1) & mask) {
+		if (index[i].hash != hash)
+			continue;
+		if (items[index[i].pos - 1].first.equals(k, len))
+			return &items[index[i].pos - 1];
+	}
+	return items + num_items;
+}
+
+
+Compound::Entry *Compound::lookup(const Key &k) const
+{
+	if (!index) {
+		for (UInt i = 0; i < num_items; i++) {
+			if (items[i].first == k)
+				return &items[i];
+		}
+		return items + num_items;
+	}
+	UInt mask = index_size - 1;
+	for (UInt i = k.hash() & mask; index[i].pos; i = (i + 1) & mask) {
+		if (index[i].hash == k.hash() && items[index[i].pos - 1].first == k)
+			return &items[index[i].pos - 1];
+	}
+	return items + num_items;
+}
+
+
+Tag & Compound::findOrInsert(const char *k, size_t len)
+{
+	Entry *e = lookup(k, len);
+	if (e != end())
+		return e->second;
+	reserve(num_items + 1);
+	new (&items[num_items]) Entry(Key(k, len));
+	num_items++;
+	if (index)
+		addToIndex(num_items - 1);
+	else
+		updateIndex();
+	return items[num_items - 1].second;
+}
+
+
+Tag & Compound::findOrInsert(Key k)
+{
+	Entry *e = lookup(k);
+	if (e != end())
+		return e->second;
+	reserve(num_items + 1);
+	new (&items[num_items]) Entry(std::move(k));
+	num_items++;
+	if (index)
+		addToIndex(num_items - 1);
+	else
+		updateIndex();
+	return items[num_items - 1].second;
+}
+
+
+Tag & Compound::at(const char *k, size_t len) const
+{
+	Entry *e = lookup(k, len);
+	if (e == items + num_items)
+		throw std::out_of_range("Compound has no key " + std::string(k, len));
+	return e->second;
+}
+
+
+/*********
+ * Index *
+ *********/
+
+// Open addressing with linear probing, kept at most half full.  Only
+// changes to the entries build or update it, so lookups never write, and
+// const Compounds can be shared between threads.
+void Compound::buildIndex()
+{
+	UInt size = 32;
+	while (size < num_items * 2)
+		size *= 2;
+	ArenaAllocator<Slot> slot_alloc(alloc);
+	index = slot_alloc.allocate(size);
+	index_size = size;
+	memset(index, 0, size * sizeof(Slot));
+	for (UInt i = 0; i < num_items; i++)
+		addToIndex(i);
+}
+
+
+void Compound::dropIndex()
+{
+	ArenaAllocator<Slot>(alloc).deallocate(index, index_size);
+	index = nullptr;
+	index_size = 0;
+}
+
+
+// Builds the index once a Compound is large enough for it to pay off
+void Compound::updateIndex()
+{
+	if (!index && num_items > index_threshold)
+		buildIndex();
+}
+
+
+void Compound::addToIndex(UInt pos)
+{
+	if ((pos + 1) * 2 > index_size) {
+		// Rebuilding re-adds this entry too
+		dropIndex();
+		buildIndex();
+		return;
+	}
+	// Keys carry their hash, so it's never computed again here
+	UInt hash = items[pos].first.hash();
+	UInt mask = index_size - 1;
+	UInt i = hash & mask;
+	while (index[i].pos)
+		i = (i + 1) & mask;
+	index[i].hash = hash;
+	index[i].pos = pos + 1;
+}
+
+
+/**********
+ * Modify *
+ **********/
+
+size_t Compound::erase(const std::string &k)
+{
+	const_iterator it = find(k);
+	if (it == end())
+		return 0;
+	erase(it);
+	return 1;
+}
+
+
+Compound::iterator Compound::erase(const_iterator it)
+{
+	UInt pos = it - items;
+	// Keep the order by shifting the rest of the entries down
+	for (UInt i = pos; i + 1 < num_items; i++)
+		items[i] = std::move(items[i + 1]);
+	items[--num_items].~Entry();
+	dropIndex();
+	updateIndex();
+	return items + pos;
+}
+
+
+void Compound::clear()
+{
+	for (UInt i = 0; i < num_items; i++)
+		items[i].~Entry();
+	num_items = 0;
+	dropIndex();
+}
+
+
+void Compound::reserve(size_t n)
+{
+	if (n <= max_items)
+		return;
+	UInt new_max = std::max<UInt>(max_items * 2, 4);
+	if (new_max < n)
+		new_max = n;
+	Entry *new_items = alloc.allocate(new_max);
+	for (UInt i = 0; i < num_items; i++) {
+		new (&new_items[i]) Entry(std::move(items[i]));
+		items[i].~Entry();
+	}
+	alloc.deallocate(items, max_items);
+	items = new_items;
+	max_items = new_max;
+}
+
+
+void Compound::sort()
+{
+	std::sort(items, items + num_items, [] (const Entry &a, const Entry &b) {
+		return a.first < b.first;
+	});
+	dropIndex();
+	updateIndex();
+}
+
+} // namespace NBT
@@ -1,109 +1,1032 @@
 
 #include <cstdint>
+#include <cstring>
 #include <cassert>
+#include <algorithm>
 
 #include <zlib.h>
+#ifdef NBT_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef NBT_HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#ifdef NBT_HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "compression.hpp"
 
 namespace NBT {
 
-constexpr std::size_t cmp_buf_size = 128 * 1024;
+// Size of the intermediate buffer used for streaming output
+constexpr std::size_t cmp_buf_size = 64 * 1024;
 
-bool compress(std::string * out, const char * in, size_t size, int level,
-		CompressionFormat format)
-{
-	int res = 0;
-	unsigned char temp_buffer[cmp_buf_size];
-
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
-	strm.avail_in = size;
 
+static int windowBits(CompressionFormat format)
+{
 	int ws = 15;
 	if (format == CompressionFormat::GZip)
 		ws += 16;
+	return ws;
+}
+
+
+bool compressionSupported(CompressionFormat format)
+{
+	switch (format) {
+	case CompressionFormat::ZLib:
+	case CompressionFormat::GZip:
+		return true;
+	case CompressionFormat::Zstd:
+#ifdef NBT_HAVE_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	case CompressionFormat::LZ4:
+#ifdef NBT_HAVE_LZ4
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+
+static bool unsupported(std::string &err, CompressionFormat format)
+{
+	err = format == CompressionFormat::Zstd ? "Zstd" : "LZ4";
+	err += " support isn't built in";
+	return false;
+}
+
+
+// Recognizes whole buffers by their magic numbers.  ZLib has none to
+// speak of, so it's the fallback.
+static CompressionFormat detect(const char *in, size_t size)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(in);
+	if (size >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+		return CompressionFormat::GZip;
+	if (size >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F &&
+			p[3] == 0xFD)
+		return CompressionFormat::Zstd;
+	if (size >= 8 && std::memcmp(p, "LZ4Block", 8) == 0)
+		return CompressionFormat::LZ4;
+	return CompressionFormat::ZLib;
+}
+
+
+#ifdef NBT_HAVE_LIBDEFLATE
+/**************
+ * libdeflate *
+ **************/
+
+// libdeflate only does whole buffers, which is what it's used for.  Its
+// compressors are made for one level, so the cached one is replaced when
+// the level changes.  If one can't be allocated, zlib is used instead.
+
+static libdeflate_compressor *libdeflateCompressor(void *&cache,
+		int &cached_level, int level)
+{
+	if (level == Z_DEFAULT_COMPRESSION)
+		level = 6;
+	if (cache && cached_level != level) {
+		libdeflate_free_compressor(
+				static_cast<libdeflate_compressor *>(cache));
+		cache = nullptr;
+	}
+	if (!cache) {
+		cache = libdeflate_alloc_compressor(level);
+		cached_level = level;
+	}
+	return static_cast<libdeflate_compressor *>(cache);
+}
+
+
+static libdeflate_decompressor *libdeflateDecompressor(void *&cache)
+{
+	if (!cache)
+		cache = libdeflate_alloc_decompressor();
+	return static_cast<libdeflate_decompressor *>(cache);
+}
+
+
+static libdeflate_result libdeflateDecompress(libdeflate_decompressor *d,
+		CompressionFormat format, char *out, size_t capacity,
+		size_t *written, const char *in, size_t size)
+{
+	size_t used;
+	if (format == CompressionFormat::GZip)
+		return libdeflate_gzip_decompress_ex(d, in, size, out, capacity,
+				&used, written);
+	return libdeflate_zlib_decompress_ex(d, in, size, out, capacity,
+			&used, written);
+}
+
+
+static bool libdeflateError(std::string &err, libdeflate_result res)
+{
+	if (res == LIBDEFLATE_INSUFFICIENT_SPACE)
+		err = "Output buffer too small";
+	else
+		err = "Inflation error: invalid or truncated data";
+	return false;
+}
+#endif // NBT_HAVE_LIBDEFLATE
+
+
+#ifdef NBT_HAVE_ZSTD
+/********
+ * Zstd *
+ ********/
+
+static bool zstdError(std::string &err, size_t res)
+{
+	if (ZSTD_getErrorCode(res) == ZSTD_error_dstSize_tooSmall) {
+		err = "Output buffer too small";
+	} else {
+		err = "Zstd error: ";
+		err += ZSTD_getErrorName(res);
+	}
+	return false;
+}
+
 
-	if ((res = deflateInit2(&strm, level, Z_DEFLATED, ws, 8,
-			Z_DEFAULT_STRATEGY)) != Z_OK) {
-		*out = "Error initializing stream: ";
-		*out += zError(res);
+static bool zstdCompress(void *&cache, int level, char *out, size_t capacity,
+		size_t *written, const char *in, size_t size, std::string &err)
+{
+	if (!cache && !(cache = ZSTD_createCCtx())) {
+		err = "Error initializing stream: out of memory";
+		return false;
+	}
+	if (level == Z_DEFAULT_COMPRESSION)
+		level = ZSTD_CLEVEL_DEFAULT;
+	size_t res = ZSTD_compressCCtx(static_cast<ZSTD_CCtx *>(cache), out,
+			capacity, in, size, level);
+	if (ZSTD_isError(res))
+		return zstdError(err, res);
+	*written = res;
+	return true;
+}
+
+
+static ZSTD_DCtx *zstdDecompressor(void *&cache, std::string &err)
+{
+	if (!cache && !(cache = ZSTD_createDCtx()))
+		err = "Error initializing stream: out of memory";
+	return static_cast<ZSTD_DCtx *>(cache);
+}
+
+
+static bool zstdDecompress(void *&cache, char *out, size_t capacity,
+		size_t *written, const char *in, size_t size, std::string &err)
+{
+	ZSTD_DCtx *d = zstdDecompressor(cache, err);
+	if (!d)
+		return false;
+	size_t res = ZSTD_decompressDCtx(d, out, capacity, in, size);
+	if (ZSTD_isError(res))
+		return zstdError(err, res);
+	*written = res;
+	return true;
+}
+
+
+// The frame header usually gives the size, but frames written by a
+// stream may not, so this streams into out, growing it as needed.
+static bool zstdDecompress(void *&cache, std::string *out, const char *in,
+		size_t size, size_t size_hint, std::string &err)
+{
+	ZSTD_DCtx *d = zstdDecompressor(cache, err);
+	if (!d)
 		return false;
+	if (!size_hint) {
+		unsigned long long known = ZSTD_getFrameContentSize(in, size);
+		size_hint = known != ZSTD_CONTENTSIZE_UNKNOWN &&
+				known != ZSTD_CONTENTSIZE_ERROR && known <= size * 1024 ?
+				known : size * 4 + 64;
 	}
+	ZSTD_DCtx_reset(d, ZSTD_reset_session_only);
 
+	size_t start = out->size();
+	size_t pos = start;
+	out->resize(start + size_hint + 1);  // Room to see the end
+	ZSTD_inBuffer src{in, size, 0};
+	size_t res;
 	do {
-		strm.avail_out = sizeof(temp_buffer);
-		strm.next_out = temp_buffer;
+		if (pos == out->size())
+			out->resize(start + (out->size() - start) * 2);
+		ZSTD_outBuffer dst{&(*out)[pos], out->size() - pos, 0};
+		res = ZSTD_decompressStream(d, &dst, &src);
+		pos += dst.pos;
+		if (ZSTD_isError(res)) {
+			out->resize(pos);
+			return zstdError(err, res);
+		}
+		if (res && src.pos == src.size && dst.pos < dst.size) {
+			out->resize(pos);
+			err = "Zstd error: unexpected end of stream";
+			return false;
+		}
+	} while (res || src.pos < src.size);
+	out->resize(pos);
+	return true;
+}
+#endif // NBT_HAVE_ZSTD
+
+
+#ifdef NBT_HAVE_LZ4
+/*******
+ * LZ4 *
+ *******/
+
+// lz4-java's LZ4BlockOutputStream format: blocks of up to 64 KiB, each with
+// a 21 byte header of the magic, a token (method and log2 of the block
+// size, less 10), the compressed and original lengths, and a checksum of
+// the original, all little-endian.  An empty block ends the stream.
+
+constexpr size_t lz4_block_size = 64 * 1024;
+constexpr size_t lz4_header_size = 21;
+constexpr unsigned lz4_raw = 0x10;
+constexpr unsigned lz4_compressed = 0x20;
+constexpr unsigned lz4_level = 6;
+constexpr uint32_t lz4_seed = 0x9747B28C;
+
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+
+// XXH32, which lz4-java truncates to 28 bits for its checksums
+static uint32_t xxh32(const unsigned char *p, size_t size, uint32_t seed)
+{
+	const uint32_t prime1 = 2654435761U, prime2 = 2246822519U,
+			prime3 = 3266489917U, prime4 = 668265263U, prime5 = 374761393U;
+	const unsigned char *end = p + size;
+	uint32_t h;
+
+	if (size >= 16) {
+		uint32_t v[4] = {seed + prime1 + prime2, seed + prime2, seed,
+				seed - prime1};
+		do {
+			for (int i = 0; i < 4; i++, p += 4)
+				v[i] = rotl32(v[i] + le32(p) * prime2, 13) * prime1;
+		} while (end - p >= 16);
+		h = rotl32(v[0], 1) + rotl32(v[1], 7) + rotl32(v[2], 12) +
+				rotl32(v[3], 18);
+	} else {
+		h = seed + prime5;
+	}
+	h += (uint32_t) size;
+
+	for (; end - p >= 4; p += 4)
+		h = rotl32(h + le32(p) * prime3, 17) * prime4;
+	for (; p < end; p++)
+		h = rotl32(h + *p * prime5, 11) * prime1;
+	h ^= h >> 15;
+	h *= prime2;
+	h ^= h >> 13;
+	h *= prime3;
+	h ^= h >> 16;
+	return h;
+}
+
+
+static void lz4Header(unsigned char *p, unsigned method, uint32_t packed,
+		uint32_t size, uint32_t check)
+{
+	std::memcpy(p, "LZ4Block", 8);
+	p[8] = method | lz4_level;
+	uint32_t fields[3] = {packed, size, check};
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 4; j++)
+			p[9 + i * 4 + j] = fields[i] >> (j * 8);
+}
+
+
+static size_t lz4Bound(size_t size)
+{
+	// Blocks that don't shrink are stored as they are
+	size_t blocks = (size + lz4_block_size - 1) / lz4_block_size;
+	return size + (blocks + 1) * lz4_header_size;
+}
+
+
+static bool lz4Compress(char *out, size_t capacity, size_t *written,
+		const char *in, size_t size)
+{
+	unsigned char *o = reinterpret_cast<unsigned char *>(out);
+	const unsigned char *i = reinterpret_cast<const unsigned char *>(in);
+	size_t pos = 0;
+	for (size_t done = 0; done < size; ) {
+		size_t n = std::min(lz4_block_size, size - done);
+		if (capacity - pos < lz4_header_size)
+			return false;
+		size_t room = capacity - pos - lz4_header_size;
+		unsigned char *block = o + pos + lz4_header_size;
+		int packed = LZ4_compress_default(in + done,
+				reinterpret_cast<char *>(block), n,
+				std::min(room, n - 1));
+		unsigned method = lz4_compressed;
+		if (packed <= 0) {
+			if (room < n)
+				return false;
+			std::memcpy(block, i + done, n);
+			packed = n;
+			method = lz4_raw;
+		}
+		lz4Header(o + pos, method, packed, n,
+				xxh32(i + done, n, lz4_seed) & 0x0FFFFFFF);
+		pos += lz4_header_size + packed;
+		done += n;
+	}
+	if (capacity - pos < lz4_header_size)
+		return false;
+	lz4Header(o + pos, lz4_raw, 0, 0, 0);
+	*written = pos + lz4_header_size;
+	return true;
+}
 
-		res = deflate(&strm, Z_FINISH);
 
-		if (res != Z_OK && res != Z_STREAM_END)
+// Decompresses the blocks into out, or with no out, only adds up their
+// sizes.
+static bool lz4Decompress(char *out, size_t capacity, size_t *written,
+		const char *in, size_t size, std::string &err)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(in);
+	const unsigned char *end = p + size;
+	size_t pos = 0;
+	while (true) {
+		if ((size_t) (end - p) < lz4_header_size) {
+			err = "LZ4 error: unexpected end of stream";
+			return false;
+		}
+		unsigned method = p[8] & 0xF0;
+		uint32_t packed = le32(p + 9);
+		uint32_t length = le32(p + 13);
+		uint32_t check = le32(p + 17);
+		if (std::memcmp(p, "LZ4Block", 8) != 0 ||
+				(method != lz4_raw && method != lz4_compressed) ||
+				length > 1U << (10 + (p[8] & 0x0F)) ||
+				(length == 0) != (packed == 0) ||
+				(method == lz4_raw && packed != length) ||
+				(length == 0 && check != 0)) {
+			err = "LZ4 error: invalid block header";
+			return false;
+		}
+		p += lz4_header_size;
+		if (length == 0)
 			break;
+		if ((size_t) (end - p) < packed) {
+			err = "LZ4 error: unexpected end of stream";
+			return false;
+		}
 
-		// avail_out is amount of *unused* space in next_out
-		size_t count = sizeof(temp_buffer) - strm.avail_out;
-		auto signed_buf = reinterpret_cast<const char *>(temp_buffer);
-		out->append(signed_buf, count);
-	} while (res == Z_OK);
+		if (out) {
+			if (capacity - pos < length) {
+				err = "Output buffer too small";
+				return false;
+			}
+			if (method == lz4_raw) {
+				std::memcpy(out + pos, p, length);
+			} else if (LZ4_decompress_safe(
+					reinterpret_cast<const char *>(p), out + pos,
+					packed, length) != (int) length) {
+				err = "LZ4 error: invalid block data";
+				return false;
+			}
+			if ((xxh32(reinterpret_cast<unsigned char *>(out + pos),
+					length, lz4_seed) & 0x0FFFFFFF) != check) {
+				err = "LZ4 error: incorrect checksum";
+				return false;
+			}
+		}
+		p += packed;
+		pos += length;
+	}
+	*written = pos;
+	return true;
+}
+#endif // NBT_HAVE_LZ4
 
-	if (res != Z_STREAM_END) {
-		*out = "Deflation error: ";
-		*out += zError(res);
+
+/**************
+ * Compressor *
+ **************/
+
+Compressor::Compressor(int level, CompressionFormat format) :
+	initialized(false),
+	finished(false),
+	level(level),
+	format(format),
+	deflater(nullptr),
+	deflater_level(0),
+	zstd(nullptr)
+{
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+}
+
+
+Compressor::~Compressor()
+{
+	if (initialized)
+		(void) deflateEnd(&strm);
+#ifdef NBT_HAVE_LIBDEFLATE
+	if (deflater)
+		libdeflate_free_compressor(
+				static_cast<libdeflate_compressor *>(deflater));
+#endif
+#ifdef NBT_HAVE_ZSTD
+	ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(zstd));
+#endif
+}
+
+
+bool Compressor::fail(const char *what, int res)
+{
+	err = what;
+	err += zError(res);
+	return false;
+}
+
+
+bool Compressor::streams() const
+{
+	return format == CompressionFormat::ZLib ||
+			format == CompressionFormat::GZip;
+}
+
+
+// Gets the stream ready for new input
+bool Compressor::begin()
+{
+	if (!compressionSupported(format))
+		return unsupported(err, format);
+	if (!streams()) {
+		if (finished)
+			pending.clear();
+		finished = false;
+		return true;
+	}
+
+	int res;
+	if (!initialized) {
+		if ((res = deflateInit2(&strm, level, Z_DEFLATED,
+				windowBits(format), 8, Z_DEFAULT_STRATEGY)) != Z_OK)
+			return fail("Error initializing stream: ", res);
+		initialized = true;
+	} else if (finished) {
+		if ((res = deflateReset(&strm)) != Z_OK)
+			return fail("Error resetting stream: ", res);
+	}
+	finished = false;
+	return true;
+}
+
+
+bool Compressor::reset()
+{
+	finished = true;
+	return begin();
+}
+
+
+bool Compressor::reset(int new_level, CompressionFormat new_format)
+{
+	if (initialized && new_format != format) {
+		// The window bits can't be changed without starting over
+		(void) deflateEnd(&strm);
+		initialized = false;
+	}
+	format = new_format;
+	if (!initialized)
+		level = new_level;  // Used when zlib is initialized, if ever
+	if (!reset())
+		return false;
+	if (new_level != level) {
+		int res;
+		if ((res = deflateParams(&strm, new_level, Z_DEFAULT_STRATEGY)) != Z_OK)
+			return fail("Error changing level: ", res);
+		level = new_level;
+	}
+	return true;
+}
+
+
+size_t Compressor::bound(size_t size)
+{
+#ifdef NBT_HAVE_ZSTD
+	if (format == CompressionFormat::Zstd)
+		return ZSTD_compressBound(size);
+#endif
+#ifdef NBT_HAVE_LZ4
+	if (format == CompressionFormat::LZ4)
+		return lz4Bound(size);
+#endif
+	if (!streams())
+		return 0;  // Not built in
+#ifdef NBT_HAVE_LIBDEFLATE
+	// Whole buffers go to libdeflate, whose bounds are a little looser
+	if (libdeflate_compressor *c = libdeflateCompressor(deflater,
+			deflater_level, level))
+		return format == CompressionFormat::GZip ?
+				libdeflate_gzip_compress_bound(c, size) :
+				libdeflate_zlib_compress_bound(c, size);
+#endif
+	if (!begin())
+		return compressBound(size) + 18;  // Worst case for either format
+	return deflateBound(&strm, size);
+}
+
+
+bool Compressor::write(const char *in, size_t size, const Sink &sink,
+		bool finish)
+{
+	if (!begin())
 		return false;
+
+	if (!streams()) {
+		if (size)
+			pending.append(in, size);
+		if (!finish)
+			return true;
+		std::string input;
+		input.swap(pending);
+		buf.resize(std::max(bound(input.size()), cmp_buf_size));
+		size_t written;
+		bool ok = compress(reinterpret_cast<char *>(buf.data()), buf.size(),
+				&written, input.data(), input.size());
+		input.clear();
+		pending.swap(input);  // Keeps its allocation for the next stream
+		if (!ok)
+			return false;
+		if (written && !sink(reinterpret_cast<const char *>(buf.data()),
+				written)) {
+			err = "Output rejected by sink";
+			return false;
+		}
+		return true;
 	}
 
-	(void) deflateEnd(&strm);
+	if (buf.empty())
+		buf.resize(cmp_buf_size);
 
+	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
+	strm.avail_in = size;
+	int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+	int res;
+
+	do {
+		strm.next_out = buf.data();
+		strm.avail_out = buf.size();
+
+		res = deflate(&strm, flush);
+		if (res == Z_STREAM_ERROR)
+			return fail("Deflation error: ", res);
+
+		// avail_out is amount of *unused* space in next_out
+		size_t count = buf.size() - strm.avail_out;
+		if (count && !sink(reinterpret_cast<const char *>(buf.data()), count)) {
+			err = "Output rejected by sink";
+			return false;
+		}
+	} while (strm.avail_out == 0 || (finish && res != Z_STREAM_END));
+
+	finished = finish;
 	return true;
 }
 
 
-bool decompress(std::string * out, const char * in, size_t size)
+bool Compressor::compress(char *out, size_t capacity, size_t *written,
+		const char *in, size_t size)
+{
+	if (!compressionSupported(format))
+		return unsupported(err, format);
+
+	// The other backends don't touch the zlib stream, but abandon it all
+	// the same
+	finished = true;
+	pending.clear();
+#ifdef NBT_HAVE_ZSTD
+	if (format == CompressionFormat::Zstd)
+		return zstdCompress(zstd, level, out, capacity, written, in, size,
+				err);
+#endif
+#ifdef NBT_HAVE_LZ4
+	if (format == CompressionFormat::LZ4) {
+		if (!lz4Compress(out, capacity, written, in, size)) {
+			err = "Output buffer too small";
+			return false;
+		}
+		return true;
+	}
+#endif
+#ifdef NBT_HAVE_LIBDEFLATE
+	if (libdeflate_compressor *c = libdeflateCompressor(deflater,
+			deflater_level, level)) {
+		*written = format == CompressionFormat::GZip ?
+				libdeflate_gzip_compress(c, in, size, out, capacity) :
+				libdeflate_zlib_compress(c, in, size, out, capacity);
+		if (!*written) {
+			err = "Output buffer too small";
+			return false;
+		}
+		return true;
+	}
+#endif
+
+	if (!reset())
+		return false;
+
+	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
+	strm.avail_in = size;
+	strm.next_out = reinterpret_cast<unsigned char *>(out);
+	strm.avail_out = capacity;
+
+	int res = deflate(&strm, Z_FINISH);
+	finished = true;
+	if (res != Z_STREAM_END) {
+		if (res == Z_OK || res == Z_BUF_ERROR)
+			err = "Output buffer too small";
+		else
+			fail("Deflation error: ", res);
+		return false;
+	}
+	*written = capacity - strm.avail_out;
+	return true;
+}
+
+
+bool Compressor::compress(std::string *out, const char *in, size_t size)
 {
-	int res = 0;
-	unsigned char temp_buffer[cmp_buf_size];
+	size_t start = out->size();
+	size_t written = 0;
+	out->resize(start + bound(size));
+	bool ok = compress(&(*out)[start], out->size() - start, &written,
+			in, size);
+	out->resize(start + written);
+	return ok;
+}
 
-	z_stream strm;
+
+/****************
+ * Decompressor *
+ ****************/
+
+Decompressor::Decompressor() :
+	initialized(false),
+	started(false),
+	done(false),
+	whole_pos(0),
+	pull_whole(false),
+	inflater(nullptr),
+	zstd(nullptr)
+{
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
 	strm.opaque = Z_NULL;
+	strm.next_in = Z_NULL;
+	strm.avail_in = 0;
+}
+
+
+Decompressor::~Decompressor()
+{
+	if (initialized)
+		(void) inflateEnd(&strm);
+#ifdef NBT_HAVE_LIBDEFLATE
+	if (inflater)
+		libdeflate_free_decompressor(
+				static_cast<libdeflate_decompressor *>(inflater));
+#endif
+#ifdef NBT_HAVE_ZSTD
+	ZSTD_freeDCtx(static_cast<ZSTD_DCtx *>(zstd));
+#endif
+}
+
+
+bool Decompressor::fail(const char *what, int res)
+{
+	err = what;
+	err += zError(res);
+	return false;
+}
+
+
+bool Decompressor::begin()
+{
+	int res;
+	if (!initialized) {
+		// Automatically detect ZLib or GZip headers
+		if ((res = inflateInit2(&strm, 15 + 32)) != Z_OK)
+			return fail("Error initializing stream: ", res);
+		initialized = true;
+	} else if ((res = inflateReset(&strm)) != Z_OK) {
+		return fail("Error resetting stream: ", res);
+	}
+	started = true;
+	done = false;
+	pull_whole = false;
+	return true;
+}
+
+
+bool Decompressor::reset()
+{
+	return begin();
+}
+
+
+bool Decompressor::write(const char *in, size_t size, const Sink &sink)
+{
+	if (done)
+		return true;
+	if (!started && !begin())
+		return false;
+	if (buf.empty())
+		buf.resize(cmp_buf_size);
+
 	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
 	strm.avail_in = size;
+	int res;
 
-	if ((res = inflateInit2(&strm, 15 + 32)) != Z_OK) {
-		*out = "Error initializing stream: ";
-		*out += zError(res);
+	do {
+		strm.next_out = buf.data();
+		strm.avail_out = buf.size();
+
+		res = inflate(&strm, Z_NO_FLUSH);
+		if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+			return fail("Inflation error: ", res);
+
+		size_t count = buf.size() - strm.avail_out;
+		if (count && !sink(reinterpret_cast<const char *>(buf.data()), count)) {
+			err = "Output rejected by sink";
+			return false;
+		}
+	} while (res != Z_STREAM_END && strm.avail_out == 0);
+
+	done = res == Z_STREAM_END;
+	return true;
+}
+
+
+bool Decompressor::start(const char *in, size_t size)
+{
+	err.clear();
+	CompressionFormat format = detect(in, size);
+	if (format != CompressionFormat::ZLib && format != CompressionFormat::GZip) {
+		// Handed out from a buffer by read()
+		whole.clear();
+		whole_pos = 0;
+		if (!decompress(&whole, in, size))
+			return false;
+		started = pull_whole = true;
+		done = whole.empty();
+		return true;
+	}
+	if (!reset())
 		return false;
+	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
+	strm.avail_in = size;
+	return true;
+}
+
+
+size_t Decompressor::read(char *out, size_t size)
+{
+	if (done || !started)
+		return 0;
+
+	if (pull_whole) {
+		size = std::min(size, whole.size() - whole_pos);
+		std::memcpy(out, &whole[whole_pos], size);
+		whole_pos += size;
+		if (whole_pos == whole.size()) {
+			done = true;
+			started = false;
+		}
+		return size;
 	}
 
-	do {
-		strm.next_out = temp_buffer;
-		strm.avail_out = sizeof(temp_buffer);
+	strm.next_out = reinterpret_cast<unsigned char *>(out);
+	strm.avail_out = size;
 
+	// Inflate can consume input (such as the header) without producing
+	// anything, which mustn't look like the end of the stream.
+	int res;
+	do {
 		res = inflate(&strm, Z_NO_FLUSH);
+	} while (res == Z_OK && strm.avail_out == size);
+
+	if (res == Z_STREAM_END) {
+		done = true;
+		started = false;
+	} else if (res == Z_BUF_ERROR && strm.avail_out == size) {
+		err = "Inflation error: unexpected end of stream";
+		started = false;
+	} else if (res != Z_OK && res != Z_BUF_ERROR) {
+		fail("Inflation error: ", res);
+		started = false;
+		return 0;
+	}
+	return size - strm.avail_out;
+}
+
+
+bool Decompressor::decompress(char *out, size_t capacity, size_t *written,
+		const char *in, size_t size)
+{
+	CompressionFormat format = detect(in, size);
+	if (!compressionSupported(format))
+		return unsupported(err, format);
+
+	// Any stream in progress is abandoned
+	started = done = pull_whole = false;
+#ifdef NBT_HAVE_ZSTD
+	if (format == CompressionFormat::Zstd)
+		return zstdDecompress(zstd, out, capacity, written, in, size, err);
+#endif
+#ifdef NBT_HAVE_LZ4
+	if (format == CompressionFormat::LZ4)
+		return lz4Decompress(out, capacity, written, in, size, err);
+#endif
+#ifdef NBT_HAVE_LIBDEFLATE
+	if (libdeflate_decompressor *d = libdeflateDecompressor(inflater)) {
+		libdeflate_result res = libdeflateDecompress(d, format, out,
+				capacity, written, in, size);
+		return res == LIBDEFLATE_SUCCESS || libdeflateError(err, res);
+	}
+#endif
+
+	if (!reset())
+		return false;
+
+	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
+	strm.avail_in = size;
+	strm.next_out = reinterpret_cast<unsigned char *>(out);
+	strm.avail_out = capacity;
+
+	int res = inflate(&strm, Z_FINISH);
+	started = false;
+	*written = capacity - strm.avail_out;
+	if (res == Z_STREAM_END)
+		return true;
+	if (res == Z_BUF_ERROR && strm.avail_out == 0)
+		err = "Output buffer too small";
+	else if (res == Z_BUF_ERROR)
+		err = "Inflation error: unexpected end of stream";
+	else
+		fail("Inflation error: ", res);
+	return false;
+}
 
-		if (res != Z_OK && res != Z_STREAM_END)
+
+bool Decompressor::decompress(std::string *out, const char *in, size_t size,
+		size_t size_hint)
+{
+	CompressionFormat format = detect(in, size);
+	if (!compressionSupported(format))
+		return unsupported(err, format);
+
+	started = done = pull_whole = false;
+	size_t start = out->size();
+#ifdef NBT_HAVE_ZSTD
+	if (format == CompressionFormat::Zstd)
+		return zstdDecompress(zstd, out, in, size, size_hint, err);
+#endif
+#ifdef NBT_HAVE_LZ4
+	if (format == CompressionFormat::LZ4) {
+		// The block headers give the exact size
+		size_t written;
+		if (!lz4Decompress(nullptr, 0, &written, in, size, err))
+			return false;
+		out->resize(start + written);
+		bool ok = lz4Decompress(&(*out)[start], written, &written, in, size,
+				err);
+		if (!ok)
+			out->resize(start);
+		return ok;
+	}
+#endif
+#ifdef NBT_HAVE_LIBDEFLATE
+	if (libdeflate_decompressor *d = libdeflateDecompressor(inflater)) {
+		// Whole buffers only, so retry in a bigger one until it fits.
+		// GZip records the size (mod 2^32) in its trailer.
+		if (!size_hint && format == CompressionFormat::GZip && size >= 18) {
+			const unsigned char *p =
+					reinterpret_cast<const unsigned char *>(in) + size - 4;
+			size_hint = p[0] | p[1] << 8 | p[2] << 16 | (size_t) p[3] << 24;
+		}
+		// Deflate can't expand data more than 1032 times
+		size_t limit = size * 1032 + 64;
+		size_t written;
+		size_t capacity = size_hint && size_hint <= limit ?
+				size_hint : std::min(size * 4 + 64, limit);
+		libdeflate_result res;
+		while (true) {
+			out->resize(start + capacity);
+			res = libdeflateDecompress(d, format, &(*out)[start], capacity,
+					&written, in, size);
+			if (res != LIBDEFLATE_INSUFFICIENT_SPACE || capacity == limit)
+				break;
+			capacity = std::min(capacity * 2, limit);
+		}
+		if (res != LIBDEFLATE_SUCCESS) {
+			out->resize(start);
+			return libdeflateError(err, res == LIBDEFLATE_INSUFFICIENT_SPACE ?
+					LIBDEFLATE_BAD_DATA : res);
+		}
+		out->resize(start + written);
+		return true;
+	}
+#endif
+
+	if (!reset())
+		return false;
+
+	// Inflate straight into out, growing it geometrically
+	size_t pos = start;
+	out->resize(start + (size_hint ? size_hint : size * 4 + 64));
+
+	strm.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(in));
+	strm.avail_in = size;
+	int res;
+
+	do {
+		if (pos == out->size())
+			out->resize(start + (out->size() - start) * 2);
+		strm.next_out = reinterpret_cast<unsigned char *>(&(*out)[pos]);
+		strm.avail_out = out->size() - pos;
+
+		res = inflate(&strm, Z_NO_FLUSH);
+		pos = out->size() - strm.avail_out;
+		if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
 			break;
+		if (res == Z_BUF_ERROR && strm.avail_out != 0)
+			break;  // Out of input
+	} while (res != Z_STREAM_END);
 
-		// avail_out is amount of *unused* space in next_out
-		size_t count = sizeof(temp_buffer) - strm.avail_out;
-		auto signed_buf = reinterpret_cast<const char *>(temp_buffer);
-		out->append(signed_buf, count);
-	} while (res == Z_OK);
+	started = false;
+	out->resize(pos);
+	if (res == Z_STREAM_END)
+		return true;
+	if (res == Z_BUF_ERROR)
+		err = "Inflation error: unexpected end of stream";
+	else
+		fail("Inflation error: ", res);
+	return false;
+}
 
-	if (res != Z_STREAM_END) {
-		*out = "Inflation error: ";
-		*out += zError(res);
+
+bool InflateSource::finish()
+{
+	if (!started)
+		return false;
+	char rest[256];
+	while (d.read(rest, sizeof(rest)))
+		;
+	return d.finished();
+}
+
+
+/***********
+ * Helpers *
+ ***********/
+
+bool compress(std::string * out, const char * in, size_t size, int level,
+		CompressionFormat format)
+{
+	Compressor c(level, format);
+	if (!c.compress(out, in, size)) {
+		*out = c.error();
 		return false;
 	}
+	return true;
+}
 
-	(void) inflateEnd(&strm);
 
+bool decompress(std::string * out, const char * in, size_t size)
+{
+	Decompressor d;
+	if (!d.decompress(out, in, size)) {
+		*out = d.error();
+		return false;
+	}
 	return true;
 }
 
 } // namespace NBT
-
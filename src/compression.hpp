@@ -2,12 +2,168 @@
 #define NBT_COMPRESSION_HEADER
 
 #include <string>
+#include <vector>
+#include <functional>
 #include <zlib.h>
 
+#include "reader.hpp"
+
 namespace NBT {
 
-enum class CompressionFormat {ZLib, GZip};
+// ZLib and GZip are always available, and use libdeflate for whole buffers
+// when it's built in.  Zstd and LZ4 need their libraries.  LZ4 is the block
+// stream of lz4-java, which Minecraft uses for chunks (region compression
+// type 4), rather than the LZ4 frame format.
+enum class CompressionFormat {ZLib, GZip, Zstd, LZ4};
+
+// Whether this build can use the format
+extern bool compressionSupported(CompressionFormat format);
+
+// Receives output as it's produced.  Returning false aborts the operation.
+typedef std::function<bool(const char *data, size_t size)> Sink;
+
+
+// Stateful compression context.  The library's state is allocated on first
+// use and kept across streams, so compressing many small buffers with one
+// object only pays for initialization once.  A new stream starts
+// automatically after the previous one is finished, or explicitly with
+// reset().  Levels are zlib's; Zstd takes its own, and LZ4 ignores them.
+class Compressor {
+public:
+	Compressor(int level = Z_DEFAULT_COMPRESSION,
+			CompressionFormat format = CompressionFormat::ZLib);
+	Compressor(const Compressor &) = delete;
+	Compressor & operator = (const Compressor &) = delete;
+	~Compressor();
+
+	// Abandons the current stream, optionally changing the settings
+	bool reset();
+	bool reset(int level, CompressionFormat format);
+
+	// Upper bound of the compressed size of size bytes of input
+	size_t bound(size_t size);
+
+	// Streaming: feed input, possibly in several pieces, and pass
+	// finish on the last one.  Output is handed to the sink.  Only ZLib
+	// and GZip really stream; other formats collect the input and
+	// compress it all on finish.
+	bool write(const char *in, size_t size, const Sink &sink,
+			bool finish = false);
+	bool finish(const Sink &sink) { return write(nullptr, 0, sink, true); }
+
+	// Compress a whole buffer into a caller-supplied buffer, which must
+	// be big enough (see bound()).
+	bool compress(char *out, size_t capacity, size_t *written,
+			const char *in, size_t size);
+	// Compress a whole buffer, appending to out.
+	bool compress(std::string *out, const char *in, size_t size);
+
+	const std::string &error() const { return err; }
+
+private:
+	bool begin();
+	bool fail(const char *what, int res);
+	bool streams() const;
+
+	z_stream strm;
+	bool initialized;
+	bool finished;
+	int level;
+	CompressionFormat format;
+	std::vector<unsigned char> buf;
+	std::string pending;  // Streamed input for formats that don't stream
+	// The optional libraries' contexts, allocated on first use
+	void *deflater;
+	int deflater_level;
+	void *zstd;
+	std::string err;
+};
+
+
+// Stateful decompression context.  The format of whole buffers is
+// detected automatically; streamed input must be ZLib or GZip.  Like
+// Compressor, it keeps its libraries' state across streams.
+class Decompressor {
+public:
+	Decompressor();
+	Decompressor(const Decompressor &) = delete;
+	Decompressor & operator = (const Decompressor &) = delete;
+	~Decompressor();
+
+	bool reset();
 
+	// Streaming: feed compressed input in any number of pieces.
+	// Output is handed to the sink.  Input after the end of the stream
+	// is ignored until reset().
+	bool write(const char *in, size_t size, const Sink &sink);
+	// Whether the end of the stream has been reached
+	bool finished() const { return done; }
+
+	// Pull-style, for a stream whose compressed data is all in memory:
+	// start() sets the input, then each read() decompresses up to size
+	// bytes into out, and returns how many.  It returns 0 at the end of
+	// the stream, and on errors, which also set error().  Formats other
+	// than ZLib and GZip are decompressed whole by start().
+	bool start(const char *in, size_t size);
+	size_t read(char *out, size_t size);
+
+	// Decompress a whole stream into a caller-supplied buffer, such as
+	// one sized from a known uncompressed length.
+	bool decompress(char *out, size_t capacity, size_t *written,
+			const char *in, size_t size);
+	// Decompress a whole stream, appending to out.  size_hint is the
+	// expected uncompressed size, if known.
+	bool decompress(std::string *out, const char *in, size_t size,
+			size_t size_hint = 0);
+
+	const std::string &error() const { return err; }
+
+private:
+	bool begin();
+	bool fail(const char *what, int res);
+
+	z_stream strm;
+	bool initialized;
+	bool started;  // A stream is in progress
+	bool done;  // The end of the stream has been reached
+	std::vector<unsigned char> buf;
+	// Output of a pull-style stream that start() decompressed whole
+	std::string whole;
+	size_t whole_pos;
+	bool pull_whole;
+	// The optional libraries' contexts, allocated on first use
+	void *inflater;
+	void *zstd;
+	std::string err;
+};
+
+
+// Feeds a Decompressor's output straight to a stream read, such as
+// Tag::read(Source &), so that parsing overlaps decompression and the
+// whole uncompressed data is never held in memory.
+class InflateSource : public Source {
+public:
+	InflateSource(Decompressor &d, const char *in, size_t size) : d(d)
+		{ started = d.start(in, size); }
+
+	// Whether the stream could be started.  If not, reads give nothing,
+	// and the reason is in the decompressor's error().
+	bool ok() const { return started; }
+
+	size_t read(UByte *buf, size_t size) override
+		{ return started ? d.read(reinterpret_cast<char *>(buf), size) : 0; }
+
+	// Decompresses whatever the read left, so that the stream's checksum
+	// is verified.  Returns whether the stream ended cleanly.
+	bool finish();
+
+private:
+	Decompressor &d;
+	bool started;
+};
+
+
+// One-shot helpers.  On failure, out is replaced with an error message.
 extern bool compress(std::string * out, const char * in, size_t size,
 		int level = Z_DEFAULT_COMPRESSION,
 		CompressionFormat format = CompressionFormat::ZLib);
@@ -16,4 +172,3 @@ extern bool decompress(std::string * out, const char * in, size_t size);
 } // namespace NBT
 
 #endif // NBT_COMPRESSION_HEADER
-
@@ -0,0 +1,721 @@
+
+#include <cstring>
+#include <algorithm>
+
+#include "diff.hpp"
+#include "serialization.hpp"
+
+namespace NBT {
+
+/**********
+ * Hashes *
+ **********/
+
+static const ULong hash_multiplier = 0x9E3779B97F4A7C15ULL;
+
+// MurmurHash3's finalizer
+static ULong mix(ULong h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+
+// Four independent lanes, so that long arrays hash at memory speed
+static ULong hashBytes(const void *data, size_t size, ULong seed)
+{
+	const UByte *p = static_cast<const UByte *>(data);
+	ULong lanes[4] = {seed, seed + 1, seed + 2, seed + 3};
+	size_t left = size;
+	ULong w;
+	for (; left >= 32; left -= 32, p += 32) {
+		for (int i = 0; i < 4; i++) {
+			memcpy(&w, p + i * 8, 8);
+			lanes[i] = (lanes[i] ^ w) * hash_multiplier;
+			lanes[i] ^= lanes[i] >> 29;
+		}
+	}
+	ULong h = mix(lanes[0]) ^ mix(lanes[1] + 1) ^ mix(lanes[2] + 2) ^
+			mix(lanes[3] + 3);
+	for (; left >= 8; left -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		h = mix(h ^ w);
+	}
+	if (left) {
+		w = 0;
+		memcpy(&w, p, left);
+		h = mix(h ^ w ^ ((ULong) left << 56));
+	}
+	return mix(h ^ size);
+}
+
+
+static ULong typeSeed(TagType type, TagType item = TagType::End)
+{
+	return mix(((ULong) type << 8 | (ULong) item) * hash_multiplier);
+}
+
+
+static void scalarBytes(const Tag &t, UByte *p)
+{
+	switch (t.type) {
+	case TagType::Byte: { Byte x = t; memcpy(p, &x, sizeof(x)); break; }
+	case TagType::Short: { Short x = t; memcpy(p, &x, sizeof(x)); break; }
+	case TagType::Int: { Int x = t; memcpy(p, &x, sizeof(x)); break; }
+	case TagType::Long: { Long x = t; memcpy(p, &x, sizeof(x)); break; }
+	case TagType::Float: { float x = t; memcpy(p, &x, sizeof(x)); break; }
+	case TagType::Double: { double x = t; memcpy(p, &x, sizeof(x)); break; }
+	default: break;
+	}
+}
+
+
+// The items of a scalar List as a native array.  Packing would modify the
+// tree, so a list of Tags is copied into scratch instead.
+static const UByte *listBytes(const Tag &t, std::vector<UByte> &scratch)
+{
+	if (!t.packed()) {
+		List l = t;
+		UInt size = Tag::itemSize(l.tagid);
+		scratch.resize((size_t) l.size * size);
+		for (UInt i = 0; i < l.size; i++)
+			scalarBytes(l.value[i], &scratch[(size_t) i * size]);
+		return scratch.data();
+	}
+	switch (t.listType()) {
+	case TagType::Byte: return (const UByte *) t.span<Byte>().data;
+	case TagType::Short: return (const UByte *) t.span<Short>().data;
+	case TagType::Int: return (const UByte *) t.span<Int>().data;
+	case TagType::Long: return (const UByte *) t.span<Long>().data;
+	case TagType::Float: return (const UByte *) t.span<float>().data;
+	case TagType::Double: return (const UByte *) t.span<double>().data;
+	default: return nullptr;
+	}
+}
+
+
+static UInt arrayItemSize(TagType type)
+{
+	switch (type) {
+	case TagType::ByteArray: return sizeof(Byte);
+	case TagType::IntArray: return sizeof(Int);
+	case TagType::LongArray: return sizeof(Long);
+	default: return 0;
+	}
+}
+
+
+// The elements of an array, in host byte order
+static UByte *arrayData(const Tag &t, UInt *size)
+{
+	switch (t.type) {
+	case TagType::ByteArray: {
+		ByteArray a = t;
+		*size = a.size;
+		return (UByte *) a.value;
+	}
+	case TagType::IntArray: {
+		IntArray a = t;
+		*size = a.size;
+		return (UByte *) a.value;
+	}
+	case TagType::LongArray: {
+		LongArray a = t;
+		*size = a.size;
+		return (UByte *) a.value;
+	}
+	default:
+		*size = 0;
+		return nullptr;
+	}
+}
+
+
+// Children are hashed through the cache, if there is one
+static ULong hashValue(const Tag &t, HashCache *cache)
+{
+	ULong seed = typeSeed(t.type);
+	ULong bits = 0;
+	UInt size;
+	switch (t.type) {
+	case TagType::End:
+		return seed;
+	case TagType::Byte: bits = (UByte) t.as<Byte>(); break;
+	case TagType::Short: bits = (UShort) t.as<Short>(); break;
+	case TagType::Int: bits = (UInt) t.as<Int>(); break;
+	case TagType::Long: bits = (ULong) t.as<Long>(); break;
+	case TagType::Float: {
+		float x = t;
+		UInt i;
+		memcpy(&i, &x, sizeof(i));
+		bits = i;
+		break;
+	}
+	case TagType::Double: {
+		double x = t;
+		memcpy(&bits, &x, sizeof(bits));
+		break;
+	}
+	case TagType::String: {
+		String s = t;
+		return hashBytes(s.value, s.size, seed);
+	}
+	case TagType::ByteArray:
+	case TagType::IntArray:
+	case TagType::LongArray: {
+		const UByte *data = arrayData(t, &size);
+		return hashBytes(data, (size_t) size * arrayItemSize(t.type), seed);
+	}
+	case TagType::List: {
+		TagType item = t.listType();
+		seed = typeSeed(t.type, item);
+		size = t.listSize();
+		// Read from disk, even an empty List is packed
+		if (!size)
+			return mix(seed);
+		if (Tag::itemSize(item)) {
+			std::vector<UByte> scratch;
+			return hashBytes(listBytes(t, scratch),
+					(size_t) size * Tag::itemSize(item), seed);
+		}
+		List list = t;
+		ULong h = seed;
+		for (UInt i = 0; i < list.size; i++)
+			h = mix(h ^ (cache ? cache->hash(list.value[i]) :
+					hashValue(list.value[i], nullptr)));
+		return mix(h ^ size);
+	}
+	case TagType::Compound: {
+		// A sum, so that the order of the entries doesn't matter
+		const Compound &c = t;
+		ULong sum = 0;
+		for (const Compound::Entry &e : c) {
+			ULong key = hashBytes(e.first.data(), e.first.size(), seed);
+			sum += mix(key * hash_multiplier ^ (cache ?
+					cache->hash(e.second) : hashValue(e.second, nullptr)));
+		}
+		return mix(sum ^ c.size() ^ seed);
+	}
+	}
+	return mix(seed ^ bits);
+}
+
+
+ULong structuralHash(const Tag &t)
+{
+	return hashValue(t, nullptr);
+}
+
+
+ULong HashCache::hash(const Tag &t)
+{
+	// Scalars and strings are cheaper to hash than to look up
+	if (t.type < TagType::ByteArray || t.type == TagType::String)
+		return hashValue(t, this);
+	auto it = hashes.find(&t);
+	if (it != hashes.end())
+		return it->second;
+	ULong h = hashValue(t, this);
+	hashes[&t] = h;
+	return h;
+}
+
+
+/********
+ * Diff *
+ ********/
+
+// Equal elements between two changed runs of an array that still get
+// merged into one write, since each write has some overhead.
+static const UInt write_gap = 16;
+
+
+// Index of the first element from i on that differs, or n
+static UInt nextDiff(const UByte *a, const UByte *b, UInt i, UInt n,
+		UInt size)
+{
+	const UInt block = 256 / size;
+	while (i + block <= n && !memcmp(a + (size_t) i * size,
+			b + (size_t) i * size, (size_t) block * size))
+		i += block;
+	while (i < n && !memcmp(a + (size_t) i * size, b + (size_t) i * size, size))
+		i++;
+	return i;
+}
+
+
+// Index of the first element from i on that's equal, or n
+static UInt nextSame(const UByte *a, const UByte *b, UInt i, UInt n,
+		UInt size)
+{
+	while (i < n && memcmp(a + (size_t) i * size, b + (size_t) i * size, size))
+		i++;
+	return i;
+}
+
+
+static Tag scalarItem(TagType type, const UByte *p)
+{
+	switch (type) {
+	case TagType::Byte: { Byte x; memcpy(&x, p, sizeof(x)); return Tag(x); }
+	case TagType::Short: { Short x; memcpy(&x, p, sizeof(x)); return Tag(x); }
+	case TagType::Int: { Int x; memcpy(&x, p, sizeof(x)); return Tag(x); }
+	case TagType::Long: { Long x; memcpy(&x, p, sizeof(x)); return Tag(x); }
+	case TagType::Float: { float x; memcpy(&x, p, sizeof(x)); return Tag(x); }
+	case TagType::Double: { double x; memcpy(&x, p, sizeof(x)); return Tag(x); }
+	default: return Tag();
+	}
+}
+
+
+namespace {
+
+class Differ {
+public:
+	Differ(Patch &patch, HashCache &from, HashCache &to) :
+		patch(patch), from(from), to(to)
+	{}
+
+	void value(const Tag &a, const Tag &b)
+	{
+		if (a.type != b.type) {
+			set(b);
+			return;
+		}
+		if (from.hash(a) == to.hash(b))
+			return;
+		switch (a.type) {
+		case TagType::Compound: compound(a, b); break;
+		case TagType::List: list(a, b); break;
+		case TagType::ByteArray:
+		case TagType::IntArray:
+		case TagType::LongArray: array(a, b); break;
+		default: set(b);
+		}
+	}
+
+private:
+	PatchEntry &add(PatchOp op, UInt start = 0, UInt count = 0)
+	{
+		patch.entries.emplace_back();
+		PatchEntry &e = patch.entries.back();
+		e.op = op;
+		e.path = path;
+		e.start = start;
+		e.count = count;
+		return e;
+	}
+
+	void set(const Tag &b) { add(PatchOp::Set).value = b; }
+
+	void compound(const Tag &a, const Tag &b);
+	void list(const Tag &a, const Tag &b);
+	void array(const Tag &a, const Tag &b);
+
+	Patch &patch;
+	HashCache &from;
+	HashCache &to;
+	std::vector<PathStep> path;
+};
+
+
+// Removals come first; they don't move anything else
+void Differ::compound(const Tag &a, const Tag &b)
+{
+	const Compound &ca = a, &cb = b;
+	for (const Compound::Entry &e : ca) {
+		if (cb.find(e.first) == cb.end()) {
+			path.push_back(PathStep{false, e.first, 0});
+			add(PatchOp::Remove);
+			path.pop_back();
+		}
+	}
+	for (const Compound::Entry &e : cb) {
+		path.push_back(PathStep{false, e.first, 0});
+		Compound::const_iterator it = ca.find(e.first);
+		if (it == ca.end())
+			set(e.second);
+		else
+			value(it->second, e.second);
+		path.pop_back();
+	}
+}
+
+
+// The common prefix and suffix are kept.  If the lengths match, the
+// items in between are diffed one by one, otherwise they're spliced.
+void Differ::list(const Tag &a, const Tag &b)
+{
+	UInt na = a.listSize(), nb = b.listSize();
+	TagType type = b.listType();
+	if (!na || !nb || a.listType() != type) {
+		set(b);
+		return;
+	}
+
+	UInt n = std::min(na, nb), pre = 0, post = 0;
+	UInt size = Tag::itemSize(type);
+	if (size) {
+		std::vector<UByte> sa, sb;
+		const UByte *pa = listBytes(a, sa), *pb = listBytes(b, sb);
+		pre = nextDiff(pa, pb, 0, n, size);
+		while (post < n - pre && !memcmp(pa + (size_t) (na - post - 1) * size,
+				pb + (size_t) (nb - post - 1) * size, size))
+			post++;
+		Tag items(TagType::List, 0, type);
+		for (UInt i = pre; i < nb - post; i++)
+			items += scalarItem(type, pb + (size_t) i * size);
+		add(PatchOp::Splice, pre, na - pre - post).value = std::move(items);
+		return;
+	}
+
+	List la = a, lb = b;
+	auto same = [&] (UInt i, UInt j) {
+		return from.hash(la.value[i]) == to.hash(lb.value[j]);
+	};
+	while (pre < n && same(pre, pre))
+		pre++;
+	while (post < n - pre && same(na - post - 1, nb - post - 1))
+		post++;
+	if (na == nb) {
+		for (UInt i = pre; i < na - post; i++) {
+			path.push_back(PathStep{true, Key(), i});
+			value(la.value[i], lb.value[i]);
+			path.pop_back();
+		}
+		return;
+	}
+	Tag items(TagType::List, 0, type);
+	items.reserve(nb - post - pre);
+	for (UInt i = pre; i < nb - post; i++)
+		items += lb.value[i];
+	add(PatchOp::Splice, pre, na - pre - post).value = std::move(items);
+}
+
+
+// Writes each run of changed elements, after resizing to the new size
+void Differ::array(const Tag &a, const Tag &b)
+{
+	UInt na, nb, size = arrayItemSize(a.type);
+	const UByte *pa = arrayData(a, &na), *pb = arrayData(b, &nb);
+	UInt n = std::min(na, nb);
+	std::vector<std::pair<UInt, UInt>> runs;
+	UInt i = nextDiff(pa, pb, 0, n, size);
+	while (i < n) {
+		UInt start = i, end = nextSame(pa, pb, i, n, size);
+		i = n;
+		while (end < n) {
+			UInt next = nextDiff(pa, pb, end, n, size);
+			if (next - end >= write_gap) {
+				i = next;
+				break;
+			}
+			end = nextSame(pa, pb, next, n, size);
+		}
+		runs.push_back(std::make_pair(start, end));
+	}
+	if (nb > n) {
+		if (!runs.empty() && n - runs.back().second < write_gap)
+			runs.back().second = nb;
+		else
+			runs.push_back(std::make_pair(n, nb));
+	} else if (runs.empty()) {
+		// Only shrunk
+		runs.push_back(std::make_pair(nb, nb));
+	}
+
+	for (const std::pair<UInt, UInt> &run : runs) {
+		PatchEntry &e = add(PatchOp::Write, run.first, nb);
+		UInt len = run.second - run.first, ignored;
+		e.value.setTag(a.type, len);
+		if (len)
+			memcpy(arrayData(e.value, &ignored), pb + (size_t) run.first * size,
+					(size_t) len * size);
+	}
+}
+
+} // namespace
+
+
+Patch diff(const Tag &from, const Tag &to, HashCache *from_hashes,
+		HashCache *to_hashes)
+{
+	HashCache from_local, to_local;
+	Patch patch;
+	Differ differ(patch, from_hashes ? *from_hashes : from_local,
+			to_hashes ? *to_hashes : to_local);
+	differ.value(from, to);
+	return patch;
+}
+
+
+/************
+ * Applying *
+ ************/
+
+// Follows the first n steps of a path, or returns nullptr if they don't
+// exist in the tree.
+static Tag *resolve(Tag &root, const std::vector<PathStep> &path, size_t n)
+{
+	Tag *t = &root;
+	for (size_t i = 0; i < n; i++) {
+		const PathStep &step = path[i];
+		if (step.item) {
+			if (t->type != TagType::List || step.index >= t->listSize())
+				return nullptr;
+			t = &(*t)[(Int) step.index];
+		} else {
+			if (t->type != TagType::Compound)
+				return nullptr;
+			Compound &c = *t;
+			Compound::iterator it = c.find(step.key);
+			if (it == c.end())
+				return nullptr;
+			t = &it->second;
+		}
+	}
+	return t;
+}
+
+
+static bool applySet(Tag &root, const PatchEntry &e)
+{
+	if (e.path.empty()) {
+		root = e.value;
+		return true;
+	}
+	Tag *parent = resolve(root, e.path, e.path.size() - 1);
+	const PathStep &last = e.path.back();
+	if (!parent)
+		return false;
+	if (last.item) {
+		if (parent->type != TagType::List || last.index >= parent->listSize() ||
+				parent->listType() != e.value.type)
+			return false;
+		(*parent)[(Int) last.index] = e.value;
+	} else {
+		if (parent->type != TagType::Compound)
+			return false;
+		static_cast<Compound &>(*parent)[last.key] = e.value;
+	}
+	return true;
+}
+
+
+static bool applyRemove(Tag &root, const PatchEntry &e)
+{
+	if (e.path.empty() || e.path.back().item)
+		return false;
+	Tag *parent = resolve(root, e.path, e.path.size() - 1);
+	if (!parent || parent->type != TagType::Compound)
+		return false;
+	Compound &c = *parent;
+	Compound::iterator it = c.find(e.path.back().key);
+	if (it == c.end())
+		return false;
+	c.erase(it);
+	return true;
+}
+
+
+static bool applySplice(Tag &root, const PatchEntry &e)
+{
+	Tag *t = resolve(root, e.path, e.path.size());
+	if (!t || t->type != TagType::List || e.value.type != TagType::List)
+		return false;
+	UInt size = t->listSize(), added = e.value.listSize();
+	if (e.start > size || e.count > size - e.start)
+		return false;
+	TagType type = t->listType();
+	if (added) {
+		if (size - e.count && e.value.listType() != type)
+			return false;
+		type = e.value.listType();
+	}
+
+	// The patch is shared, and may be applied from several threads, so
+	// its items are copied without unpacking them
+	List items = *t;
+	Tag result(TagType::List, 0, type);
+	result.reserve(size - e.count + added);
+	for (UInt i = 0; i < e.start; i++)
+		result += std::move(items.value[i]);
+	for (UInt i = 0; i < added; i++)
+		result += e.value.listItem(i);
+	for (UInt i = e.start + e.count; i < size; i++)
+		result += std::move(items.value[i]);
+	*t = std::move(result);
+	return true;
+}
+
+
+static bool applyWrite(Tag &root, const PatchEntry &e)
+{
+	Tag *t = resolve(root, e.path, e.path.size());
+	UInt item = arrayItemSize(e.value.type);
+	if (!t || !item || t->type != e.value.type)
+		return false;
+	UInt size, len;
+	const UByte *src = arrayData(e.value, &len);
+	if (e.start > e.count || len > e.count - e.start)
+		return false;
+
+	const UByte *old = arrayData(*t, &size);
+	if (size != e.count) {
+		Tag resized(t->type, e.count);
+		UInt ignored;
+		UByte *dst = arrayData(resized, &ignored);
+		if (e.count) {
+			UInt kept = std::min(size, e.count);
+			if (kept)
+				memcpy(dst, old, (size_t) kept * item);
+			memset(dst + (size_t) kept * item, 0, (size_t) (e.count - kept) * item);
+		}
+		*t = std::move(resized);
+	} else {
+		t->detach();
+	}
+	if (len)
+		memcpy(arrayData(*t, &size) + (size_t) e.start * item, src,
+				(size_t) len * item);
+	return true;
+}
+
+
+bool Patch::apply(Tag &root) const
+{
+	for (const PatchEntry &e : entries) {
+		bool ok = false;
+		switch (e.op) {
+		case PatchOp::Set: ok = applySet(root, e); break;
+		case PatchOp::Remove: ok = applyRemove(root, e); break;
+		case PatchOp::Splice: ok = applySplice(root, e); break;
+		case PatchOp::Write: ok = applyWrite(root, e); break;
+		}
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+
+/*****************
+ * Serialization *
+ *****************/
+
+/* Patch format:
+ *   UInt entry_count
+ *   entries[entry_count]:
+ *     PatchOp op
+ *     UInt path_length
+ *     steps[path_length]:
+ *       Byte item
+ *       UInt index, or UShort keylen + char key[keylen]
+ *     UInt start, UInt count (Splice and Write only)
+ *     TagType valtype + Tag value (all but Remove)
+ */
+
+std::string Patch::write() const
+{
+	std::string out;
+	write(out);
+	return out;
+}
+
+
+void Patch::write(std::string &out) const
+{
+	appendInt(out, entries.size());
+	for (const PatchEntry &e : entries) {
+		appendByte(out, (UByte) e.op);
+		appendInt(out, e.path.size());
+		for (const PathStep &step : e.path) {
+			appendByte(out, step.item);
+			if (step.item)
+				appendInt(out, step.index);
+			else
+				appendString(out, step.key.data(), step.key.size());
+		}
+		if (e.op == PatchOp::Splice || e.op == PatchOp::Write) {
+			appendInt(out, e.start);
+			appendInt(out, e.count);
+		}
+		if (e.op != PatchOp::Remove)
+			e.value.write(out, true);
+	}
+}
+
+
+ReadResult Patch::read(const UByte *bytes, size_t len, const ReadOptions &opts)
+{
+	entries.clear();
+	ReadContext ctx(bytes, len, opts);
+	try {
+		ctx.need(sizeof(UInt));
+		UInt count = readInt(bytes);
+		ctx.index += sizeof(UInt);
+		ctx.account(count, sizeof(PatchEntry));
+		for (UInt i = 0; i < count; i++) {
+			entries.emplace_back();
+			PatchEntry &e = entries.back();
+			ctx.need(sizeof(UByte) + sizeof(UInt));
+			e.op = (PatchOp) bytes[ctx.index];
+			if (e.op > PatchOp::Write)
+				ctx.fail(ReadError::InvalidType);
+			UInt steps = readInt(bytes + ctx.index + sizeof(UByte));
+			ctx.index += sizeof(UByte) + sizeof(UInt);
+			// Each step takes at least a flag and a key length
+			if (steps > ctx.left() / (sizeof(Byte) + sizeof(UShort)))
+				ctx.fail(ReadError::Truncated);
+			ctx.account(steps, sizeof(PathStep));
+
+			for (UInt j = 0; j < steps; j++) {
+				PathStep step{false, Key(), 0};
+				ctx.need(sizeof(Byte));
+				step.item = bytes[ctx.index++] != 0;
+				if (step.item) {
+					ctx.need(sizeof(UInt));
+					step.index = readInt(bytes + ctx.index);
+					ctx.index += sizeof(UInt);
+				} else {
+					ctx.need(sizeof(UShort));
+					UShort keylen = readShort(bytes + ctx.index);
+					ctx.index += sizeof(UShort);
+					ctx.need(keylen);
+					step.key = Key(reinterpret_cast<const char *>(
+							bytes + ctx.index), keylen);
+					ctx.index += keylen;
+				}
+				e.path.push_back(std::move(step));
+			}
+
+			e.start = e.count = 0;
+			if (e.op == PatchOp::Splice || e.op == PatchOp::Write) {
+				ctx.need(2 * sizeof(UInt));
+				e.start = readInt(bytes + ctx.index);
+				e.count = readInt(bytes + ctx.index + sizeof(UInt));
+				ctx.index += 2 * sizeof(UInt);
+			}
+			if (e.op == PatchOp::Remove)
+				continue;
+			ReadResult res = e.value.read(bytes + ctx.index, len - ctx.index,
+					false, ctx.opts);
+			if (!res)
+				throw ParseError(res.error, ctx.index + res.offset);
+			if ((e.op == PatchOp::Splice && e.value.type != TagType::List) ||
+					(e.op == PatchOp::Write && !arrayItemSize(e.value.type)))
+				ctx.fail(ReadError::InvalidType);
+			ctx.index += res.offset;
+		}
+	} catch (const ParseError &e) {
+		entries.clear();
+		return ReadResult{e.error, e.offset};
+	}
+	return ReadResult{ReadError::None, ctx.index};
+}
+
+} // namespace NBT
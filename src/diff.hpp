@@ -0,0 +1,91 @@
+#ifndef NBT_DIFF_HEADER
+#define NBT_DIFF_HEADER
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "nbt.hpp"
+
+namespace NBT {
+
+/**********
+ * Hashes *
+ **********/
+
+// Structural hash of a value.  Equal values hash equally, however they're
+// stored (packed or not, borrowed or owned), and compounds hash the same
+// whatever the order of their entries.
+extern ULong structuralHash(const Tag &t);
+
+// Remembers the hashes of the containers and arrays of a tree, so that each
+// is only hashed once.  Entries are keyed by address, so the cache must be
+// cleared whenever the tree is modified.  Keeping a cache for a tree that
+// is diffed repeatedly, such as the last version sent to a client, saves
+// hashing it again each time.
+class HashCache {
+public:
+	ULong hash(const Tag &t);
+	void clear() { hashes.clear(); }
+
+private:
+	std::unordered_map<const Tag *, ULong> hashes;
+};
+
+
+/*********
+ * Patch *
+ *********/
+
+enum class PatchOp : UByte {
+	Set,     // Set the entry or item at the path to value
+	Remove,  // Remove the compound entry at the path
+	Splice,  // Replace count items of the List at the path from start
+	         // with the items of value
+	Write,   // Resize the array at the path to count elements, then
+	         // overwrite the ones from start with value
+};
+
+// A compound key, or a list index
+struct PathStep {
+	bool item;
+	Key key;
+	UInt index;
+};
+
+struct PatchEntry {
+	PatchOp op;
+	std::vector<PathStep> path;  // An empty path is the root
+	UInt start;
+	UInt count;
+	Tag value;
+};
+
+// A list of changes that turns one tree into another.  Entries apply in
+// order, and each one's path refers to the tree as the entries before it
+// left it.
+class Patch {
+public:
+	bool empty() const { return entries.empty(); }
+
+	std::string write() const;
+	void write(std::string &out) const;
+	ReadResult read(const UByte *bytes, size_t len,
+			const ReadOptions &opts=ReadOptions());
+
+	// Returns false if the patch doesn't fit the tree, in which case the
+	// entries before the one that failed have already been applied.
+	bool apply(Tag &root) const;
+
+	std::vector<PatchEntry> entries;
+};
+
+// Builds a patch turning from into to.  Subtrees with equal hashes are
+// treated as equal without comparing them.  The caches, if given, must
+// only be used for their own tree.
+extern Patch diff(const Tag &from, const Tag &to,
+		HashCache *from_hashes=nullptr, HashCache *to_hashes=nullptr);
+
+} // namespace NBT
+
+#endif // NBT_DIFF_HEADER
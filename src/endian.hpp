@@ -1,4 +1,5 @@
-// Wrappers for cross-platform host<=>big-endian conversion functions
+// Wrappers for cross-platform host<=>big-endian and host<=>little-endian
+// conversion functions
 
 #ifndef NBT_ENDIAN_HEADER
 #define NBT_ENDIAN_HEADER
@@ -13,6 +14,12 @@
 	#define be32toh(x) OSSwapBigToHostInt32(x)
 	#define htobe64(x) OSSwapHostToBigInt64(x)
 	#define be64toh(x) OSSwapBigToHostInt64(x)
+	#define htole16(x) OSSwapHostToLittleInt16(x)
+	#define le16toh(x) OSSwapLittleToHostInt16(x)
+	#define htole32(x) OSSwapHostToLittleInt32(x)
+	#define le32toh(x) OSSwapLittleToHostInt32(x)
+	#define htole64(x) OSSwapHostToLittleInt64(x)
+	#define le64toh(x) OSSwapLittleToHostInt64(x)
 #elif defined(__OpenBSD__)
 	#include <sys/endian.h>
 #elif defined(__NetBSD__) || defined(__FreeBSD__) || defined(__DragonFly__)
@@ -21,6 +28,9 @@
 	#define be16toh(x) betoh16(x)
 	#define be32toh(x) betoh32(x)
 	#define be64toh(x) betoh64(x)
+	#define le16toh(x) letoh16(x)
+	#define le32toh(x) letoh32(x)
+	#define le64toh(x) letoh64(x)
 #elif defined(_WIN32)
 	#include <winsock2.h>
 	#include <sys/param.h>
@@ -33,9 +43,21 @@
 	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 		#define htobe64(x) (((uint64_t)htonl((uint64_t)(x) & 0xFFFFFFFF) << 32) | htonl((uint64_t)(x) >> 32))
 		#define be64toh(x) (((uint64_t)ntohl((uint64_t)(x) & 0xFFFFFFFF) << 32) | ntohl((uint64_t)(x) >> 32))
+		#define htole16(x) (x)
+		#define le16toh(x) (x)
+		#define htole32(x) (x)
+		#define le32toh(x) (x)
+		#define htole64(x) (x)
+		#define le64toh(x) (x)
 	#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 		#define htobe64(x) x
 		#define be64toh(x) x
+		#define htole16(x) __builtin_bswap16(x)
+		#define le16toh(x) __builtin_bswap16(x)
+		#define htole32(x) __builtin_bswap32(x)
+		#define le32toh(x) __builtin_bswap32(x)
+		#define htole64(x) __builtin_bswap64(x)
+		#define le64toh(x) __builtin_bswap64(x)
 	#else
 		#error "Only big and little endian supported on Windows!"
 	#endif
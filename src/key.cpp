@@ -0,0 +1,187 @@
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "key.hpp"
+#include "arena.hpp"
+
+namespace NBT {
+
+uint32_t hashKey(const char *k, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t) k[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+/*************
+ * Key table *
+ *************/
+
+// The table is split into shards, each with its own lock, and each
+// thread keeps a small cache of the symbols it looked up last, so that
+// the common names are found without locking at all.
+
+static const size_t shard_count = 16;
+static const size_t cache_size = 512;
+
+namespace {
+
+struct Shard {
+	Shard() : slots(64), count(0) {}
+
+	std::mutex lock;
+	std::vector<const Symbol *> slots;  // Open addressing, at most half full
+	size_t count;
+	Arena arena;  // The symbols, which are never freed
+};
+
+} // namespace
+
+static std::atomic<size_t> interned_count(0);
+
+// Never destroyed, so that keys stay valid during static destruction
+static Shard *shards()
+{
+	static Shard *s = new Shard[shard_count];
+	return s;
+}
+
+
+static thread_local const Symbol *cache[cache_size];
+
+
+static bool matches(const Symbol *s, uint32_t hash, const char *k, size_t len)
+{
+	return s->hash == hash && s->size == len && memcmp(s->data(), k, len) == 0;
+}
+
+
+static Symbol *allocateSymbol(void *mem, uint32_t hash, const char *k,
+		size_t len, bool interned)
+{
+	Symbol *s = static_cast<Symbol *>(mem);
+	s->hash = hash;
+	s->size = len;
+	s->interned = interned;
+	if (len)
+		memcpy(s + 1, k, len);
+	return s;
+}
+
+
+static void grow(Shard &shard)
+{
+	std::vector<const Symbol *> old(shard.slots.size() * 2, nullptr);
+	old.swap(shard.slots);
+	size_t mask = shard.slots.size() - 1;
+	for (const Symbol *s : old) {
+		if (!s)
+			continue;
+		size_t i = s->hash & mask;
+		while (shard.slots[i])
+			i = (i + 1) & mask;
+		shard.slots[i] = s;
+	}
+}
+
+
+/*******
+ * Key *
+ *******/
+
+const Symbol Key::empty = {2166136261u, 0, true};
+
+
+const Symbol *Key::intern(const char *k, size_t len)
+{
+	if (len == 0)
+		return &empty;
+	uint32_t hash = hashKey(k, len);
+	if (len > max_interned_length)
+		return allocateSymbol(::operator new(sizeof(Symbol) + len),
+				hash, k, len, false);
+
+	const Symbol *&cached = cache[hash & (cache_size - 1)];
+	if (cached && matches(cached, hash, k, len))
+		return cached;
+
+	// The low bits pick the slot, so the shard comes from the high ones
+	Shard &shard = shards()[(hash >> 28) % shard_count];
+	std::lock_guard<std::mutex> guard(shard.lock);
+	size_t mask = shard.slots.size() - 1;
+	size_t i = hash & mask;
+	for (; shard.slots[i]; i = (i + 1) & mask) {
+		if (matches(shard.slots[i], hash, k, len))
+			return cached = shard.slots[i];
+	}
+	if (shard.count >= max_interned_keys / shard_count)
+		return allocateSymbol(::operator new(sizeof(Symbol) + len),
+				hash, k, len, false);
+
+	const Symbol *s = allocateSymbol(shard.arena.allocate(
+			sizeof(Symbol) + len, alignof(Symbol)), hash, k, len, true);
+	shard.slots[i] = s;
+	if (++shard.count * 2 > shard.slots.size())
+		grow(shard);
+	interned_count++;
+	return cached = s;
+}
+
+
+const Symbol *Key::copy(const Symbol *s)
+{
+	return allocateSymbol(::operator new(sizeof(Symbol) + s->size),
+			s->hash, s->data(), s->size, false);
+}
+
+
+Key & Key::operator = (const Key &k)
+{
+	if (sym != k.sym) {
+		const Symbol *s = k.sym->interned ? k.sym : copy(k.sym);
+		release();
+		sym = s;
+	}
+	return *this;
+}
+
+
+Key & Key::operator = (Key &&k) noexcept
+{
+	if (this != &k) {
+		release();
+		sym = k.sym;
+		k.sym = &empty;
+	}
+	return *this;
+}
+
+
+bool Key::operator < (const Key &k) const
+{
+	size_t n = std::min(size(), k.size());
+	int cmp = n ? memcmp(data(), k.data(), n) : 0;
+	return cmp < 0 || (cmp == 0 && size() < k.size());
+}
+
+
+size_t Key::internedCount()
+{
+	return interned_count;
+}
+
+
+std::ostream & operator << (std::ostream &os, const Key &k)
+{
+	return os.write(k.data(), k.size());
+}
+
+} // namespace NBT
@@ -0,0 +1,91 @@
+#ifndef NBT_KEY_HEADER
+#define NBT_KEY_HEADER
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <string>
+
+namespace NBT {
+
+// 32-bit FNV-1a, as used for compound keys
+extern uint32_t hashKey(const char *k, size_t len);
+
+// A key's bytes, preceded by their hash
+struct Symbol {
+	uint32_t hash;
+	uint32_t size;
+	bool interned;
+
+	const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+};
+
+
+// A compound key.  Keys are interned in a table shared by all threads, so
+// that the same few hundred names used throughout a world are stored once
+// and copying a key never allocates.  Keys longer than
+// max_interned_length, or created once the table holds max_interned_keys,
+// get a private copy instead.  Since interned keys are never freed, a
+// given name is either always interned or never, and interned keys can be
+// compared by pointer.
+class Key {
+public:
+	static const size_t max_interned_length = 64;
+	static const size_t max_interned_keys = 64 * 1024;
+
+	Key() : sym(&empty) {}
+	Key(const char *k, size_t len) : sym(intern(k, len)) {}
+	Key(const char *k) : Key(k, strlen(k)) {}
+	Key(const std::string &k) : Key(k.data(), k.size()) {}
+	Key(const Key &k) : sym(k.sym->interned ? k.sym : copy(k.sym)) {}
+	Key(Key &&k) noexcept : sym(k.sym) { k.sym = &empty; }
+	~Key() { release(); }
+
+	Key & operator = (const Key &k);
+	Key & operator = (Key &&k) noexcept;
+
+	const char *data() const { return sym->data(); }
+	size_t size() const { return sym->size; }
+	uint32_t hash() const { return sym->hash; }
+	bool interned() const { return sym->interned; }
+
+	std::string str() const { return std::string(data(), size()); }
+	operator std::string () const { return str(); }
+
+	bool equals(const char *k, size_t len) const
+		{ return size() == len && memcmp(data(), k, len) == 0; }
+	bool operator == (const Key &k) const
+	{
+		return sym == k.sym || (!(interned() && k.interned()) &&
+				equals(k.data(), k.size()));
+	}
+	bool operator != (const Key &k) const { return !(*this == k); }
+	bool operator == (const std::string &k) const { return equals(k.data(), k.size()); }
+	bool operator != (const std::string &k) const { return !(*this == k); }
+	bool operator == (const char *k) const { return equals(k, strlen(k)); }
+	bool operator != (const char *k) const { return !(*this == k); }
+	// Orders by bytes, like std::string
+	bool operator < (const Key &k) const;
+
+	// Number of keys in the shared table
+	static size_t internedCount();
+
+private:
+	static const Symbol *intern(const char *k, size_t len);
+	static const Symbol *copy(const Symbol *s);
+	void release()
+	{
+		if (sym != &empty && !sym->interned)
+			::operator delete(const_cast<Symbol *>(sym));
+	}
+
+	static const Symbol empty;
+	const Symbol *sym;
+};
+
+extern std::ostream & operator << (std::ostream &os, const Key &k);
+
+} // namespace NBT
+
+#endif // NBT_KEY_HEADER
@@ -0,0 +1,145 @@
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#	define NBT_HAVE_MMAP
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
+
+#include "mapped_file.hpp"
+
+namespace NBT {
+
+#ifdef NBT_HAVE_MMAP
+
+static int adviceFor(AccessPattern pattern)
+{
+	switch (pattern) {
+	case AccessPattern::Sequential: return MADV_SEQUENTIAL;
+	case AccessPattern::Random: return MADV_RANDOM;
+	default: return MADV_NORMAL;
+	}
+}
+
+
+// madvise needs page-aligned ranges
+static void adviseRange(const UByte *base, size_t len, size_t offset,
+		size_t size, int advice)
+{
+	if (!base || offset >= len)
+		return;
+	if (size > len - offset)
+		size = len - offset;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page - 1);
+	(void) madvise(const_cast<UByte *>(base) + start,
+			size + (offset - start), advice);
+}
+
+
+bool MappedFile::open(const std::string &path, AccessPattern pattern)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		err = "Can't open " + path + ": " + std::strerror(errno);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		err = "Can't get the size of " + path + ": " + std::strerror(errno);
+		::close(fd);
+		return false;
+	}
+	len = st.st_size;
+	if (len) {
+		void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			err = "Can't map " + path + ": " + std::strerror(errno);
+			::close(fd);
+			len = 0;
+			return false;
+		}
+		bytes = static_cast<const UByte *>(p);
+		mapped = true;
+	}
+	// The mapping stays valid without the descriptor
+	::close(fd);
+	opened = true;
+	if (pattern != AccessPattern::Normal)
+		advise(pattern);
+	return true;
+}
+
+
+void MappedFile::close()
+{
+	if (mapped)
+		munmap(const_cast<UByte *>(bytes), len);
+	bytes = nullptr;
+	len = 0;
+	mapped = false;
+	opened = false;
+}
+
+
+void MappedFile::advise(size_t offset, size_t size, AccessPattern pattern)
+{
+	adviseRange(bytes, len, offset, size, adviceFor(pattern));
+}
+
+
+void MappedFile::prefetch(size_t offset, size_t size)
+{
+	adviseRange(bytes, len, offset, size, MADV_WILLNEED);
+}
+
+#else  // NBT_HAVE_MMAP
+
+bool MappedFile::open(const std::string &path, AccessPattern)
+{
+	close();
+	std::FILE *f = std::fopen(path.c_str(), "rb");
+	if (!f) {
+		err = "Can't open " + path + ": " + std::strerror(errno);
+		return false;
+	}
+	UByte chunk[64 * 1024];
+	size_t got;
+	while ((got = std::fread(chunk, 1, sizeof(chunk), f)) > 0)
+		fallback.insert(fallback.end(), chunk, chunk + got);
+	bool ok = !std::ferror(f);
+	std::fclose(f);
+	if (!ok) {
+		err = "Error reading " + path;
+		fallback.clear();
+		return false;
+	}
+	bytes = fallback.empty() ? nullptr : fallback.data();
+	len = fallback.size();
+	opened = true;
+	return true;
+}
+
+
+void MappedFile::close()
+{
+	fallback.clear();
+	fallback.shrink_to_fit();
+	bytes = nullptr;
+	len = 0;
+	opened = false;
+}
+
+
+void MappedFile::advise(size_t, size_t, AccessPattern) {}
+void MappedFile::prefetch(size_t, size_t) {}
+
+#endif  // NBT_HAVE_MMAP
+
+} // namespace NBT
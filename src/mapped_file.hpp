@@ -0,0 +1,57 @@
+#ifndef NBT_MAPPED_FILE_HEADER
+#define NBT_MAPPED_FILE_HEADER
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "nbt.hpp"
+
+namespace NBT {
+
+// How a mapping is going to be read, passed on to the kernel as a hint
+enum class AccessPattern {
+	Normal,
+	Sequential,  // Whole-file scans: read ahead aggressively
+	Random,  // Scattered lookups, such as single chunks: don't read ahead
+};
+
+// A read-only view of a whole file.  The data can be passed straight to
+// Tag::read, visit or a Decompressor without copying it.  Where mmap isn't
+// available the file is read into memory instead.
+class MappedFile {
+public:
+	MappedFile() : bytes(nullptr), len(0), mapped(false), opened(false) {}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator = (const MappedFile &) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const std::string &path,
+			AccessPattern pattern = AccessPattern::Normal);
+	void close();
+	bool isOpen() const { return opened; }
+
+	const UByte *data() const { return bytes; }
+	size_t size() const { return len; }
+
+	// Changes the hint for the whole file or a part of it
+	void advise(AccessPattern pattern)
+		{ advise(0, len, pattern); }
+	void advise(size_t offset, size_t size, AccessPattern pattern);
+	// Asks for a range to be paged in ahead of use
+	void prefetch(size_t offset, size_t size);
+
+	const std::string &error() const { return err; }
+
+private:
+	const UByte *bytes;
+	size_t len;
+	bool mapped;  // Otherwise the data is in fallback
+	bool opened;
+	std::vector<UByte> fallback;
+	std::string err;
+};
+
+} // namespace NBT
+
+#endif // NBT_MAPPED_FILE_HEADER
@@ -1,6 +1,8 @@
 
 #include <cstring>
 #include <cassert>
+#include <limits>
+#include <stdexcept>
 
 #include "nbt.hpp"
 
@@ -33,8 +35,10 @@ Tag::Tag(const std::string &x) :
 	type(TagType::String)
 {
 	value.v_string.size = x.size();
-	value.v_string.value = new char[x.size()];
-	memcpy(value.v_string.value, x.data(), x.size());
+	if (!x.empty()) {
+		value.v_string.value = new char[x.size()];
+		memcpy(value.v_string.value, x.data(), x.size());
+	}
 }
 
 
@@ -61,6 +65,8 @@ Tag & Tag::operator = (Tag &&t)
 	}
 	free();
 	type = t.type;
+	flags = t.flags;
+	capacity = t.capacity;
 	value = t.value;
 	t.type = TagType::End;
 	return *this;
@@ -69,6 +75,8 @@ Tag & Tag::operator = (Tag &&t)
 Tag & Tag::operator [] (const Int &k)
 {
 	assert(type == TagType::List);
+	materialize();
+	unpack();
 	UInt ak = TOABS(k, value.v_list.size);
 	ensureSize<List, Tag>(&value.v_list, ak + 1);
 	return value.v_list.value[ak];
@@ -77,6 +85,8 @@ Tag & Tag::operator [] (const Int &k)
 Tag & Tag::operator [] (const Int &k) const
 {
 	assert(type == TagType::List);
+	materialize();
+	unpack();
 	UInt ak = TOABS(k, value.v_list.size);
 	assert(ak < value.v_list.size);
 	return value.v_list.value[ak];
@@ -85,6 +95,7 @@ Tag & Tag::operator [] (const Int &k) const
 Tag & Tag::operator += (const Byte &b)
 {
 	assert(type == TagType::ByteArray);
+	detach();
 	ensureSize<ByteArray, Byte>(&value.v_byte_array, value.v_byte_array.size + 1);
 	value.v_byte_array.value[value.v_byte_array.size - 1] = b;
 	return *this;
@@ -93,6 +104,7 @@ Tag & Tag::operator += (const Byte &b)
 Tag & Tag::operator += (const Int &i)
 {
 	assert(type == TagType::IntArray);
+	detach();
 	ensureSize<IntArray, Int>(&value.v_int_array, value.v_int_array.size + 1);
 	value.v_int_array.value[value.v_int_array.size - 1] = i;
 	return *this;
@@ -101,6 +113,7 @@ Tag & Tag::operator += (const Int &i)
 Tag & Tag::operator += (const Tag &t)
 {
 	assert(type == TagType::List);
+	setListType(t.type);
 	ensureSize<List, Tag>(&value.v_list, value.v_list.size + 1);
 	value.v_list.value[value.v_list.size - 1] = t;
 	return *this;
@@ -109,6 +122,7 @@ Tag & Tag::operator += (const Tag &t)
 Tag & Tag::operator += (Tag &&t)
 {
 	assert(type == TagType::List);
+	setListType(t.type);
 	ensureSize<List, Tag>(&value.v_list, value.v_list.size + 1);
 	value.v_list.value[value.v_list.size - 1] = std::move(t);
 	return *this;
@@ -127,6 +141,7 @@ void Tag::setTag(const TagType tag, UInt size, TagType subtype)
 	switch (type) {
 	case TagType::ByteArray:
 		value.v_byte_array.size = size;
+		capacity = size;
 		if (size) value.v_byte_array.value = new Byte[size];
 		break;
 	case TagType::String:
@@ -136,6 +151,7 @@ void Tag::setTag(const TagType tag, UInt size, TagType subtype)
 	case TagType::List:
 		value.v_list.size = size;
 		value.v_list.tagid = subtype;
+		capacity = size;
 		if (size) value.v_list.value = new Tag[size];
 		break;
 	case TagType::Compound:
@@ -143,8 +159,14 @@ void Tag::setTag(const TagType tag, UInt size, TagType subtype)
 		break;
 	case TagType::IntArray:
 		value.v_int_array.size = size;
+		capacity = size;
 		if (size) value.v_int_array.value = new Int[size];
 		break;
+	case TagType::LongArray:
+		value.v_long_array.size = size;
+		capacity = size;
+		if (size) value.v_long_array.value = new Long[size];
+		break;
 	default:
 		memset((void*) &value, 0, sizeof(value));
 	}
@@ -156,10 +178,17 @@ void Tag::copy(const Tag &t)
 	free();
 	ULong size;
 	type = t.type;
+	if (t.flags & FlagLazy) {
+		// Share the serialized data rather than decoding it
+		flags = FlagLazy;
+		value = t.value;
+		return;
+	}
 	switch (type) {
 	case TagType::ByteArray:
 		size = t.value.v_byte_array.size;
 		value.v_byte_array.size = size;
+		capacity = size;
 		if (!size) break;
 		value.v_byte_array.value = new Byte[size];
 		memcpy((void*) value.v_byte_array.value,
@@ -177,6 +206,16 @@ void Tag::copy(const Tag &t)
 		size = t.value.v_list.size;
 		value.v_list.tagid = t.value.v_list.tagid;
 		value.v_list.size = size;
+		capacity = size;
+		if (t.flags & FlagPacked) {
+			flags = FlagPacked;
+			if (!size) break;
+			size = (size * itemSize(value.v_list.tagid) + 7) / 8;
+			value.v_packed.data = new ULong[size];
+			memcpy(value.v_packed.data, t.value.v_packed.data,
+					size * sizeof(ULong));
+			break;
+		}
 		if (!size) break;
 		value.v_list.value = new Tag[size];
 		for (UInt i = 0; i < size; i++) {
@@ -189,11 +228,21 @@ void Tag::copy(const Tag &t)
 	case TagType::IntArray:
 		size = t.value.v_int_array.size;
 		value.v_int_array.size = size;
+		capacity = size;
 		if (!size) break;
 		value.v_int_array.value = new Int[size];
 		memcpy((void*) value.v_int_array.value,
 				(void*) t.value.v_int_array.value, size * sizeof(Int));
 		break;
+	case TagType::LongArray:
+		size = t.value.v_long_array.size;
+		value.v_long_array.size = size;
+		capacity = size;
+		if (!size) break;
+		value.v_long_array.value = new Long[size];
+		memcpy((void*) value.v_long_array.value,
+				(void*) t.value.v_long_array.value, size * sizeof(Long));
+		break;
 	default:
 		value = t.value;
 	}
@@ -202,30 +251,105 @@ void Tag::copy(const Tag &t)
 
 void Tag::free()
 {
+	if (flags & FlagLazy)
+		type = TagType::End;  // Nothing allocated yet
 	switch (type) {
 	case TagType::ByteArray:
-		if (value.v_byte_array.size)
+		if (capacity && !borrowed())
 			delete [] value.v_byte_array.value;
 		break;
 	case TagType::String:
-		if (value.v_string.size)
+		if (value.v_string.size && !borrowed())
 			delete [] value.v_string.value;
 		break;
 	case TagType::List:
-		if (value.v_list.size)
+		if (!capacity)
+			break;
+		if (flags & FlagPacked) {
+			if (!borrowed())
+				delete [] static_cast<ULong *>(value.v_packed.data);
+		} else if (borrowed()) {
+			for (UInt i = 0; i < capacity; i++)
+				value.v_list.value[i].~Tag();
+		} else {
 			delete [] value.v_list.value;
+		}
 		break;
 	case TagType::Compound:
-		delete value.v_compound;
+		if (borrowed())
+			value.v_compound->~Compound();
+		else
+			delete value.v_compound;
 		break;
 	case TagType::IntArray:
-		if (value.v_int_array.size)
+		if (capacity && !borrowed())
 			delete [] value.v_int_array.value;
 		break;
+	case TagType::LongArray:
+		if (capacity && !borrowed())
+			delete [] value.v_long_array.value;
+		break;
 	default:
 		break;
 	}
 	type = TagType::End;  // Prevent double free
+	flags = 0;
+	capacity = 0;
+}
+
+
+// Gives the tag its own copy of a borrowed payload, so that it can be
+// modified without touching the buffer that it was read from.  Lazy
+// subtrees are decoded in full.
+void Tag::detach()
+{
+	if (flags & FlagLazy)
+		decodeLazy(false);
+	if (!borrowed())
+		return;
+	switch (type) {
+	case TagType::ByteArray:
+		reallocate<ByteArray, Byte>(&value.v_byte_array,
+				value.v_byte_array.size);
+		break;
+	case TagType::String: {
+		const char *src = value.v_string.value;
+		value.v_string.value = new char[value.v_string.size];
+		memcpy(value.v_string.value, src, value.v_string.size);
+		break;
+	}
+	case TagType::List:
+		if (flags & FlagPacked) {
+			UInt words = (value.v_packed.size *
+					itemSize(value.v_packed.tagid) + 7) / 8;
+			ULong *data = words ? new ULong[words] : nullptr;
+			memcpy(data, value.v_packed.data, words * sizeof(ULong));
+			value.v_packed.data = data;
+			capacity = value.v_packed.size;
+		} else {
+			reallocate<List, Tag>(&value.v_list, value.v_list.size);
+		}
+		break;
+	case TagType::Compound: {
+		// Moving between allocators moves the entries one by one
+		Compound *heap = new Compound;
+		*heap = std::move(*value.v_compound);
+		value.v_compound->~Compound();
+		value.v_compound = heap;
+		break;
+	}
+	case TagType::IntArray:
+		reallocate<IntArray, Int>(&value.v_int_array,
+				value.v_int_array.size);
+		break;
+	case TagType::LongArray:
+		reallocate<LongArray, Long>(&value.v_long_array,
+				value.v_long_array.size);
+		break;
+	default:
+		break;
+	}
+	flags &= ~FlagBorrowed;
 }
 
 
@@ -234,27 +358,163 @@ void Tag::free()
  * Insert *
  **********/
 
+// Moves the items to new heap storage with room for cap items, which
+// must be at least the current size.
+template <typename container, typename contained>
+	void Tag::reallocate(container *field, UInt cap)
+{
+	contained *items = cap ? new contained[cap] : nullptr;
+	for (UInt i = 0; i < field->size; i++) {
+		items[i] = std::move(field->value[i]);
+	}
+	if (borrowed()) {
+		for (UInt i = 0; i < capacity; i++)
+			field->value[i].~contained();
+		flags &= ~FlagBorrowed;
+	} else if (capacity) {
+		delete [] field->value;
+	}
+	field->value = items;
+	capacity = cap;
+}
+
+
+// Sets the item type of a list that doesn't have one yet, and checks that
+// it matches otherwise.
+void Tag::setListType(TagType tag)
+{
+	materialize();
+	unpack();
+	if (value.v_list.size > 0 && value.v_list.tagid != TagType::End) {
+		assert(tag == value.v_list.tagid);
+	} else {
+		value.v_list.tagid = tag;
+	}
+}
+
+
 template <typename container, typename contained>
 	void Tag::ensureSize(container *field, UInt size)
 {
-	if (size > field->size) {
-		container newc;
-		newc.size = size;
-		newc.value = new contained[size];
-		for (UInt i = 0; i < field->size; i++) {
-			newc.value[i] = std::move(field->value[i]);
-		}
-		if (field->size)
-			delete [] field->value;
-		*field = newc;
+	if (size > capacity) {
+		// Grow geometrically so that appending is amortized O(1)
+		UInt cap = capacity < 4 ? 4 : capacity;
+		while (cap < size)
+			cap = cap > std::numeric_limits<UInt>::max() / 2 ?
+				std::numeric_limits<UInt>::max() : cap * 2;
+		reallocate<container, contained>(field, cap);
+	}
+	if (size > field->size)
+		field->size = size;
+}
+
+
+void Tag::reserve(UInt n)
+{
+	materialize();
+	unpack();
+	switch (type) {
+	case TagType::ByteArray:
+		if (n > capacity)
+			reallocate<ByteArray, Byte>(&value.v_byte_array, n);
+		break;
+	case TagType::List:
+		if (n > capacity)
+			reallocate<List, Tag>(&value.v_list, n);
+		break;
+	case TagType::IntArray:
+		if (n > capacity)
+			reallocate<IntArray, Int>(&value.v_int_array, n);
+		break;
+	case TagType::LongArray:
+		if (n > capacity)
+			reallocate<LongArray, Long>(&value.v_long_array, n);
+		break;
+	default:
+		assert(false);
+	}
+}
+
+
+void Tag::shrink_to_fit()
+{
+	materialize();
+	unpack();
+	switch (type) {
+	case TagType::ByteArray:
+		if (capacity > value.v_byte_array.size)
+			reallocate<ByteArray, Byte>(&value.v_byte_array,
+					value.v_byte_array.size);
+		break;
+	case TagType::List:
+		if (capacity > value.v_list.size)
+			reallocate<List, Tag>(&value.v_list, value.v_list.size);
+		break;
+	case TagType::IntArray:
+		if (capacity > value.v_int_array.size)
+			reallocate<IntArray, Int>(&value.v_int_array,
+					value.v_int_array.size);
+		break;
+	case TagType::LongArray:
+		if (capacity > value.v_long_array.size)
+			reallocate<LongArray, Long>(&value.v_long_array,
+					value.v_long_array.size);
+		break;
+	default:
+		assert(false);
 	}
 }
 
 
+// Checks that n more items still leave the size within a UInt
+static void checkAppend(UInt size, size_t n)
+{
+	if (n > std::numeric_limits<UInt>::max() - size)
+		throw std::length_error("Array would have too many items");
+}
+
+
+Tag & Tag::append(const Byte *bytes, size_t n)
+{
+	assert(type == TagType::ByteArray);
+	detach();
+	UInt size = value.v_byte_array.size;
+	checkAppend(size, n);
+	ensureSize<ByteArray, Byte>(&value.v_byte_array, size + n);
+	memcpy(value.v_byte_array.value + size, bytes, n);
+	return *this;
+}
+
+
+Tag & Tag::append(const Int *ints, size_t n)
+{
+	assert(type == TagType::IntArray);
+	detach();
+	UInt size = value.v_int_array.size;
+	checkAppend(size, n);
+	ensureSize<IntArray, Int>(&value.v_int_array, size + n);
+	memcpy(value.v_int_array.value + size, ints, n * sizeof(Int));
+	return *this;
+}
+
+
+Tag & Tag::append(const Long *longs, size_t n)
+{
+	assert(type == TagType::LongArray);
+	detach();
+	UInt size = value.v_long_array.size;
+	checkAppend(size, n);
+	ensureSize<LongArray, Long>(&value.v_long_array, size + n);
+	memcpy(value.v_long_array.value + size, longs, n * sizeof(Long));
+	return *this;
+}
+
+
 void Tag::insert(const Int k, const Byte b)
 {
 	assert(type == TagType::ByteArray);
-	UInt ak = TOABS(k, value.v_list.size);
+	detach();
+	UInt ak = TOABS(k, value.v_byte_array.size);
 	ensureSize<ByteArray, Byte>(&value.v_byte_array, ak + 1);
 	value.v_byte_array.value[ak] = b;
 }
@@ -263,7 +523,8 @@ void Tag::insert(const Int k, const Byte b)
 void Tag::insert(const Int k, const Int i)
 {
 	assert(type == TagType::IntArray);
-	UInt ak = TOABS(k, value.v_list.size);
+	detach();
+	UInt ak = TOABS(k, value.v_int_array.size);
 	ensureSize<IntArray, Int>(&value.v_int_array, ak + 1);
 	value.v_int_array.value[ak] = i;
 }
@@ -272,11 +533,7 @@ void Tag::insert(const Int k, const Int i)
 void Tag::insert(const Int k, const Tag &t)
 {
 	assert(type == TagType::List);
-	if (value.v_list.size > 0 && value.v_list.tagid != TagType::End) {
-		assert(t.type == value.v_list.tagid);
-	} else {
-		value.v_list.tagid = t.type;
-	}
+	setListType(t.type);
 	UInt ak = TOABS(k, value.v_list.size);
 	ensureSize<List, Tag>(&value.v_list, ak + 1);
 	value.v_list.value[ak] = t;
@@ -286,8 +543,110 @@ void Tag::insert(const Int k, const Tag &t)
 void Tag::insert(const std::string &k, const Tag &t)
 {
 	assert(type == TagType::Compound);
+	materialize();
 	(*value.v_compound)[k] = t;
 }
 
+
+
+/****************
+ * Packed lists *
+ ****************/
+
+template <typename T>
+static void packItems(const Tag *items, UInt size, void *data)
+{
+	T *out = static_cast<T *>(data);
+	for (UInt i = 0; i < size; i++)
+		out[i] = items[i].as<T>();
+}
+
+
+template <typename T>
+static void unpackItems(const void *data, UInt size, Tag *items)
+{
+	const T *in = static_cast<const T *>(data);
+	for (UInt i = 0; i < size; i++)
+		items[i] = Tag(in[i]);
+}
+
+
+// Packed items are kept in an array of ULong, for alignment
+void Tag::pack()
+{
+	assert(type == TagType::List);
+	materialize();
+	if ((flags & FlagPacked) || !itemSize(value.v_list.tagid))
+		return;
+	List list = value.v_list;
+	UInt words = (list.size * itemSize(list.tagid) + 7) / 8;
+	ULong *data = words ? new ULong[words] : nullptr;
+	switch (list.tagid) {
+	case TagType::Byte: packItems<Byte>(list.value, list.size, data); break;
+	case TagType::Short: packItems<Short>(list.value, list.size, data); break;
+	case TagType::Int: packItems<Int>(list.value, list.size, data); break;
+	case TagType::Long: packItems<Long>(list.value, list.size, data); break;
+	case TagType::Float: packItems<float>(list.value, list.size, data); break;
+	case TagType::Double: packItems<double>(list.value, list.size, data); break;
+	default: break;
+	}
+	free();
+	type = TagType::List;
+	flags = FlagPacked;
+	capacity = list.size;
+	value.v_packed = PackedList{list.tagid, list.size, data};
+}
+
+
+Tag Tag::listItem(UInt i) const
+{
+	assert(type == TagType::List);
+	materialize();
+	assert(i < value.v_list.size);
+	if (!(flags & FlagPacked))
+		return value.v_list.value[i];
+	const void *data = value.v_packed.data;
+	switch (value.v_packed.tagid) {
+	case TagType::Byte: return Tag(static_cast<const Byte *>(data)[i]);
+	case TagType::Short: return Tag(static_cast<const Short *>(data)[i]);
+	case TagType::Int: return Tag(static_cast<const Int *>(data)[i]);
+	case TagType::Long: return Tag(static_cast<const Long *>(data)[i]);
+	case TagType::Float: return Tag(static_cast<const float *>(data)[i]);
+	case TagType::Double: return Tag(static_cast<const double *>(data)[i]);
+	default: return Tag();
+	}
+}
+
+
+void Tag::unpackList()
+{
+	PackedList list = value.v_packed;
+	Tag *items = list.size ? new Tag[list.size] : nullptr;
+	switch (list.tagid) {
+	case TagType::Byte: unpackItems<Byte>(list.data, list.size, items); break;
+	case TagType::Short: unpackItems<Short>(list.data, list.size, items); break;
+	case TagType::Int: unpackItems<Int>(list.data, list.size, items); break;
+	case TagType::Long: unpackItems<Long>(list.data, list.size, items); break;
+	case TagType::Float: unpackItems<float>(list.data, list.size, items); break;
+	case TagType::Double: unpackItems<double>(list.data, list.size, items); break;
+	default: break;
+	}
+	free();
+	type = TagType::List;
+	capacity = list.size;
+	value.v_list = List{list.tagid, list.size, items};
+}
+
+
+/************
+ * Document *
+ ************/
+
+void Document::clear()
+{
+	root.free();
+	arena.reset();
+}
+
 } // namespace NBT
 
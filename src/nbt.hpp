@@ -3,12 +3,16 @@
 #define NBT_HEADER
 
 #include <cstdint>
+#include <cstring>
 #include <cassert>
 #include <exception>
+#include <stdexcept>
 #include <string>
-#include <map>
 #include <limits>
 
+#include "arena.hpp"
+#include "key.hpp"
+
 // Require C++11
 #if __cplusplus < 201103L
 	#error NBT-CPP requires C++11
@@ -50,6 +54,7 @@ enum class TagType : UByte {
 	List,
 	Compound,
 	IntArray,
+	LongArray,
 };
 
 struct ByteArray {
@@ -68,13 +73,31 @@ struct List {
 	Tag *value;
 };
 
-typedef std::map<std::string, Tag> Compound;
+// A List of scalars stored as a native array; see Tag::span()
+struct PackedList {
+	TagType tagid;
+	UInt size;
+	void *data;
+};
+
+class Compound;
 
 struct IntArray {
 	UInt size;
 	Int *value;
 };
 
+struct LongArray {
+	UInt size;
+	Long *value;
+};
+
+// The serialized payload of a subtree that hasn't been decoded yet
+struct LazyValue {
+	const UByte *bytes;
+	ULong size;
+};
+
 union Value {
 	Byte      v_byte;
 	Short     v_short;
@@ -85,10 +108,128 @@ union Value {
 	ByteArray v_byte_array;
 	String    v_string;
 	List      v_list;
+	PackedList v_packed;  // Shares tagid and size with v_list
 	Compound *v_compound;
 	IntArray  v_int_array;
+	LongArray v_long_array;
+	LazyValue v_lazy;
 };
 
+
+// Direct access to the items of a scalar List
+template <typename T>
+struct Span {
+	T *data;
+	UInt size;
+
+	T *begin() const { return data; }
+	T *end() const { return data + size; }
+	T & operator [] (UInt i) const { return data[i]; }
+};
+
+// The item type of Lists that can be packed
+template <typename T> struct ScalarType;
+template <> struct ScalarType<Byte>   { static const TagType value = TagType::Byte; };
+template <> struct ScalarType<Short>  { static const TagType value = TagType::Short; };
+template <> struct ScalarType<Int>    { static const TagType value = TagType::Int; };
+template <> struct ScalarType<Long>   { static const TagType value = TagType::Long; };
+template <> struct ScalarType<float>  { static const TagType value = TagType::Float; };
+template <> struct ScalarType<double> { static const TagType value = TagType::Double; };
+
+
+/***************************
+ * Deserialization results *
+ ***************************/
+
+enum class ReadError : UByte {
+	None,
+	Truncated,        // A field runs past the end of the input
+	InvalidType,      // Unknown tag type, or an untyped non-empty list
+	TooDeep,          // Nesting exceeds ReadOptions::max_depth
+	TooManyElements,  // A length prefix exceeds ReadOptions::max_elements
+	TooLarge,         // Total allocation exceeds ReadOptions::max_alloc
+	TypeMismatch,     // A value has the wrong type for where it appears
+	Syntax,           // Malformed input, such as SNBT or an overlong varint
+};
+
+extern const char *readErrorString(ReadError error);
+
+// On success offset is the number of bytes consumed, otherwise it is the
+// offset of the field that failed to parse.
+struct ReadResult {
+	ReadError error;
+	ULong offset;
+
+	explicit operator bool() const { return error == ReadError::None; }
+};
+
+// Limits applied by the length-aware read functions.  The defaults are
+// generous enough for any vanilla chunk or player file.
+struct ReadOptions {
+	ReadOptions() :
+		max_depth(512),
+		max_elements(16 * 1024 * 1024),
+		max_alloc(256 * 1024 * 1024),
+		borrow(false),
+		lazy(false),
+		arena(nullptr)
+	{}
+
+	static ReadOptions unlimited();
+
+	UInt max_depth;
+	UInt max_elements;
+	ULong max_alloc;  // Approximate bytes of memory for the whole tree
+
+	// Make ByteArray and String payloads point into the input instead of
+	// copying them.  The input must then outlive the tree (or until each
+	// tag is detach()ed), and must not be modified.
+	bool borrow;
+
+	// Only record where each List or Compound inside the root compound
+	// is, and decode it on first access.  Undecoded subtrees are written
+	// back verbatim.  As with borrow, the input must outlive the tree.
+	// Decoding later applies no limits, and never uses the arena.
+	// NOT THREAD-SAFE: decoding happens in place even through const
+	// access, so a lazy tree mustn't be shared between threads until the
+	// subtrees they read have been materialize()d on one of them.
+	bool lazy;
+
+	// Allocate the tree's payloads, lists and compounds from this arena
+	// instead of the heap.  The arena must outlive the tree.
+	Arena *arena;
+};
+
+class ParseError : public std::runtime_error {
+public:
+	ParseError(ReadError error, ULong offset);
+
+	ReadError error;
+	ULong offset;
+};
+
+struct ReadContext;
+class Source;
+
+// Wire formats, for the read and write templates.  The plain functions use
+// BigEndian.
+struct BigEndian;            // Java Edition
+struct LittleEndian;         // Bedrock Edition files
+struct NetworkLittleEndian;  // Bedrock Edition protocol, with varints
+
+// How a whole value's root is framed.  Files, and the Java protocol before
+// 1.20.2, give the root a name; the protocol since then doesn't.  An End
+// root is a lone type byte either way.
+enum class RootName : UByte {
+	Named,     // Type, name, then payload
+	Nameless,  // Type, then payload
+};
+
+
+/*******
+ * Tag *
+ *******/
+
 class Tag {
 public:
 	Tag() : type(TagType::End), value() {}
@@ -107,7 +248,8 @@ public:
 	Tag(const std::string &x);
 
 	Tag(const Tag &t) : type(TagType::End) { copy(t); }
-	Tag(Tag &&t) : type(t.type), value(t.value)
+	Tag(Tag &&t) noexcept :
+		type(t.type), flags(t.flags), capacity(t.capacity), value(t.value)
 		{ t.type = TagType::End; }
 
 	~Tag() { free(); }
@@ -116,10 +258,10 @@ public:
 	Tag & operator = (Tag &&t);
 	Tag & operator [] (const Int &k);
 	Tag & operator [] (const Int &k) const;
-	Tag & operator [] (const std::string &k) { assert(type == TagType::Compound); return (*value.v_compound)[k]; }
-	Tag & operator [] (const std::string &k) const { assert(type == TagType::Compound); return value.v_compound->at(k); }
-	Tag & operator [] (const char *k) { assert(type == TagType::Compound); return (*value.v_compound)[k]; }
-	Tag & operator [] (const char *k) const { assert(type == TagType::Compound); return value.v_compound->at(k); }
+	Tag & operator [] (const std::string &k);
+	Tag & operator [] (const std::string &k) const;
+	Tag & operator [] (const char *k);
+	Tag & operator [] (const char *k) const;
 
 	Tag & operator += (const Byte &t);
 	Tag & operator += (const Int &t);
@@ -134,9 +276,10 @@ public:
 	operator double    () const { assert(type == TagType::Double);    return value.v_double; }
 	operator ByteArray () const { assert(type == TagType::ByteArray); return value.v_byte_array; }
 	operator String    () const { assert(type == TagType::String);    return value.v_string; }
-	operator List      () const { assert(type == TagType::List);      return value.v_list; }
-	operator Compound& () const { assert(type == TagType::Compound);  return *value.v_compound; }
+	operator List      () const { assert(type == TagType::List);      materialize(); unpack(); return value.v_list; }
+	operator Compound& () const { assert(type == TagType::Compound);  materialize(); return *value.v_compound; }
 	operator IntArray  () const { assert(type == TagType::IntArray);  return value.v_int_array; }
+	operator LongArray () const { assert(type == TagType::LongArray); return value.v_long_array; }
 
 	operator std::string () const {
 		assert(type == TagType::String);
@@ -149,10 +292,76 @@ public:
 
 	void copy(const Tag &t);
 	void free();
+	void detach();
+	bool borrowed() const { return flags & FlagBorrowed; }
+	// Decodes a lazily-read subtree, if this is one.  Const access calls
+	// this too, which modifies the tree; see ReadOptions::lazy.
+	void materialize() const
+		{ if (flags & FlagLazy) const_cast<Tag *>(this)->decodeLazy(); }
 	void setTag(const TagType tag, UInt size = 0, TagType subtype = TagType::End);
 
+	// Lists of Byte, Short, Int, Long, Float or Double can be stored as a
+	// native array rather than as Tags.  They are read that way, span()
+	// packs them, and anything that needs Tag items (operator[], the List
+	// conversion, adding items) unpacks them again.
+	//
+	// NOT THREAD-SAFE: unpacking replaces the list's storage even through
+	// the const operator[] and List conversion, so those mustn't be used
+	// on a packed list that other threads are reading.  listItem(), the
+	// const span(), write(), dump() and copying only read.
+	bool packed() const { return flags & FlagPacked; }
+	// Leaves Lists of other item types as they are
+	void pack();
+	void unpack() const
+		{ if (flags & FlagPacked) const_cast<Tag *>(this)->unpackList(); }
+	// Empty if the List holds some other type of item
+	template <typename T> Span<T> span();
+	// Can't pack, so the list must already be packed, or empty
+	template <typename T> Span<const T> span() const;
+	// A copy of a List item, packed or not
+	Tag listItem(UInt i) const;
+	// Size of a packed List item, or 0 if the type can't be packed
+	static UInt itemSize(TagType tag);
+	// Item type and count of a List, without unpacking it
+	TagType listType() const
+		{ assert(type == TagType::List); materialize(); return value.v_list.tagid; }
+	UInt listSize() const
+		{ assert(type == TagType::List); materialize(); return value.v_list.size; }
+
 	void read(const UByte *bytes, bool compound=true);
+	ReadResult read(const UByte *bytes, size_t len, bool compound=true,
+			const ReadOptions &opts=ReadOptions());
+	std::string write(bool write_type=false) const;
+	void write(std::string &out, bool write_type=false) const;
+	// In another format.  Lazy reads are only kept lazy for BigEndian.
+	template <typename Format>
+	ReadResult read(const UByte *bytes, size_t len, bool compound=true,
+			const ReadOptions &opts=ReadOptions());
+	template <typename Format>
 	std::string write(bool write_type=false) const;
+	template <typename Format>
+	void write(std::string &out, bool write_type=false) const;
+	// A whole value at an offset into a larger buffer, such as a packet.
+	// The read's result offset counts from offset, so on success it's the
+	// number of bytes consumed; a root name is checked and dropped.  The
+	// write inserts at offset (with an empty name, if Named), and returns
+	// the number of bytes produced.
+	ReadResult readAt(const UByte *bytes, size_t len, size_t offset,
+			RootName mode, const ReadOptions &opts=ReadOptions());
+	size_t writeAt(std::string &out, size_t offset, RootName mode) const;
+	template <typename Format>
+	ReadResult readAt(const UByte *bytes, size_t len, size_t offset,
+			RootName mode, const ReadOptions &opts=ReadOptions());
+	template <typename Format>
+	size_t writeAt(std::string &out, size_t offset, RootName mode) const;
+	// A whole value, as in readAt, pulled from a stream such as an
+	// InflateSource.  Borrowed and lazy reads aren't possible, and array
+	// lengths are only bounded by the options' limits.
+	ReadResult read(Source &src, RootName mode,
+			const ReadOptions &opts=ReadOptions());
+	template <typename Format>
+	ReadResult read(Source &src, RootName mode,
+			const ReadOptions &opts=ReadOptions());
 	std::string dump(const std::string &indent="\t", UByte level=0) const;
 
 	void insert(const Int k, const Byte b);
@@ -160,21 +369,252 @@ public:
 	void insert(const Int k, const Tag &t);
 	void insert(const std::string &k, const Tag &t);
 
+	// Capacity management for List and array tags
+	void reserve(UInt n);
+	void shrink_to_fit();
+	// Throw std::length_error if the size would no longer fit in a UInt
+	Tag & append(const Byte *bytes, size_t n);
+	Tag & append(const Int *ints, size_t n);
+	Tag & append(const Long *longs, size_t n);
+
 	TagType type;
 
 protected:
-	void readTag(const UByte *bytes, ULong &index, TagType tag);
-
-	friend List      readList    (const UByte *bytes, ULong &index);
-	friend Compound *readCompound(const UByte *bytes, ULong &index);
-
-	ULong getSerializedSize() const;
+	template <typename Format>
+		void readRoot(ReadContext &ctx, bool compound);
+	template <typename Format>
+		void readTag(ReadContext &ctx, TagType tag);
+	template <typename Format>
+		ReadResult readValue(ReadContext &ctx, RootName mode);
+	void readLazy(ReadContext &ctx, TagType tag);
+	void decodeLazy(bool lazy=true);
+
+	enum : UByte {
+		// The payload points into memory that the tag doesn't own: the
+		// input buffer or an arena.  Borrowed list items and compounds
+		// are still destroyed, but their storage isn't freed.
+		FlagBorrowed = 1 << 0,
+		// The value is a LazyValue, to be decoded on first access
+		FlagLazy = 1 << 1,
+		// The value is a PackedList
+		FlagPacked = 1 << 2,
+	};
+
+	void unpackList();
+
+	template <typename Format>
+		friend void readList(ReadContext &ctx, Tag &t);
+	template <typename Format>
+		friend void readCompound(ReadContext &ctx, Compound &x);
+	template <typename T> friend struct Codec;
+
+	template <typename Format>
+		void writePayload(std::string &out) const;
+	void setListType(TagType tag);
 	template <typename container, typename contained>
 		void ensureSize(container *field, UInt size);
+	template <typename container, typename contained>
+		void reallocate(container *field, UInt cap);
 
+	UByte flags = 0;
+	// Allocated items of a List or an array
+	UInt capacity = 0;
 	Value value;
 };
 
+
+template <typename T>
+Span<T> Tag::span()
+{
+	assert(type == TagType::List);
+	materialize();
+	if (value.v_list.size == 0)
+		value.v_list.tagid = ScalarType<T>::value;
+	if (value.v_list.tagid != ScalarType<T>::value)
+		return Span<T>{nullptr, 0};
+	pack();
+	return Span<T>{static_cast<T *>(value.v_packed.data), value.v_packed.size};
+}
+
+
+template <typename T>
+Span<const T> Tag::span() const
+{
+	assert(type == TagType::List);
+	materialize();
+	assert(packed() || value.v_list.size == 0);
+	if (!packed() || value.v_packed.tagid != ScalarType<T>::value)
+		return Span<const T>{nullptr, 0};
+	return Span<const T>{static_cast<const T *>(value.v_packed.data),
+			value.v_packed.size};
+}
+
+
+
+/************
+ * Compound *
+ ************/
+
+// Compound entries are stored contiguously in insertion order, so that
+// re-serializing a tree reproduces its input.  Small compounds are
+// searched linearly; larger ones get a hash index on first lookup.
+// Like std::vector, inserting or erasing invalidates references to
+// entries.
+class Compound {
+public:
+	struct Entry {
+		Entry(const Key &k) : first(k) {}
+		Entry(Key &&k) : first(std::move(k)) {}
+
+		Key first;
+		Tag second;
+	};
+
+	typedef Entry value_type;
+	typedef Entry *iterator;
+	typedef const Entry *const_iterator;
+	typedef ArenaAllocator<Entry> allocator_type;
+
+	explicit Compound(const allocator_type &alloc = allocator_type());
+	// Copies always allocate from the heap
+	Compound(const Compound &other);
+	Compound(Compound &&other) noexcept;
+	~Compound();
+
+	Compound & operator = (const Compound &other);
+	Compound & operator = (Compound &&other);
+
+	// Looks the key up, inserting an End tag if it's missing
+	Tag & operator [] (const std::string &k) { return findOrInsert(k.data(), k.size()); }
+	Tag & operator [] (const char *k) { return findOrInsert(k, strlen(k)); }
+	Tag & operator [] (const Key &k) { return findOrInsert(k); }
+	Tag & findOrInsert(const char *k, size_t len);
+	Tag & findOrInsert(Key k);
+
+	// Throw std::out_of_range if the key is missing
+	Tag & at(const std::string &k) const { return at(k.data(), k.size()); }
+	Tag & at(const char *k) const { return at(k, strlen(k)); }
+	Tag & at(const char *k, size_t len) const;
+
+	iterator find(const std::string &k) { return find(k.data(), k.size()); }
+	iterator find(const char *k) { return find(k, strlen(k)); }
+	iterator find(const char *k, size_t len) { return lookup(k, len); }
+	const_iterator find(const std::string &k) const { return find(k.data(), k.size()); }
+	const_iterator find(const char *k) const { return find(k, strlen(k)); }
+	const_iterator find(const char *k, size_t len) const { return lookup(k, len); }
+	// Interned keys are compared by pointer
+	iterator find(const Key &k) { return lookup(k); }
+	const_iterator find(const Key &k) const { return lookup(k); }
+
+	size_t count(const std::string &k) const { return find(k) != end(); }
+	size_t count(const char *k) const { return find(k) != end(); }
+
+	size_t erase(const std::string &k);
+	iterator erase(const_iterator it);
+
+	iterator begin() { return items; }
+	iterator end() { return items + num_items; }
+	const_iterator begin() const { return items; }
+	const_iterator end() const { return items + num_items; }
+
+	size_t size() const { return num_items; }
+	bool empty() const { return num_items == 0; }
+	void clear();
+	void reserve(size_t n);
+	// Orders the entries by key, as std::map did
+	void sort();
+
+	allocator_type get_allocator() const { return alloc; }
+
+private:
+	struct Slot {
+		UInt hash;
+		UInt pos;  // Entry position + 1, or 0 if empty
+	};
+
+	static const UInt index_threshold = 16;
+
+	Entry *lookup(const char *k, size_t len) const;
+	Entry *lookup(const Key &k) const;
+	void buildIndex();
+	void dropIndex();
+	void updateIndex();
+	void addToIndex(UInt pos);
+
+	Entry *items;
+	UInt num_items;
+	UInt max_items;
+	Slot *index;  // Kept for more than index_threshold entries
+	UInt index_size;
+	allocator_type alloc;
+};
+
+
+inline Tag & Tag::operator [] (const std::string &k)
+	{ assert(type == TagType::Compound); materialize(); return (*value.v_compound)[k]; }
+inline Tag & Tag::operator [] (const std::string &k) const
+	{ assert(type == TagType::Compound); materialize(); return value.v_compound->at(k); }
+inline Tag & Tag::operator [] (const char *k)
+	{ assert(type == TagType::Compound); materialize(); return (*value.v_compound)[k]; }
+inline Tag & Tag::operator [] (const char *k) const
+	{ assert(type == TagType::Compound); materialize(); return value.v_compound->at(k); }
+
+inline UInt Tag::itemSize(TagType tag)
+{
+	switch (tag) {
+	case TagType::Byte: return sizeof(Byte);
+	case TagType::Short: return sizeof(Short);
+	case TagType::Int: return sizeof(Int);
+	case TagType::Long: return sizeof(Long);
+	case TagType::Float: return sizeof(float);
+	case TagType::Double: return sizeof(double);
+	default: return 0;
+	}
+}
+
+
+/************
+ * Document *
+ ************/
+
+// A tree whose tags, payloads and compound entries all come from one
+// arena, and are released together.  The root is an ordinary Tag; it can
+// be read and modified as usual, and anything added later lives on the
+// heap.
+class Document {
+public:
+	Document(size_t block_size = 64 * 1024) : arena(block_size) {}
+	Document(const Document &) = delete;
+	Document & operator = (const Document &) = delete;
+
+	ReadResult read(const UByte *bytes, size_t len, bool compound=true,
+			ReadOptions opts=ReadOptions());
+	template <typename Format>
+	ReadResult read(const UByte *bytes, size_t len, bool compound=true,
+			ReadOptions opts=ReadOptions());
+	// As in Tag::readAt
+	ReadResult readAt(const UByte *bytes, size_t len, size_t offset,
+			RootName mode, ReadOptions opts=ReadOptions());
+	template <typename Format>
+	ReadResult readAt(const UByte *bytes, size_t len, size_t offset,
+			RootName mode, ReadOptions opts=ReadOptions());
+	ReadResult read(Source &src, RootName mode,
+			ReadOptions opts=ReadOptions());
+	template <typename Format>
+	ReadResult read(Source &src, RootName mode,
+			ReadOptions opts=ReadOptions());
+	// Frees the tree, and all of the arena except for one block
+	void clear();
+
+	operator Tag& () { return root; }
+	Tag & operator [] (const std::string &k) { return root[k]; }
+	Tag & operator [] (const char *k) { return root[k]; }
+
+	// Declared first so that it's destroyed after the tree
+	Arena arena;
+	Tag root;
+};
+
 } // namespace NBT
 
 #endif
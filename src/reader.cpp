@@ -0,0 +1,34 @@
+#include "walker.hpp"
+
+namespace NBT {
+
+void truncated(ULong offset)
+{
+	throw ParseError(ReadError::Truncated, offset);
+}
+
+
+ReadResult skip(const UByte *bytes, size_t len, TagType tag,
+		const ReadOptions &opts)
+{
+	return skip<BigEndian>(bytes, len, tag, opts);
+}
+
+
+ReadResult visit(const UByte *bytes, size_t len, Visitor &v, bool compound,
+		const ReadOptions &opts)
+{
+	return visit<BigEndian>(bytes, len, v, compound, opts);
+}
+
+
+ReadResult visit(Source &src, Visitor &v, bool compound,
+		const ReadOptions &opts)
+{
+	return visit<BigEndian>(src, v, compound, opts);
+}
+
+
+NBT_INSTANTIATE_WALK(BigEndian)
+
+} // namespace NBT
@@ -0,0 +1,93 @@
+#ifndef NBT_READER_HEADER
+#define NBT_READER_HEADER
+
+#include <cstddef>
+#include <string>
+
+#include "nbt.hpp"
+
+namespace NBT {
+
+enum class VisitResult : UByte {
+	Continue,
+	Skip,  // Skip over the value or the container's contents
+	Stop,  // End the walk (successfully) right away
+};
+
+// Receives the events of an NBT walk.  The default implementations accept
+// and ignore everything, so visitors only override what they need.
+// Pointers passed to the hooks are only valid until the hook returns.
+class Visitor {
+public:
+	virtual ~Visitor() {}
+
+	// Called before each compound entry's value.  Skipping the entry
+	// suppresses all events for its value.
+	virtual VisitResult key(TagType, const char * /*name*/, UShort /*len*/)
+		{ return VisitResult::Continue; }
+
+	// Skipping a container suppresses its contents and its end event
+	virtual VisitResult beginCompound() { return VisitResult::Continue; }
+	virtual void endCompound() {}
+	virtual VisitResult beginList(TagType /*tagid*/, UInt /*size*/)
+		{ return VisitResult::Continue; }
+	virtual void endList() {}
+
+	virtual void value(Byte) {}
+	virtual void value(Short) {}
+	virtual void value(Int) {}
+	virtual void value(Long) {}
+	virtual void value(float) {}
+	virtual void value(double) {}
+	virtual void value(const char * /*str*/, UShort /*len*/) {}
+	virtual void byteArray(const Byte * /*data*/, UInt /*size*/) {}
+	// In host byte order
+	virtual void intArray(const Int * /*data*/, UInt /*size*/) {}
+	virtual void longArray(const Long * /*data*/, UInt /*size*/) {}
+};
+
+// Incremental input for a walk.  read() fills up to size bytes and returns
+// how many it wrote, or 0 at the end of the input.
+class Source {
+public:
+	virtual ~Source() {}
+	virtual size_t read(UByte *buf, size_t size) = 0;
+};
+
+// Walk NBT data, calling the visitor's hooks for each element.  The root
+// is treated as in Tag::read.  ReadOptions::max_depth is enforced, and
+// max_elements bounds array lengths; nothing else is allocated.
+extern ReadResult visit(const UByte *bytes, size_t len, Visitor &v,
+		bool compound=true, const ReadOptions &opts=ReadOptions());
+extern ReadResult visit(Source &src, Visitor &v,
+		bool compound=true, const ReadOptions &opts=ReadOptions());
+
+// Find the length of a payload of the given type without decoding it.
+// On success the result's offset is the payload's size.
+extern ReadResult skip(const UByte *bytes, size_t len, TagType tag,
+		const ReadOptions &opts=ReadOptions());
+
+// The same for data in another format (see Tag::read)
+template <typename Format>
+ReadResult visit(const UByte *bytes, size_t len, Visitor &v,
+		bool compound=true, const ReadOptions &opts=ReadOptions());
+template <typename Format>
+ReadResult visit(Source &src, Visitor &v,
+		bool compound=true, const ReadOptions &opts=ReadOptions());
+template <typename Format>
+ReadResult skip(const UByte *bytes, size_t len, TagType tag,
+		const ReadOptions &opts=ReadOptions());
+
+// Converts data from one format to another in a single pass, without
+// building a tree, and appends it to out.  The root is treated as in
+// Tag::read, and limits are applied as in visit().
+template <typename From, typename To>
+ReadResult transcode(const UByte *bytes, size_t len, std::string &out,
+		bool compound=true, const ReadOptions &opts=ReadOptions());
+template <typename From, typename To>
+ReadResult transcode(Source &src, std::string &out,
+		bool compound=true, const ReadOptions &opts=ReadOptions());
+
+} // namespace NBT
+
+#endif // NBT_READER_HEADER
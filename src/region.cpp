@@ -0,0 +1,516 @@
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#include "region.hpp"
+#include "serialization.hpp"
+
+namespace NBT {
+
+// Each chunk starts with its length (including the compression byte) and
+// its compression type.
+constexpr UInt chunk_header_size = 5;
+// Set in the compression type of chunks stored in separate .mcc files
+constexpr UByte external_flag = 0x80;
+constexpr UInt header_sectors = 2;
+
+
+static UInt sectorsFor(ULong size)
+{
+	return (size + Region::sector_size - 1) / Region::sector_size;
+}
+
+
+/********************
+ * Con/De-structors *
+ ********************/
+
+Region::Region() :
+	file(nullptr)
+{
+	memset(offsets, 0, sizeof(offsets));
+	memset(timestamps, 0, sizeof(timestamps));
+}
+
+
+Region::~Region()
+{
+	close();
+}
+
+
+/********
+ * File *
+ ********/
+
+bool Region::open(const std::string &new_path, bool create)
+{
+	close();
+	file = std::fopen(new_path.c_str(), "r+b");
+	if (!file && create)
+		file = std::fopen(new_path.c_str(), "w+b");
+	if (!file)
+		return fail("Can't open " + new_path + ": " + std::strerror(errno));
+	path = new_path;
+	if (!readHeader()) {
+		std::string msg = err;
+		close();
+		err = msg;
+		return false;
+	}
+	return true;
+}
+
+
+bool Region::openMapped(const std::string &new_path, AccessPattern pattern)
+{
+	close();
+	if (!map.open(new_path, pattern))
+		return fail(map.error());
+	path = new_path;
+	if (map.size() < header_sectors * sector_size) {
+		close();
+		return fail(new_path + " is too small to be a region file");
+	}
+	// The header is always needed, whatever the pattern
+	map.prefetch(0, header_sectors * sector_size);
+	return parseHeader(map.data(), map.size());
+}
+
+
+void Region::close()
+{
+	if (file)
+		std::fclose(file);
+	file = nullptr;
+	map.close();
+	path.clear();
+	memset(offsets, 0, sizeof(offsets));
+	memset(timestamps, 0, sizeof(timestamps));
+	used.clear();
+}
+
+
+bool Region::readHeader()
+{
+	if (std::fseek(file, 0, SEEK_END) != 0)
+		return fail("Can't seek in " + path);
+	long size = std::ftell(file);
+	if (size < 0)
+		return fail("Can't get the size of " + path);
+	if (size == 0) {
+		// New file
+		std::string header(header_sectors * sector_size, '\0');
+		if (!writeAt(0, header.data(), header.size()))
+			return false;
+		size = header.size();
+	} else if ((ULong) size < header_sectors * sector_size) {
+		return fail(path + " is too small to be a region file");
+	}
+
+	UByte header[header_sectors * sector_size];
+	if (!readAt(0, header, sizeof(header)))
+		return false;
+	return parseHeader(header, size);
+}
+
+
+bool Region::parseHeader(const UByte *header, ULong size)
+{
+	used.assign(sectorsFor(size), false);
+	mark(0, header_sectors, true);
+	for (UInt i = 0; i < chunk_count; i++) {
+		UInt loc = readInt(header + i * 4);
+		UInt start = loc >> 8, count = loc & 0xFF;
+		// Locations that overlap the header or run past the end of the
+		// file are treated as missing chunks.
+		if (start < header_sectors || count == 0 ||
+				start + count > used.size())
+			continue;
+		offsets[i] = loc;
+		timestamps[i] = readInt(header + sector_size + i * 4);
+		mark(start, count, true);
+	}
+	return true;
+}
+
+
+bool Region::fail(const std::string &what)
+{
+	err = what;
+	return false;
+}
+
+
+bool Region::readAt(ULong pos, void *dst, size_t size)
+{
+	if (std::fseek(file, pos, SEEK_SET) != 0 ||
+			std::fread(dst, 1, size, file) != size)
+		return fail("Error reading " + path);
+	return true;
+}
+
+
+bool Region::writeAt(ULong pos, const void *src, size_t size)
+{
+	if (std::fseek(file, pos, SEEK_SET) != 0 ||
+			std::fwrite(src, 1, size, file) != size)
+		return fail("Error writing " + path);
+	return true;
+}
+
+
+bool Region::writeHeaderEntry(UInt index)
+{
+	UByte entry[4];
+	writeInt(entry, offsets[index]);
+	if (!writeAt(index * 4, entry, sizeof(entry)))
+		return false;
+	writeInt(entry, timestamps[index]);
+	return writeAt(sector_size + index * 4, entry, sizeof(entry));
+}
+
+
+/*************
+ * Allocator *
+ *************/
+
+// First fit.  If nothing fits, the chunk goes at the end of the file,
+// taking over any free sectors already there.
+UInt Region::allocate(UInt count)
+{
+	UInt run = 0;
+	for (UInt i = header_sectors; i < used.size(); i++) {
+		run = used[i] ? 0 : run + 1;
+		if (run == count)
+			return i + 1 - count;
+	}
+	return used.size() - run;
+}
+
+
+void Region::mark(UInt start, UInt count, bool in_use)
+{
+	if (start + count > used.size())
+		used.resize(start + count, false);
+	std::fill(used.begin() + start, used.begin() + start + count, in_use);
+}
+
+
+/***********
+ * Reading *
+ ***********/
+
+bool Region::readRaw(int x, int z, const char **data, size_t *size,
+		ChunkCompression *compression)
+{
+	if (!isOpen())
+		return fail("Region isn't open");
+	UInt loc = offsets[chunkIndex(x, z)];
+	if (!loc)
+		return fail("Chunk not present");
+	ULong pos = (ULong) (loc >> 8) * sector_size;
+	ULong space = (ULong) (loc & 0xFF) * sector_size;
+
+	UByte header_buf[chunk_header_size];
+	const UByte *header = header_buf;
+	if (map.isOpen()) {
+		if (pos + space > map.size())
+			return fail("Chunk runs past the end of the file");
+		header = map.data() + pos;
+	} else if (!readAt(pos, header_buf, sizeof(header_buf))) {
+		return false;
+	}
+	UInt length = readInt(header);
+	if (length == 0 || (ULong) length + 4 > space)
+		return fail("Invalid chunk length");
+	if (header[4] & external_flag)
+		return fail("Chunk is stored in an external file");
+
+	*compression = (ChunkCompression) header[4];
+	*size = length - 1;
+	if (map.isOpen()) {
+		*data = reinterpret_cast<const char *>(header + chunk_header_size);
+		return true;
+	}
+	buf.resize(*size);
+	*data = buf.data();
+	return readAt(pos + chunk_header_size, &buf[0], buf.size());
+}
+
+
+bool Region::readRaw(int x, int z, std::string *out,
+		ChunkCompression *compression)
+{
+	const char *data;
+	size_t size;
+	if (!readRaw(x, z, &data, &size, compression))
+		return false;
+	out->assign(data, size);
+	return true;
+}
+
+
+bool Region::readChunk(int x, int z, std::string *out)
+{
+	const char *data;
+	size_t size;
+	ChunkCompression compression;
+	if (!readRaw(x, z, &data, &size, &compression))
+		return false;
+	switch (compression) {
+	case ChunkCompression::None:
+		out->append(data, size);
+		return true;
+	case ChunkCompression::GZip:
+	case ChunkCompression::ZLib:
+	case ChunkCompression::LZ4:
+		// The decompressor detects the format by itself
+		if (!decompressor.decompress(out, data, size))
+			return fail(decompressor.error());
+		return true;
+	}
+	return fail("Unknown compression type");
+}
+
+
+bool Region::readChunk(int x, int z, Tag &tag, const ReadOptions &opts)
+{
+	const char *raw;
+	size_t size;
+	ChunkCompression compression;
+	if (!readRaw(x, z, &raw, &size, &compression))
+		return false;
+
+	ReadResult res{ReadError::Truncated, 0};
+	if (compression == ChunkCompression::None) {
+		// Uncompressed chunks are parsed where they are
+		if (!rootPayload(&raw, &size))
+			return fail("Chunk data isn't a compound");
+		res = tag.read(reinterpret_cast<const UByte *>(raw), size, true,
+				opts);
+	} else if (compression == ChunkCompression::GZip ||
+			compression == ChunkCompression::ZLib ||
+			compression == ChunkCompression::LZ4) {
+		// Compressed ones are parsed as they're inflated, so the whole
+		// uncompressed chunk is never held in memory
+		InflateSource src(decompressor, raw, size);
+		if (src.ok())
+			res = tag.read(src, RootName::Named, opts);
+		if (!src.finish()) {
+			tag = Tag();
+			return fail(decompressor.error());
+		}
+		if (res && tag.type != TagType::Compound) {
+			tag = Tag();
+			return fail("Chunk data isn't a compound");
+		}
+	} else {
+		return fail("Unknown compression type");
+	}
+	if (!res)
+		return fail(std::string("Invalid chunk data: ") +
+				readErrorString(res.error));
+	return true;
+}
+
+
+// Chunks hold a named root compound
+bool Region::rootPayload(const char **data, size_t *size)
+{
+	const UByte *bytes = reinterpret_cast<const UByte *>(*data);
+	if (*size < 3 || (TagType) bytes[0] != TagType::Compound)
+		return false;
+	size_t skip = 3 + readShort(bytes + 1);
+	if (skip > *size)
+		return false;
+	*data += skip;
+	*size -= skip;
+	return true;
+}
+
+
+/***********
+ * Writing *
+ ***********/
+
+bool Region::writeRaw(int x, int z, const char *data, size_t size,
+		ChunkCompression compression, UInt timestamp)
+{
+	if (!file)
+		return fail("Region isn't open for writing");
+	ULong total = (ULong) size + chunk_header_size;
+	UInt count = sectorsFor(total);
+	if (count > 0xFF)
+		return fail("Chunk is too large");
+
+	UInt index = chunkIndex(x, z);
+	UInt old_start = offsets[index] >> 8, old_count = offsets[index] & 0xFF;
+	UInt start;
+	if (offsets[index] && count <= old_count) {
+		// Rewrite in place, freeing the sectors that are no longer needed
+		start = old_start;
+		mark(start + count, old_count - count, false);
+	} else {
+		if (offsets[index])
+			mark(old_start, old_count, false);
+		start = allocate(count);
+	}
+
+	UByte header[chunk_header_size];
+	writeInt(header, size + 1);
+	header[4] = (UByte) compression;
+	ULong pos = (ULong) start * sector_size;
+	if (!writeAt(pos, header, sizeof(header)) ||
+			!writeAt(pos + sizeof(header), data, size))
+		return false;
+	// Pad to a whole sector so that the file size stays a multiple of it
+	size_t pad = (ULong) count * sector_size - total;
+	if (pad) {
+		static const char zeros[sector_size] = {};
+		if (std::fwrite(zeros, 1, pad, file) != pad)
+			return fail("Error writing " + path);
+	}
+	mark(start, count, true);
+
+	offsets[index] = start << 8 | count;
+	timestamps[index] = timestamp ? timestamp : (UInt) std::time(nullptr);
+	if (!writeHeaderEntry(index))
+		return false;
+	if (std::fflush(file) != 0)
+		return fail("Error writing " + path);
+	return true;
+}
+
+
+bool Region::writeChunk(int x, int z, const char *data, size_t size,
+		ChunkCompression compression, UInt timestamp)
+{
+	if (compression == ChunkCompression::None)
+		return writeRaw(x, z, data, size, compression, timestamp);
+	CompressionFormat format;
+	switch (compression) {
+	case ChunkCompression::GZip: format = CompressionFormat::GZip; break;
+	case ChunkCompression::ZLib: format = CompressionFormat::ZLib; break;
+	case ChunkCompression::LZ4: format = CompressionFormat::LZ4; break;
+	default: return fail("Unknown compression type");
+	}
+	std::string packed;
+	if (!compressor.reset(Z_DEFAULT_COMPRESSION, format) ||
+			!compressor.compress(&packed, data, size))
+		return fail(compressor.error());
+	return writeRaw(x, z, packed.data(), packed.size(), compression,
+			timestamp);
+}
+
+
+bool Region::writeChunk(int x, int z, const Tag &tag,
+		ChunkCompression compression, UInt timestamp)
+{
+	if (tag.type != TagType::Compound)
+		return fail("Chunk data isn't a compound");
+	buf.clear();
+	tag.writeAt(buf, 0, RootName::Named);
+	return writeChunk(x, z, buf.data(), buf.size(), compression, timestamp);
+}
+
+
+bool Region::removeChunk(int x, int z)
+{
+	UInt index = chunkIndex(x, z);
+	if (!offsets[index])
+		return true;
+	if (!file)
+		return fail("Region isn't open for writing");
+	mark(offsets[index] >> 8, offsets[index] & 0xFF, false);
+	offsets[index] = 0;
+	timestamps[index] = 0;
+	if (!writeHeaderEntry(index))
+		return false;
+	if (std::fflush(file) != 0)
+		return fail("Error writing " + path);
+	return true;
+}
+
+
+/**************
+ * Compaction *
+ **************/
+
+bool Region::compact()
+{
+	if (!file)
+		return fail("Region isn't open for writing");
+
+	// Keep the chunks in their current order, for locality
+	std::vector<UInt> order;
+	for (UInt i = 0; i < chunk_count; i++)
+		if (offsets[i])
+			order.push_back(i);
+	std::sort(order.begin(), order.end(), [this] (UInt a, UInt b) {
+		return offsets[a] < offsets[b];
+	});
+
+	std::string tmp_path = path + ".tmp";
+	std::FILE *out = std::fopen(tmp_path.c_str(), "wb");
+	if (!out)
+		return fail("Can't open " + tmp_path + ": " + std::strerror(errno));
+
+	UByte header[header_sectors * sector_size] = {};
+	bool ok = std::fwrite(header, 1, sizeof(header), out) == sizeof(header);
+	UInt next = header_sectors;
+	for (UInt i = 0; ok && i < order.size(); i++) {
+		UInt index = order[i];
+		UInt start = offsets[index] >> 8, count = offsets[index] & 0xFF;
+		// Only copy the sectors that the chunk actually uses
+		UByte len[4];
+		if (!readAt((ULong) start * sector_size, len, sizeof(len))) {
+			ok = false;
+			break;
+		}
+		UInt length = readInt(len);
+		ULong total = (ULong) length + 4;
+		if (length == 0 || total > count * sector_size) {
+			ok = fail("Invalid chunk length");
+			break;
+		}
+		count = sectorsFor(total);
+		buf.assign((size_t) count * sector_size, '\0');
+		ok = readAt((ULong) start * sector_size, &buf[0], total) &&
+			std::fwrite(buf.data(), 1, buf.size(), out) == buf.size();
+		writeInt(header + index * 4, next << 8 | count);
+		writeInt(header + sector_size + index * 4, timestamps[index]);
+		next += count;
+	}
+	if (ok) {
+		ok = std::fseek(out, 0, SEEK_SET) == 0 &&
+			std::fwrite(header, 1, sizeof(header), out) == sizeof(header);
+		if (!ok)
+			fail("Error writing " + tmp_path);
+	}
+	if (std::fclose(out) != 0 && ok)
+		ok = fail("Error writing " + tmp_path);
+	if (!ok) {
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	std::string old_path = path;
+	std::fclose(file);
+	file = nullptr;
+#ifdef _WIN32
+	std::remove(old_path.c_str());
+#endif
+	if (std::rename(tmp_path.c_str(), old_path.c_str()) != 0) {
+		std::string msg = "Can't replace " + old_path + ": " +
+				std::strerror(errno);
+		std::remove(tmp_path.c_str());
+		open(old_path, false);
+		return fail(msg);
+	}
+	return open(old_path, false);
+}
+
+} // namespace NBT
@@ -0,0 +1,118 @@
+#ifndef NBT_REGION_HEADER
+#define NBT_REGION_HEADER
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "nbt.hpp"
+#include "compression.hpp"
+#include "mapped_file.hpp"
+
+namespace NBT {
+
+// Compression type byte stored in front of each chunk
+enum class ChunkCompression : UByte {
+	GZip = 1,
+	ZLib = 2,
+	None = 3,
+	LZ4 = 4,
+};
+
+// An Anvil (.mca) or McRegion (.mcr) file: a header of 1,024 chunk
+// locations and timestamps followed by 4 KiB sectors of chunk data.
+// Only the header is read up front; chunks are read and written
+// individually.  Chunk coordinates may be given in region-local (0-31) or
+// world form, since only the low five bits are used.
+//
+// Methods return false on failure and leave a message in error().
+class Region {
+public:
+	static const UInt sector_size = 4096;
+	static const UInt chunk_count = 1024;
+
+	Region();
+	Region(const Region &) = delete;
+	Region & operator = (const Region &) = delete;
+	~Region();
+
+	// Opens (and optionally creates) a region file, reading its header
+	bool open(const std::string &path, bool create = true);
+	// Opens a region file read-only through a memory mapping, so chunks
+	// are decompressed or parsed straight from the file's pages.
+	bool openMapped(const std::string &path,
+			AccessPattern pattern = AccessPattern::Random);
+	void close();
+	bool isOpen() const { return file != nullptr || map.isOpen(); }
+
+	bool hasChunk(int x, int z) const
+		{ return offsets[chunkIndex(x, z)] != 0; }
+	UInt timestamp(int x, int z) const
+		{ return timestamps[chunkIndex(x, z)]; }
+	// Size of the file in sectors, including the header
+	UInt sectorCount() const { return used.size(); }
+
+	// Reads a chunk as stored, without decompressing it
+	bool readRaw(int x, int z, std::string *out, ChunkCompression *compression);
+	// Finds a chunk's stored data without copying it out of a mapped file.
+	// The pointer is valid until the next call or until the file is closed.
+	bool readRaw(int x, int z, const char **data, size_t *size,
+			ChunkCompression *compression);
+	// Reads a chunk's uncompressed NBT data (appended to out)
+	bool readChunk(int x, int z, std::string *out);
+	// Reads a chunk's root compound.  Compressed chunks are parsed from
+	// the decompressor's output as it's produced, so borrowed and lazy
+	// reads only apply to uncompressed ones.
+	bool readChunk(int x, int z, Tag &tag,
+			const ReadOptions &opts = ReadOptions());
+
+	// Stores already-compressed chunk data.  A timestamp of 0 means now.
+	bool writeRaw(int x, int z, const char *data, size_t size,
+			ChunkCompression compression, UInt timestamp = 0);
+	// Compresses and stores uncompressed NBT data
+	bool writeChunk(int x, int z, const char *data, size_t size,
+			ChunkCompression compression = ChunkCompression::ZLib,
+			UInt timestamp = 0);
+	// Serializes and stores a chunk's root compound
+	bool writeChunk(int x, int z, const Tag &tag,
+			ChunkCompression compression = ChunkCompression::ZLib,
+			UInt timestamp = 0);
+	bool removeChunk(int x, int z);
+
+	// Strips the name of a chunk's root compound, leaving its payload for
+	// Tag::read.  Fails if the root isn't a compound.
+	static bool rootPayload(const char **data, size_t *size);
+
+	// Rewrites the file with the chunks packed together, dropping the
+	// space left behind by moved and removed chunks.
+	bool compact();
+
+	const std::string &error() const { return err; }
+
+private:
+	static UInt chunkIndex(int x, int z) { return (x & 31) | (z & 31) << 5; }
+
+	bool fail(const std::string &what);
+	bool readAt(ULong pos, void *dst, size_t size);
+	bool writeAt(ULong pos, const void *src, size_t size);
+	bool writeHeaderEntry(UInt index);
+	bool readHeader();
+	bool parseHeader(const UByte *header, ULong file_size);
+	UInt allocate(UInt count);
+	void mark(UInt start, UInt count, bool in_use);
+
+	std::FILE *file;
+	MappedFile map;
+	std::string path;
+	UInt offsets[chunk_count];  // First sector << 8 | sector count
+	UInt timestamps[chunk_count];
+	std::vector<bool> used;  // Which sectors are taken
+	Compressor compressor;
+	Decompressor decompressor;
+	std::string buf;  // Reused for chunk data
+	std::string err;
+};
+
+} // namespace NBT
+
+#endif // NBT_REGION_HEADER
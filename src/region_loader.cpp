@@ -0,0 +1,171 @@
+
+#include <mutex>
+#include <condition_variable>
+
+#include "region_loader.hpp"
+#include "region.hpp"
+#include "compression.hpp"
+
+namespace NBT {
+
+struct RegionLoader::WorkerState {
+	Decompressor decompressor;
+	Document doc;
+	std::string data;
+};
+
+
+// A chunk located in a mapped region, ready to be handed to a worker
+struct RegionLoader::Job {
+	size_t region;
+	int x, z;
+	const char *raw;
+	size_t size;
+	ChunkCompression compression;
+	std::string error;
+};
+
+
+RegionLoader::RegionLoader(ThreadPool &pool, const ReadOptions &opts) :
+	pool(pool),
+	opts(opts)
+{
+	for (unsigned i = 0; i < pool.size(); i++)
+		workers.emplace_back(new WorkerState);
+}
+
+
+RegionLoader::~RegionLoader() {}
+
+
+bool RegionLoader::load(const std::vector<std::string> &paths,
+		const ChunkCallback &callback)
+{
+	std::vector<std::vector<std::pair<int, int>>> chunks(paths.size());
+	for (std::vector<std::pair<int, int>> &list : chunks)
+		for (int z = 0; z < 32; z++)
+			for (int x = 0; x < 32; x++)
+				list.push_back(std::make_pair(x, z));
+	return run(paths, chunks, callback, true);
+}
+
+
+bool RegionLoader::load(const std::string &path,
+		const std::vector<std::pair<int, int>> &chunks,
+		const ChunkCallback &callback)
+{
+	std::vector<std::string> paths(1, path);
+	std::vector<std::vector<std::pair<int, int>>> lists(1, chunks);
+	return run(paths, lists, callback, false);
+}
+
+
+// Regions are mapped and their chunks located up front, on the calling
+// thread, so that the workers only decompress and parse.
+bool RegionLoader::run(const std::vector<std::string> &paths,
+		const std::vector<std::vector<std::pair<int, int>>> &chunks,
+		const ChunkCallback &callback, bool whole)
+{
+	std::vector<std::unique_ptr<Region>> regions;
+	std::vector<Job> jobs;
+	for (size_t i = 0; i < paths.size(); i++) {
+		regions.emplace_back(new Region);
+		Region &region = *regions.back();
+		if (!region.openMapped(paths[i], whole ? AccessPattern::Sequential :
+				AccessPattern::Random)) {
+			err = region.error();
+			return false;
+		}
+		for (const std::pair<int, int> &pos : chunks[i]) {
+			// Whole-region loads only report the chunks that exist
+			if (whole && !region.hasChunk(pos.first, pos.second))
+				continue;
+			Job job;
+			job.region = i;
+			job.x = pos.first & 31;
+			job.z = pos.second & 31;
+			if (!region.readRaw(pos.first, pos.second, &job.raw, &job.size,
+					&job.compression)) {
+				job.raw = nullptr;
+				job.error = region.error();
+			}
+			jobs.push_back(std::move(job));
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable done;
+	size_t remaining = jobs.size();
+	for (const Job &job : jobs) {
+		const Job *j = &job;
+		pool.submit([this, j, &callback, &lock, &done, &remaining]
+				(unsigned worker) {
+			process(*workers[worker], *j, callback);
+			std::lock_guard<std::mutex> guard(lock);
+			if (--remaining == 0)
+				done.notify_all();
+		});
+	}
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [&remaining] { return remaining == 0; });
+	return true;
+}
+
+
+void RegionLoader::process(WorkerState &state, const Job &job,
+		const ChunkCallback &callback)
+{
+	LoadedChunk chunk{job.region, job.x, job.z, nullptr, job.error};
+	const char *data = job.raw;
+	size_t size = job.size;
+	bool compressed = job.compression == ChunkCompression::GZip ||
+			job.compression == ChunkCompression::ZLib ||
+			job.compression == ChunkCompression::LZ4;
+	ReadResult res{ReadError::Truncated, 0};
+
+	if (!chunk.error.empty()) {
+		// Already failed
+	} else if (compressed && !opts.borrow && !opts.lazy) {
+		// Parsed as it's inflated.  Borrowed and lazy trees point into
+		// their input, so they need the whole chunk decompressed first.
+		InflateSource src(state.decompressor, data, size);
+		if (src.ok())
+			res = state.doc.read(src, RootName::Named, opts);
+		if (!src.finish())
+			chunk.error = state.decompressor.error();
+		else if (!res)
+			chunk.error = std::string("Invalid chunk data: ") +
+					readErrorString(res.error);
+		else if (state.doc.root.type != TagType::Compound)
+			chunk.error = "Chunk data isn't a compound";
+		else
+			chunk.tag = &state.doc.root;
+		callback(chunk);
+		return;
+	} else if (compressed) {
+		state.data.clear();
+		if (state.decompressor.decompress(&state.data, data, size)) {
+			data = state.data.data();
+			size = state.data.size();
+		} else {
+			chunk.error = state.decompressor.error();
+		}
+	} else if (job.compression != ChunkCompression::None) {
+		chunk.error = "Unknown compression type";
+	}
+
+	if (chunk.error.empty()) {
+		if (!Region::rootPayload(&data, &size)) {
+			chunk.error = "Chunk data isn't a compound";
+		} else if (!(res = state.doc.read(reinterpret_cast<const UByte *>(data),
+				size, true, opts))) {
+			chunk.error = std::string("Invalid chunk data: ") +
+					readErrorString(res.error);
+		} else {
+			chunk.tag = &state.doc.root;
+		}
+	}
+	callback(chunk);
+}
+
+} // namespace NBT
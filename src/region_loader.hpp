@@ -0,0 +1,68 @@
+#ifndef NBT_REGION_LOADER_HEADER
+#define NBT_REGION_LOADER_HEADER
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <functional>
+
+#include "nbt.hpp"
+#include "thread_pool.hpp"
+
+namespace NBT {
+
+struct LoadedChunk {
+	size_t region;  // Index of the region in the load call
+	int x, z;  // Region-local coordinates
+	Tag *tag;  // nullptr if the chunk failed to load
+	std::string error;
+};
+
+// Called on the worker threads, in completion order, so it must be
+// thread-safe.  The tag only lives until the callback returns (it is
+// allocated from the worker's arena), so anything kept must be copied.
+typedef std::function<void(LoadedChunk &chunk)> ChunkCallback;
+
+// Decompresses and parses chunks of region files on a thread pool.  Each
+// worker keeps its own Decompressor and Document, which are reused from
+// chunk to chunk.  Chunks are parsed as they're inflated, unless the
+// options ask for borrowed or lazy trees, which need the whole chunk.
+class RegionLoader {
+public:
+	RegionLoader(ThreadPool &pool, const ReadOptions &opts = ReadOptions());
+	RegionLoader(const RegionLoader &) = delete;
+	RegionLoader & operator = (const RegionLoader &) = delete;
+	~RegionLoader();
+
+	// Loads every chunk of each region, returning once all of them have
+	// been delivered.  Fails if a region can't be opened, in which case
+	// nothing is loaded.
+	bool load(const std::vector<std::string> &paths,
+			const ChunkCallback &callback);
+	// Loads the given chunks of one region
+	bool load(const std::string &path,
+			const std::vector<std::pair<int, int>> &chunks,
+			const ChunkCallback &callback);
+
+	const std::string &error() const { return err; }
+
+private:
+	struct WorkerState;
+	struct Job;
+
+	bool run(const std::vector<std::string> &paths,
+			const std::vector<std::vector<std::pair<int, int>>> &chunks,
+			const ChunkCallback &callback, bool whole);
+	void process(WorkerState &state, const Job &job,
+			const ChunkCallback &callback);
+
+	ThreadPool &pool;
+	ReadOptions opts;
+	std::vector<std::unique_ptr<WorkerState>> workers;
+	std::string err;
+};
+
+} // namespace NBT
+
+#endif // NBT_REGION_LOADER_HEADER
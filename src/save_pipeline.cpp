@@ -0,0 +1,129 @@
+
+#include <stdexcept>
+
+#include "save_pipeline.hpp"
+
+namespace NBT {
+
+static ChunkCompression chunkCompression(CompressionFormat format)
+{
+	switch (format) {
+	case CompressionFormat::GZip: return ChunkCompression::GZip;
+	case CompressionFormat::LZ4: return ChunkCompression::LZ4;
+	case CompressionFormat::ZLib: return ChunkCompression::ZLib;
+	case CompressionFormat::Zstd: break;
+	}
+	throw std::invalid_argument("Regions have no compression type for Zstd");
+}
+
+
+SavePipeline::SavePipeline(Region &region, ThreadPool &pool,
+		CompressionFormat format, int level, size_t max_pending) :
+	region(region),
+	pool(pool),
+	compression(chunkCompression(format)),
+	max_pending(max_pending),
+	pending(0),
+	writing(false)
+{
+	for (unsigned i = 0; i < pool.size(); i++)
+		compressors.emplace_back(new Compressor(level, format));
+}
+
+
+SavePipeline::~SavePipeline()
+{
+	flush();
+}
+
+
+void SavePipeline::save(int x, int z, const Tag &tag, UInt timestamp)
+{
+	std::unique_ptr<Job> job(new Job);
+	job->x = x;
+	job->z = z;
+	job->timestamp = timestamp;
+	job->done = false;
+	bool failed = tag.type != TagType::Compound;
+	if (failed)
+		job->error = "Chunk data isn't a compound";
+	else
+		tag.writeAt(job->data, 0, RootName::Named);
+	job->size = job->data.size();
+
+	// Only complete() marks the job done, and until then nothing else
+	// frees it, so j stays valid after the lock is released
+	Job *j = job.get();
+	{
+		// A chunk bigger than the limit still goes through on its own
+		std::unique_lock<std::mutex> guard(lock);
+		space.wait(guard, [this, j] {
+			return pending == 0 || pending + j->size <= max_pending;
+		});
+		pending += j->size;
+		jobs.push_back(std::move(job));
+	}
+
+	if (failed) {
+		complete(*j);
+		return;
+	}
+	pool.submit([this, j] (unsigned worker) {
+		compress(*compressors[worker], *j);
+		complete(*j);
+	});
+}
+
+
+void SavePipeline::compress(Compressor &compressor, Job &job)
+{
+	std::string packed;
+	if (compressor.compress(&packed, job.data.data(), job.data.size()))
+		job.data.swap(packed);
+	else
+		job.error = compressor.error();
+}
+
+
+// Marks a job finished, then writes out the finished jobs at the front of
+// the queue, unless another thread is already doing so.  That thread
+// checks the queue again after every write, so nothing is left behind.
+void SavePipeline::complete(Job &job)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	job.done = true;
+	if (writing)
+		return;
+	writing = true;
+	while (!jobs.empty() && jobs.front()->done) {
+		std::unique_ptr<Job> next = std::move(jobs.front());
+		jobs.pop_front();
+		guard.unlock();
+
+		if (next->error.empty() && !region.writeRaw(next->x, next->z,
+				next->data.data(), next->data.size(), compression,
+				next->timestamp))
+			next->error = region.error();
+
+		guard.lock();
+		if (!next->error.empty())
+			errors.push_back(SaveError{next->x & 31, next->z & 31,
+					next->error});
+		pending -= next->size;
+		space.notify_all();
+	}
+	writing = false;
+	space.notify_all();
+}
+
+
+std::vector<SaveError> SavePipeline::flush()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	space.wait(guard, [this] { return jobs.empty() && !writing; });
+	std::vector<SaveError> result;
+	result.swap(errors);
+	return result;
+}
+
+} // namespace NBT
@@ -0,0 +1,78 @@
+#ifndef NBT_SAVE_PIPELINE_HEADER
+#define NBT_SAVE_PIPELINE_HEADER
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "nbt.hpp"
+#include "compression.hpp"
+#include "region.hpp"
+#include "thread_pool.hpp"
+
+namespace NBT {
+
+struct SaveError {
+	int x, z;
+	std::string error;
+};
+
+// Saves chunks to a region in three stages: serialization on the calling
+// thread, compression on a thread pool, and writing in the order the
+// chunks were saved.  The region must not be used directly until the
+// pipeline has been flushed.
+class SavePipeline {
+public:
+	// max_pending bounds the serialized data in flight; save() blocks
+	// until there's room for more.  Regions have no compression type for
+	// Zstd, so that format throws std::invalid_argument.
+	SavePipeline(Region &region, ThreadPool &pool,
+			CompressionFormat format = CompressionFormat::ZLib,
+			int level = Z_DEFAULT_COMPRESSION,
+			size_t max_pending = 64 * 1024 * 1024);
+	SavePipeline(const SavePipeline &) = delete;
+	SavePipeline & operator = (const SavePipeline &) = delete;
+	// Flushes, discarding any errors
+	~SavePipeline();
+
+	// Serializes the chunk before returning, so the tag can be changed or
+	// freed right away.  A timestamp of 0 means the time of the write.
+	void save(int x, int z, const Tag &tag, UInt timestamp = 0);
+
+	// Waits for every saved chunk to be written, and returns the chunks
+	// that failed since the last flush.
+	std::vector<SaveError> flush();
+
+private:
+	struct Job {
+		int x, z;
+		UInt timestamp;
+		size_t size;  // Serialized size, as counted against max_pending
+		std::string data;
+		std::string error;
+		bool done;
+	};
+
+	void compress(Compressor &compressor, Job &job);
+	void complete(Job &job);
+
+	Region &region;
+	ThreadPool &pool;
+	ChunkCompression compression;
+	size_t max_pending;
+	std::vector<std::unique_ptr<Compressor>> compressors;
+
+	std::mutex lock;  // Guards everything below
+	std::condition_variable space;  // Signalled as chunks are written
+	std::deque<std::unique_ptr<Job>> jobs;  // In save order
+	size_t pending;  // Bytes in flight
+	bool writing;  // A thread is writing out finished chunks
+	std::vector<SaveError> errors;
+};
+
+} // namespace NBT
+
+#endif // NBT_SAVE_PIPELINE_HEADER
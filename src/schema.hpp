@@ -0,0 +1,395 @@
+#ifndef NBT_SCHEMA_HEADER
+#define NBT_SCHEMA_HEADER
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "nbt.hpp"
+#include "byteswap.hpp"
+#include "reader.hpp"
+#include "serialization.hpp"
+
+namespace NBT {
+
+// Binds C++ structs to compounds, so that they can be decoded straight
+// from serialized NBT and encoded again without building a Tag tree.  A
+// schema lists a struct's fields with their keys, at global scope:
+//
+//   struct Item { std::string id; Byte count = 1; };
+//   NBT_SCHEMA(Item,
+//       NBT_FIELD(id, "id"),
+//       NBT_FIELD(count, "Count"))
+//
+// Field types map to tags as follows:
+//   Byte, Short, Int, Long, float, double: the matching scalar
+//   bool: Byte
+//   std::string: String
+//   std::vector<Byte>, std::vector<Int>, std::vector<Long>: the arrays
+//   std::vector<T> of any other type: a List of T
+//   A struct with a schema: Compound
+//   Tag: any value, read as by Tag::read
+//
+// When decoding, unknown keys are skipped and missing keys leave their
+// fields untouched.  A value of the wrong type fails with
+// ReadError::TypeMismatch.  Fields are written in the order they're listed,
+// except for Tag fields of type End.
+
+template <typename T> struct Codec;
+
+template <typename T>
+struct Field {
+	const char *name;
+	UShort len;
+	TagType (*type)(const T &x);
+	void (*read)(ReadContext &ctx, TagType tag, T &x);
+	void (*write)(std::string &out, const T &x);
+};
+
+// Specialized by NBT_SCHEMA.  fields() points list at the fields and
+// returns how many there are.
+template <typename T> struct Schema;
+
+
+/***********
+ * Helpers *
+ ***********/
+
+inline void expectType(ReadContext &ctx, TagType tag, TagType expected)
+{
+	if (tag != expected)
+		ctx.fail(ReadError::TypeMismatch);
+}
+
+
+inline void skipPayload(ReadContext &ctx, TagType tag)
+{
+	ReadOptions opts = ctx.opts;
+	opts.max_depth -= ctx.depth;
+	ReadResult res = skip(ctx.bytes + ctx.index, ctx.size - ctx.index,
+			tag, opts);
+	if (!res)
+		throw ParseError(res.error, ctx.index + res.offset);
+	ctx.index += res.offset;
+}
+
+
+inline UInt readLength(ReadContext &ctx, ULong item_size)
+{
+	ctx.need(sizeof(UInt));
+	UInt size = readInt(ctx.bytes + ctx.index);
+	ctx.index += sizeof(UInt);
+	if (size > (ctx.size - ctx.index) / item_size)
+		ctx.fail(ReadError::Truncated);
+	ctx.account(size, item_size);
+	return size;
+}
+
+
+template <typename T, typename M, M T::*member>
+TagType fieldType(const T &x)
+	{ return Codec<M>::type(x.*member); }
+
+template <typename T, typename M, M T::*member>
+void readField(ReadContext &ctx, TagType tag, T &x)
+	{ Codec<M>::read(ctx, tag, x.*member); }
+
+template <typename T, typename M, M T::*member>
+void writeField(std::string &out, const T &x)
+	{ Codec<M>::write(out, x.*member); }
+
+
+/**********
+ * Codecs *
+ **********/
+
+// Each codec gives the tag type a value is written as, and reads and
+// writes its payload.  The primary template handles structs.
+
+template <typename T>
+struct Codec {
+	static TagType type(const T &) { return TagType::Compound; }
+
+	static void read(ReadContext &ctx, TagType tag, T &x)
+	{
+		expectType(ctx, tag, TagType::Compound);
+		if (++ctx.depth > ctx.opts.max_depth)
+			ctx.fail(ReadError::TooDeep);
+		const Field<T> *fields;
+		size_t count = Schema<T>::fields(&fields);
+		size_t next = 0;
+		while (true) {
+			ctx.need(sizeof(Byte));
+			TagType t = (TagType) ctx.bytes[ctx.index];
+			ctx.index += sizeof(Byte);
+			if (t == TagType::End)
+				break;
+
+			ctx.need(sizeof(UShort));
+			UShort len = readShort(ctx.bytes + ctx.index);
+			ctx.index += sizeof(UShort);
+			ctx.need(len);
+			const char *name = reinterpret_cast<const char *>(
+					ctx.bytes + ctx.index);
+			ctx.index += len;
+
+			// Keys usually come in the order they're listed, so the
+			// search starts after the last match.
+			const Field<T> *field = nullptr;
+			for (size_t i = 0; i < count; i++) {
+				const Field<T> &f = fields[(next + i) % count];
+				if (f.len == len && !memcmp(f.name, name, len)) {
+					field = &f;
+					next = (next + i + 1) % count;
+					break;
+				}
+			}
+			if (field)
+				field->read(ctx, t, x);
+			else
+				skipPayload(ctx, t);
+		}
+		--ctx.depth;
+	}
+
+	static void write(std::string &out, const T &x)
+	{
+		const Field<T> *fields;
+		size_t count = Schema<T>::fields(&fields);
+		for (size_t i = 0; i < count; i++) {
+			const Field<T> &f = fields[i];
+			// Empty Tag fields are left out
+			TagType t = f.type(x);
+			if (t == TagType::End)
+				continue;
+			appendByte(out, (UByte) t);
+			appendString(out, f.name, f.len);
+			f.write(out, x);
+		}
+		appendByte(out, (UByte) TagType::End);
+	}
+};
+
+
+#define NBT_SCALAR_CODEC(T, tag, reader, appender, itype) \
+	template <> struct Codec<T> { \
+		static TagType type(const T &) { return tag; } \
+		static void read(ReadContext &ctx, TagType t, T &x) \
+		{ \
+			expectType(ctx, t, tag); \
+			ctx.need(sizeof(T)); \
+			x = (T) reader(ctx.bytes + ctx.index); \
+			ctx.index += sizeof(T); \
+		} \
+		static void write(std::string &out, const T &x) \
+			{ appender(out, (itype) x); } \
+	};
+
+inline UByte readUByte(const UByte *bytes) { return *bytes; }
+
+NBT_SCALAR_CODEC(Byte,   TagType::Byte,   readUByte,  appendByte,   UByte)
+NBT_SCALAR_CODEC(Short,  TagType::Short,  readShort,  appendShort,  UShort)
+NBT_SCALAR_CODEC(Int,    TagType::Int,    readInt,    appendInt,    UInt)
+NBT_SCALAR_CODEC(Long,   TagType::Long,   readLong,   appendLong,   ULong)
+NBT_SCALAR_CODEC(float,  TagType::Float,  readFloat,  appendFloat,  float)
+NBT_SCALAR_CODEC(double, TagType::Double, readDouble, appendDouble, double)
+
+#undef NBT_SCALAR_CODEC
+
+
+template <>
+struct Codec<bool> {
+	static TagType type(const bool &) { return TagType::Byte; }
+	static void read(ReadContext &ctx, TagType tag, bool &x)
+	{
+		Byte b;
+		Codec<Byte>::read(ctx, tag, b);
+		x = b != 0;
+	}
+	static void write(std::string &out, const bool &x)
+		{ appendByte(out, x); }
+};
+
+
+template <>
+struct Codec<std::string> {
+	static TagType type(const std::string &) { return TagType::String; }
+	static void read(ReadContext &ctx, TagType tag, std::string &x)
+	{
+		expectType(ctx, tag, TagType::String);
+		ctx.need(sizeof(UShort));
+		UShort len = readShort(ctx.bytes + ctx.index);
+		ctx.index += sizeof(UShort);
+		ctx.need(len);
+		x.assign(reinterpret_cast<const char *>(ctx.bytes + ctx.index), len);
+		ctx.index += len;
+	}
+	static void write(std::string &out, const std::string &x)
+	{
+		assert(x.size() <= std::numeric_limits<UShort>::max());
+		appendString(out, x.data(), x.size());
+	}
+};
+
+
+// Arrays, and Lists of scalars, are converted in bulk
+#define NBT_ARRAY_CODEC(T, tag, copy) \
+	template <> struct Codec<std::vector<T>> { \
+		static TagType type(const std::vector<T> &) { return tag; } \
+		static void read(ReadContext &ctx, TagType t, std::vector<T> &x) \
+		{ \
+			expectType(ctx, t, tag); \
+			if (tag == TagType::List) { \
+				ctx.need(sizeof(Byte)); \
+				TagType item = (TagType) ctx.bytes[ctx.index]; \
+				ctx.index += sizeof(Byte); \
+				UInt size = readLength(ctx, sizeof(T)); \
+				if (size) \
+					expectType(ctx, item, ScalarType<T>::value); \
+				x.resize(size); \
+			} else { \
+				x.resize(readLength(ctx, sizeof(T))); \
+			} \
+			copy(x.data(), ctx.bytes + ctx.index, x.size()); \
+			ctx.index += x.size() * sizeof(T); \
+		} \
+		static void write(std::string &out, const std::vector<T> &x) \
+		{ \
+			if (tag == TagType::List) \
+				appendByte(out, (UByte) ScalarType<T>::value); \
+			appendInt(out, x.size()); \
+			size_t start = out.size(); \
+			out.resize(start + x.size() * sizeof(T)); \
+			copy(&out[start], x.data(), x.size()); \
+		} \
+	};
+
+inline void copyBytes(void *dst, const void *src, size_t count)
+	{ if (count) memcpy(dst, src, count); }
+
+NBT_ARRAY_CODEC(Byte,   TagType::ByteArray, copyBytes)
+NBT_ARRAY_CODEC(Int,    TagType::IntArray,  copyBE32)
+NBT_ARRAY_CODEC(Long,   TagType::LongArray, copyBE64)
+NBT_ARRAY_CODEC(Short,  TagType::List,      copyBE16)
+NBT_ARRAY_CODEC(float,  TagType::List,      copyBE32)
+NBT_ARRAY_CODEC(double, TagType::List,      copyBE64)
+
+#undef NBT_ARRAY_CODEC
+
+
+// Other Lists are read item by item, growing the vector as they go so
+// that a bogus size can't allocate much before the data runs out.
+template <typename T>
+struct Codec<std::vector<T>> {
+	static TagType type(const std::vector<T> &) { return TagType::List; }
+
+	static void read(ReadContext &ctx, TagType tag, std::vector<T> &x)
+	{
+		expectType(ctx, tag, TagType::List);
+		if (++ctx.depth > ctx.opts.max_depth)
+			ctx.fail(ReadError::TooDeep);
+		ctx.need(sizeof(Byte) + sizeof(UInt));
+		TagType item = (TagType) ctx.bytes[ctx.index];
+		UInt size = readInt(ctx.bytes + ctx.index + sizeof(Byte));
+		ctx.index += sizeof(Byte) + sizeof(UInt);
+		ctx.account(size, sizeof(T));
+		x.clear();
+		for (UInt i = 0; i < size; i++) {
+			x.emplace_back();
+			Codec<T>::read(ctx, item, x.back());
+		}
+		--ctx.depth;
+	}
+
+	// All items must have the same type
+	static void write(std::string &out, const std::vector<T> &x)
+	{
+		appendByte(out, (UByte) (x.empty() ? TagType::End :
+				Codec<T>::type(x.front())));
+		appendInt(out, x.size());
+		for (const T &item : x)
+			Codec<T>::write(out, item);
+	}
+};
+
+
+template <>
+struct Codec<Tag> {
+	static TagType type(const Tag &x) { return x.type; }
+	static void read(ReadContext &ctx, TagType tag, Tag &x)
+	{
+		x.free();
+		x.readTag<BigEndian>(ctx, tag);
+	}
+	static void write(std::string &out, const Tag &x)
+		{ x.writePayload<BigEndian>(out); }
+};
+
+
+/**************
+ * Interfaces *
+ **************/
+
+// The root is treated as in Tag::read and Tag::write.  If decoding fails,
+// x may have been partly updated.
+template <typename T>
+ReadResult decode(const UByte *bytes, size_t len, T &x, bool compound=true,
+		const ReadOptions &opts=ReadOptions())
+{
+	ReadContext ctx(bytes, len, opts);
+	try {
+		TagType tag = TagType::Compound;
+		if (!compound) {
+			ctx.need(sizeof(Byte));
+			tag = (TagType) bytes[ctx.index];
+			ctx.index += sizeof(Byte);
+		}
+		Codec<T>::read(ctx, tag, x);
+	} catch (const ParseError &e) {
+		return ReadResult{e.error, e.offset};
+	}
+	return ReadResult{ReadError::None, ctx.index};
+}
+
+
+template <typename T>
+void encode(std::string &out, const T &x, bool write_type=false)
+{
+	if (write_type)
+		appendByte(out, (UByte) Codec<T>::type(x));
+	Codec<T>::write(out, x);
+}
+
+
+template <typename T>
+std::string encode(const T &x, bool write_type=false)
+{
+	std::string out;
+	encode(out, x, write_type);
+	return out;
+}
+
+} // namespace NBT
+
+
+#define NBT_SCHEMA(T, ...) \
+	namespace NBT { \
+	template <> struct Schema<T> { \
+		typedef T Self; \
+		static size_t fields(const Field<T> **list) \
+		{ \
+			static const Field<T> items[] = { __VA_ARGS__ }; \
+			*list = items; \
+			return sizeof(items) / sizeof(*items); \
+		} \
+	}; \
+	}
+
+// The key must be a string literal
+#define NBT_FIELD(member, key) \
+	Field<Self>{key, sizeof(key) - 1, \
+		&fieldType<Self, decltype(Self::member), &Self::member>, \
+		&readField<Self, decltype(Self::member), &Self::member>, \
+		&writeField<Self, decltype(Self::member), &Self::member>}
+
+#endif // NBT_SCHEMA_HEADER
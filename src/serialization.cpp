@@ -1,16 +1,17 @@
 
+#include <algorithm>
 #include <cstring>
+#include <limits>
 #include <sstream>
+#include <type_traits>
 
 #include "nbt.hpp"
+#include "reader.hpp"
 #include "serialization.hpp"
 
 
 namespace NBT {
 
-inline void writeByte(UByte * bytes, UByte b);
-inline void writeBytes(UByte * bytes, const UByte * write, UInt size);
-inline void writeString(UByte * bytes, const char * str, UShort size);
 inline UByte readByte(const UByte * bytes);
 
 
@@ -18,140 +19,143 @@ inline UByte readByte(const UByte * bytes);
  * Serialization *
  *****************/
 
-// Doesn't include size of tagid (always 1)
-ULong Tag::getSerializedSize() const
+std::string Tag::write(bool write_type) const
 {
-	ULong size = 0;
-	ULong i = 0;
-	switch (type) {
-	case TagType::End: return 0;
-	case TagType::Byte: return sizeof(Byte);
-	case TagType::Short: return sizeof(Short);
-	case TagType::Int: return sizeof(Int);
-	case TagType::Long: return sizeof(Long);
-	case TagType::Float: return sizeof(float);
-	case TagType::Double: return sizeof(double);
-	case TagType::ByteArray:
-		return sizeof(UInt) //Size field
-			+ value.v_byte_array.size; // Array size
-	case TagType::String:
-		return sizeof(UShort) // Size field
-			+ value.v_string.size; //String siza
-	case TagType::List:
-		for (; i < value.v_list.size; i++) {
-			size += value.v_list.value[i].getSerializedSize();
-		}
-		return sizeof(UByte) // TagID
-			+ sizeof(UInt) // Size
-			+ size; // Items
-	case TagType::Compound:
-		for (auto &it : *value.v_compound) {
-			size += 1 // Value type
-				+ 2 // String size
-				+ it.first.size() // String
-				+ it.second.getSerializedSize(); // Value
-		}
-		return size
-			+ sizeof(UByte); // End tag
-	case TagType::IntArray:
-		return sizeof(Short) // Size
-			+ value.v_int_array.size * sizeof(Int); // Ints
-	}
-	return 0;
+	return write<BigEndian>(write_type);
+}
+
+
+void Tag::write(std::string &out, bool write_type) const
+{
+	write<BigEndian>(out, write_type);
 }
 
 
+template <typename Format>
 std::string Tag::write(bool write_type) const
 {
-	ULong index = 0;
-	UInt i = 0;
-	ULong size = getSerializedSize();
+	std::string out;
+	write<Format>(out, write_type);
+	return out;
+}
+
 
+template <typename Format>
+void Tag::write(std::string &out, bool write_type) const
+{
 	if (write_type)
-		size += sizeof(Byte);
+		appendByte(out, (UByte) type);
+	writePayload<Format>(out);
+}
 
-	std::string byteStr;
-	byteStr.resize(size);
-	UByte *bytes = reinterpret_cast<UByte *>(&byteStr[0]);
-	std::string str;
 
-	if (write_type)
-		writeByte((bytes + index++), (UByte) type);
+size_t Tag::writeAt(std::string &out, size_t offset, RootName mode) const
+{
+	return writeAt<BigEndian>(out, offset, mode);
+}
+
+
+template <typename Format>
+size_t Tag::writeAt(std::string &out, size_t offset, RootName mode) const
+{
+	assert(offset <= out.size());
+	size_t end = out.size();
+	appendByte(out, (UByte) type);
+	if (mode == RootName::Named && type != TagType::End)
+		Format::appendLength(out, 0);
+	writePayload<Format>(out);
+	// Written at the end, and then moved in front of whatever follows
+	// offset, so that appending (the usual case) costs nothing extra.
+	if (offset < end)
+		std::rotate(out.begin() + offset, out.begin() + end, out.end());
+	return out.size() - end;
+}
+
+
+// Appends the tag's payload (everything but the tag ID) to out.  Children
+// are written straight into the same buffer, so each node is visited once.
+template <typename Format>
+void Tag::writePayload(std::string &out) const
+{
+	UInt i = 0;
+
+	// Lazy subtrees hold BigEndian data, so other formats decode them
+	if (flags & FlagLazy) {
+		if (std::is_same<Format, BigEndian>::value) {
+			appendBytes(out, value.v_lazy.bytes, value.v_lazy.size);
+			return;
+		}
+		materialize();
+	}
 
 	switch (type) {
 	case TagType::End:
 		break;
 	case TagType::Byte:
-		writeByte(bytes + index, value.v_byte);
+		appendByte(out, value.v_byte);
 		break;
 	case TagType::Short:
-		writeShort(bytes + index, value.v_short);
+		Format::appendShort(out, value.v_short);
 		break;
 	case TagType::Int:
-		writeInt(bytes + index, value.v_int);
+		Format::appendInt(out, value.v_int);
 		break;
 	case TagType::Long:
-		writeLong(bytes + index, value.v_long);
+		Format::appendLong(out, value.v_long);
 		break;
 	case TagType::Float:
-		writeFloat(bytes + index, value.v_float);
+		Format::appendFloat(out, value.v_float);
 		break;
 	case TagType::Double:
-		writeDouble(bytes + index, value.v_double);
+		Format::appendDouble(out, value.v_double);
 		break;
 	case TagType::ByteArray:
-		writeInt(bytes + index, value.v_byte_array.size);
-		index += sizeof(Int);
-		writeBytes(bytes + index, (UByte *) value.v_byte_array.value,
+		Format::appendSize(out, value.v_byte_array.size);
+		appendBytes(out, value.v_byte_array.value,
 				value.v_byte_array.size);
 		break;
 	case TagType::String:
-		writeString(bytes + index, value.v_string.value, value.v_string.size);
+		Format::appendLength(out, value.v_string.size);
+		appendBytes(out, value.v_string.value, value.v_string.size);
 		break;
 	case TagType::List:
-		writeByte(bytes + index, (UByte) value.v_list.tagid);
-		index += sizeof(Byte);
-		writeInt(bytes + index, value.v_list.size);
-		index += sizeof(Int);
+		appendByte(out, (UByte) value.v_list.tagid);
+		Format::appendSize(out, value.v_list.size);
+		if (flags & FlagPacked) {
+			Format::appendItems(out, value.v_packed.data,
+					value.v_packed.tagid, value.v_packed.size);
+			break;
+		}
 		for (; i < value.v_list.size; i++) {
-			str = value.v_list.value[i].write();
-			writeBytes(bytes + index,
-				reinterpret_cast<const UByte *>(str.data()),
-				str.size());
-			index += str.size();
+			value.v_list.value[i].writePayload<Format>(out);
 		}
 		break;
 	case TagType::Compound:
 		for (auto &it : *value.v_compound) {
-			writeByte(bytes + index, (UByte) it.second.type);
-			index += sizeof(Byte);
-			writeString(bytes + index, it.first.data(), it.first.size());
-			index += sizeof(Short) + it.first.size();
-			str = it.second.write();
-			writeBytes(bytes + index,
-				reinterpret_cast<const UByte *>(str.data()),
-				str.size());
-			index += str.size();
+			appendByte(out, (UByte) it.second.type);
+			Format::appendLength(out, it.first.size());
+			appendBytes(out, it.first.data(), it.first.size());
+			it.second.writePayload<Format>(out);
 		}
-		writeByte(bytes + index, (UByte) TagType::End);
+		appendByte(out, (UByte) TagType::End);
 		break;
 	case TagType::IntArray:
-		writeInt(bytes + index, value.v_int_array.size);
-		index += sizeof(Int);
-		// Can't use memcpy, since you have to account for endianess
-		for (; i < value.v_int_array.size; i++) {
-			writeInt(bytes + index, value.v_int_array.value[i]);
-			index += sizeof(Int);
-		}
+		Format::appendSize(out, value.v_int_array.size);
+		Format::appendItems(out, value.v_int_array.value, TagType::Int,
+				value.v_int_array.size);
+		break;
+	case TagType::LongArray:
+		Format::appendSize(out, value.v_long_array.size);
+		Format::appendItems(out, value.v_long_array.value, TagType::Long,
+				value.v_long_array.size);
 		break;
 	}
-
-	return byteStr;
 }
 
 
 std::string Tag::dump(const std::string &indent, UByte level) const
 {
+	materialize();
 	bool first = true;
 	std::ostringstream os;
 
@@ -211,7 +215,9 @@ std::string Tag::dump(const std::string &indent, UByte level) const
 		for (UInt i = 0; i < value.v_list.size; i++) {
 			if (i != 0)
 				os << sep_str;
-			os << idt_str << value.v_list.value[i].dump(indent, level+1);
+			// Packed items are dumped from copies, leaving the list as is
+			os << idt_str << (packed() ? listItem(i).dump(indent, level+1) :
+					value.v_list.value[i].dump(indent, level+1));
 		}
 		os << end_idt_str << ']';
 		break;
@@ -235,6 +241,15 @@ std::string Tag::dump(const std::string &indent, UByte level) const
 		}
 		os << end_idt_str << ']';
 		break;
+	case TagType::LongArray:
+		os << "long[";
+		for (UInt i = 0; i < value.v_long_array.size; i++) {
+			if (i != 0)
+				os << sep_str;
+			os << idt_str << value.v_long_array.value[i];
+		}
+		os << end_idt_str << ']';
+		break;
 	default:
 		os << "<UNKNOWN TAG>";
 	}
@@ -242,95 +257,330 @@ std::string Tag::dump(const std::string &indent, UByte level) const
 }
 
 
-inline void writeBytes(UByte * bytes, const UByte * write, UInt size)
+/*******************
+ * Deserialization *
+ *******************/
+
+const char *readErrorString(ReadError error)
 {
-	memcpy(bytes, write, size);
+	switch (error) {
+	case ReadError::None: return "No error";
+	case ReadError::Truncated: return "Unexpected end of data";
+	case ReadError::InvalidType: return "Invalid tag type";
+	case ReadError::TooDeep: return "Maximum nesting depth exceeded";
+	case ReadError::TooManyElements: return "Maximum element count exceeded";
+	case ReadError::TooLarge: return "Maximum allocation size exceeded";
+	case ReadError::TypeMismatch: return "Unexpected tag type";
+	case ReadError::Syntax: return "Syntax error";
+	}
+	return "Unknown error";
 }
 
 
-inline void writeByte(UByte * bytes, UByte b)
+ParseError::ParseError(ReadError error, ULong offset) :
+	std::runtime_error(std::string(readErrorString(error)) +
+			" at " + std::to_string(offset)),
+	error(error),
+	offset(offset)
+{}
+
+
+ReadOptions ReadOptions::unlimited()
 {
-	bytes[0] = b;
+	ReadOptions opts;
+	opts.max_depth = std::numeric_limits<UInt>::max();
+	opts.max_elements = std::numeric_limits<UInt>::max();
+	opts.max_alloc = std::numeric_limits<ULong>::max();
+	return opts;
 }
 
 
-inline void writeString(UByte * bytes, const char * str, UShort size)
+// Big enough for most fields, and small enough to stay in cache
+static const size_t stream_window = 16 * 1024;
+
+ReadContext::ReadContext(Source &src, const ReadOptions &opts) :
+	bytes(nullptr), size(0), index(0), depth(0), allocated(0), opts(opts),
+	source(&src), window(stream_window), base(0)
 {
-	writeShort(bytes, size);
-	writeBytes(bytes + sizeof(Short), (const UByte *) str, size);
+	this->opts.borrow = false;
+	this->opts.lazy = false;
+	bytes = window.data();
 }
 
 
-/*******************
- * Deserialization *
- *******************/
+void ReadContext::more(ULong n)
+{
+	if (!source)
+		fail(ReadError::Truncated);
+	// Move what's left to the front, then top it up.  The window grows
+	// with the data that actually arrives, so that a forged length fails
+	// at the end of the input instead of allocating for it up front.
+	size_t left = size - index;
+	memmove(window.data(), window.data() + index, left);
+	base += index;
+	index = 0;
+	size = left;
+	while (size < n) {
+		if (size == window.size())
+			window.resize(std::min<ULong>(window.size() * 2, n));
+		size_t got = source->read(window.data() + size, window.size() - size);
+		if (!got) {
+			bytes = window.data();
+			fail(ReadError::Truncated);
+		}
+		size += got;
+	}
+	bytes = window.data();
+}
+
 
 void Tag::read(const UByte *bytes, bool compound)
+{
+	// Without a length nothing can be checked, so this trusts the data
+	ReadContext ctx(bytes, std::numeric_limits<ULong>::max(),
+			ReadOptions::unlimited());
+	readRoot<BigEndian>(ctx, compound);
+}
+
+
+ReadResult Tag::read(const UByte *bytes, size_t len, bool compound,
+		const ReadOptions &opts)
+{
+	return read<BigEndian>(bytes, len, compound, opts);
+}
+
+
+template <typename Format>
+ReadResult Tag::read(const UByte *bytes, size_t len, bool compound,
+		const ReadOptions &opts)
+{
+	ReadContext ctx(bytes, len, opts);
+	try {
+		readRoot<Format>(ctx, compound);
+	} catch (const ParseError &e) {
+		free();
+		return ReadResult{e.error, e.offset};
+	}
+	return ReadResult{ReadError::None, ctx.offset()};
+}
+
+
+ReadResult Document::read(const UByte *bytes, size_t len, bool compound,
+		ReadOptions opts)
+{
+	return read<BigEndian>(bytes, len, compound, opts);
+}
+
+
+template <typename Format>
+ReadResult Document::read(const UByte *bytes, size_t len, bool compound,
+		ReadOptions opts)
+{
+	clear();
+	opts.arena = &arena;
+	return root.read<Format>(bytes, len, compound, opts);
+}
+
+
+ReadResult Tag::readAt(const UByte *bytes, size_t len, size_t offset,
+		RootName mode, const ReadOptions &opts)
+{
+	return readAt<BigEndian>(bytes, len, offset, mode, opts);
+}
+
+
+template <typename Format>
+ReadResult Tag::readAt(const UByte *bytes, size_t len, size_t offset,
+		RootName mode, const ReadOptions &opts)
+{
+	free();
+	if (offset > len)
+		return ReadResult{ReadError::Truncated, 0};
+	ReadContext ctx(bytes + offset, len - offset, opts);
+	return readValue<Format>(ctx, mode);
+}
+
+
+ReadResult Tag::read(Source &src, RootName mode, const ReadOptions &opts)
+{
+	return read<BigEndian>(src, mode, opts);
+}
+
+
+template <typename Format>
+ReadResult Tag::read(Source &src, RootName mode, const ReadOptions &opts)
+{
+	free();
+	ReadContext ctx(src, opts);
+	return readValue<Format>(ctx, mode);
+}
+
+
+// Reads a whole value, with its type and maybe a name
+template <typename Format>
+ReadResult Tag::readValue(ReadContext &ctx, RootName mode)
+{
+	try {
+		TagType tag = (TagType) readByte(ctx.take(sizeof(Byte)));
+		if (mode == RootName::Named && tag != TagType::End)
+			ctx.skip(Format::readLength(ctx));
+		readTag<Format>(ctx, tag);
+	} catch (const ParseError &e) {
+		free();
+		return ReadResult{e.error, e.offset};
+	}
+	return ReadResult{ReadError::None, ctx.offset()};
+}
+
+
+ReadResult Document::readAt(const UByte *bytes, size_t len, size_t offset,
+		RootName mode, ReadOptions opts)
+{
+	return readAt<BigEndian>(bytes, len, offset, mode, opts);
+}
+
+
+template <typename Format>
+ReadResult Document::readAt(const UByte *bytes, size_t len, size_t offset,
+		RootName mode, ReadOptions opts)
+{
+	clear();
+	opts.arena = &arena;
+	return root.readAt<Format>(bytes, len, offset, mode, opts);
+}
+
+
+ReadResult Document::read(Source &src, RootName mode, ReadOptions opts)
+{
+	return read<BigEndian>(src, mode, opts);
+}
+
+
+template <typename Format>
+ReadResult Document::read(Source &src, RootName mode, ReadOptions opts)
+{
+	clear();
+	opts.arena = &arena;
+	return root.read<Format>(src, mode, opts);
+}
+
+
+template <typename Format>
+void Tag::readRoot(ReadContext &ctx, bool compound)
 {
 	free();
-	ULong index = 0;
 	// Strictly, the root NBT tag must be Compound, but it's theoretically
 	// possible to store other values directly as the root element.
-	if (compound) {
-		readTag(bytes, index, TagType::Compound);
-	} else {
-		TagType tag = (TagType) readByte(bytes);
-		index += sizeof(Byte);
-		readTag(bytes, index, tag);
-	}
+	if (compound)
+		readTag<Format>(ctx, TagType::Compound);
+	else
+		readTag<Format>(ctx, (TagType) readByte(ctx.take(sizeof(Byte))));
 }
 
 
-void Tag::readTag(const UByte *bytes, ULong &index, TagType tag)
+// The tag's type is only set once its value is in a state that free() can
+// clean up, so that a failed read never leaks or frees garbage.
+template <typename Format>
+void Tag::readTag(ReadContext &ctx, TagType tag)
 {
-	type = tag;
 	switch (tag) {
 	case TagType::End:
 		break;
 	case TagType::Byte:
-		value.v_byte = readByte(bytes + index);
-		index += sizeof(Byte);
+		value.v_byte = readByte(ctx.take(sizeof(Byte)));
 		break;
 	case TagType::Short:
-		value.v_short = readShort(bytes + index);
-		index += sizeof(Short);
+		value.v_short = Format::readShort(ctx);
 		break;
 	case TagType::Int:
-		value.v_int = readInt(bytes + index);
-		index += sizeof(Int);
+		value.v_int = Format::readInt(ctx);
 		break;
 	case TagType::Long:
-		value.v_long = readLong(bytes + index);
-		index += sizeof(Long);
+		value.v_long = Format::readLong(ctx);
 		break;
 	case TagType::Float:
-		value.v_float = readFloat(bytes + index);
-		index += sizeof(float);
+		value.v_float = Format::readFloat(ctx);
 		break;
 	case TagType::Double:
-		value.v_double = readDouble(bytes + index);
-		index += sizeof(double);
+		value.v_double = Format::readDouble(ctx);
 		break;
 	case TagType::ByteArray:
-		value.v_byte_array = readByteArray(bytes, index);
+		value.v_byte_array = readByteArray<Format>(ctx);
+		capacity = value.v_byte_array.size;
+		if ((ctx.opts.borrow || ctx.opts.arena) && value.v_byte_array.size)
+			flags |= FlagBorrowed;
 		break;
 	case TagType::String:
-		value.v_string = readString(bytes, index);
+		value.v_string = readString<Format>(ctx);
+		if ((ctx.opts.borrow || ctx.opts.arena) && value.v_string.size)
+			flags |= FlagBorrowed;
 		break;
 	case TagType::List:
-		value.v_list = readList(bytes, index);
-		break;
+		value.v_list.size = 0;
+		if (ctx.opts.arena)
+			flags |= FlagBorrowed;
+		type = tag;
+		readList<Format>(ctx, *this);
+		return;
 	case TagType::Compound:
-		value.v_compound = readCompound(bytes, index);
-		break;
+		if (ctx.opts.arena) {
+			void *mem = ctx.opts.arena->allocate(sizeof(Compound),
+					alignof(Compound));
+			value.v_compound = new (mem) Compound(
+					Compound::allocator_type(ctx.opts.arena));
+			flags |= FlagBorrowed;
+		} else {
+			value.v_compound = new Compound;
+		}
+		type = tag;
+		readCompound<Format>(ctx, *value.v_compound);
+		return;
 	case TagType::IntArray:
-		value.v_int_array = readIntArray(bytes, index);
+		value.v_int_array = readIntArray<Format>(ctx);
+		capacity = value.v_int_array.size;
+		if (ctx.opts.arena && value.v_int_array.size)
+			flags |= FlagBorrowed;
+		break;
+	case TagType::LongArray:
+		value.v_long_array = readLongArray<Format>(ctx);
+		capacity = value.v_long_array.size;
+		if (ctx.opts.arena && value.v_long_array.size)
+			flags |= FlagBorrowed;
 		break;
 	default:
-		throw std::runtime_error("Invalid tag type " +
-			std::to_string((int)tag) +
-			" at " + std::to_string(index));
+		ctx.fail(ReadError::InvalidType);
 	}
+	type = tag;
+}
+
+
+// Records where a subtree is, after checking that it's well-formed
+void Tag::readLazy(ReadContext &ctx, TagType tag)
+{
+	ReadOptions opts = ctx.opts;
+	opts.max_depth -= ctx.depth;
+	ULong start = ctx.index;
+	ReadResult res = skip(ctx.bytes + start, ctx.size - start, tag, opts);
+	if (!res)
+		throw ParseError(res.error, start + res.offset);
+	ctx.index += res.offset;
+	value.v_lazy.bytes = ctx.bytes + start;
+	value.v_lazy.size = res.offset;
+	flags |= FlagLazy;
+	type = tag;
+}
+
+
+void Tag::decodeLazy(bool lazy)
+{
+	LazyValue raw = value.v_lazy;
+	TagType tag = type;
+	type = TagType::End;
+	flags = 0;
+	ReadOptions opts = ReadOptions::unlimited();
+	opts.lazy = lazy;
+	ReadContext ctx(raw.bytes, raw.size, opts);
+	readTag<BigEndian>(ctx, tag);
 }
 
 
@@ -340,50 +590,168 @@ inline UByte readByte(const UByte * bytes)
 }
 
 
-ByteArray readByteArray(const UByte *bytes, ULong &index)
+// Allocates storage for an array payload from the read's arena if it has
+// one, or from the heap otherwise.
+template <typename T>
+static T *allocate(ReadContext &ctx, UInt count)
+{
+	if (ctx.opts.arena)
+		return static_cast<T *>(ctx.opts.arena->allocate(
+				count * sizeof(T), alignof(T)));
+	return new T[count];
+}
+
+
+template <typename T>
+static void release(ReadContext &ctx, T *items)
+{
+	if (!ctx.opts.arena)
+		delete [] items;
+}
+
+
+// Reads count scalars of the given type into storage of T units, which
+// grows batch by batch in a stream.
+template <typename Format, typename T>
+static T *readScalars(ReadContext &ctx, TagType tag, UInt count)
+{
+	size_t item = Tag::itemSize(tag);
+	auto units = [item] (UInt n) {
+		return (n * item + sizeof(T) - 1) / sizeof(T);
+	};
+	UInt cap = ctx.batch(count);
+	UInt done = 0;
+	T *items = allocate<T>(ctx, units(cap));
+	try {
+		while (true) {
+			Format::readItems(ctx, reinterpret_cast<UByte *>(items) +
+					done * item, tag, cap - done);
+			done = cap;
+			if (done == count)
+				return items;
+			cap = std::min<ULong>((ULong) cap * 2, count);
+			T *grown = allocate<T>(ctx, units(cap));
+			memcpy(grown, items, done * item);
+			release(ctx, items);
+			items = grown;
+		}
+	} catch (const ParseError &) {
+		release(ctx, items);
+		throw;
+	}
+}
+
+
+static Tag *allocateTags(ReadContext &ctx, UInt count)
+{
+	if (!ctx.opts.arena)
+		return new Tag[count];
+	Tag *tags = static_cast<Tag *>(ctx.opts.arena->allocate(
+			count * sizeof(Tag), alignof(Tag)));
+	for (UInt i = 0; i < count; i++)
+		new (&tags[i]) Tag;
+	return tags;
+}
+
+
+template <typename Format>
+ByteArray readByteArray(ReadContext &ctx)
 {
 	ByteArray x;
-	x.size = readInt(bytes + index);
-	index += sizeof(Int);
-	x.value = new Byte[x.size];
-	for (UInt i = 0; i < x.size; i++) {
-		x.value[i] = readByte(bytes + index);
-		index += sizeof(Byte);
+	x.size = Format::readSize(ctx);
+	// Limits come first, since need() buffers all of a stream's payload
+	ctx.account(x.size, ctx.opts.borrow ? 0 : sizeof(Byte));
+	ctx.need(x.size);
+	if (ctx.opts.borrow) {
+		x.value = (Byte *) (ctx.bytes + ctx.index);
+		ctx.index += x.size;
+		return x;
 	}
+	if (!x.size)
+		return x;
+	x.value = allocate<Byte>(ctx, x.size);
+	memcpy(x.value, ctx.bytes + ctx.index, x.size);
+	ctx.index += x.size;
 	return x;
 }
 
 
-String readString(const UByte *bytes, ULong &index)
+template <typename Format>
+String readString(ReadContext &ctx)
 {
 	String x;
-	x.size = readShort(bytes + index);
-	index += sizeof(Short);
-	if (!x.size)
+	x.size = Format::readLength(ctx);
+	// Limits come first, since need() buffers all of a stream's payload
+	ctx.account(x.size, ctx.opts.borrow ? 0 : sizeof(char));
+	ctx.need(x.size);
+	if (ctx.opts.borrow) {
+		x.value = (char *) (ctx.bytes + ctx.index);
+		ctx.index += x.size;
 		return x;
-	x.value = new char[x.size];
-	for (UShort i = 0; i < x.size; i++) {
-		x.value[i] = readByte(bytes + index);
-		index += sizeof(Byte);
 	}
+	if (!x.size)
+		return x;
+	x.value = allocate<char>(ctx, x.size);
+	memcpy(x.value, ctx.bytes + ctx.index, x.size);
+	ctx.index += x.size;
 	return x;
 }
 
 
-List readList(const UByte *bytes, ULong &index)
+template <typename Format>
+void readList(ReadContext &ctx, Tag &t)
 {
-	List x;
-	x.tagid = (TagType) readByte(bytes + index);
-	index += sizeof(Byte);
-	x.size = readInt(bytes + index);
-	index += sizeof(Int);
-	if (x.size > 0) {
-		x.value = new Tag[x.size];
+	List &x = t.value.v_list;
+	if (++ctx.depth > ctx.opts.max_depth)
+		ctx.fail(ReadError::TooDeep);
+	ctx.need(sizeof(Byte));
+	x.tagid = (TagType) readByte(ctx.bytes + ctx.index);
+	if (x.tagid > TagType::LongArray)
+		ctx.fail(ReadError::InvalidType);
+	ctx.index += sizeof(Byte);
+	UInt size = Format::readSize(ctx);
+	if (size > 0 && x.tagid == TagType::End)
+		ctx.fail(ReadError::InvalidType);
+	// Check that the items can fit before allocating them
+	if (size > 0 && size > ctx.left() / Format::minSize(x.tagid))
+		ctx.fail(ReadError::Truncated);
+	if (Tag::itemSize(x.tagid)) {
+		// Scalars are stored packed, and converted all at once
+		UInt item = Tag::itemSize(x.tagid);
+		ctx.account(size, item);
+		t.flags |= Tag::FlagPacked;
+		if (size > 0) {
+			t.value.v_packed.data = readScalars<Format, ULong>(ctx,
+					x.tagid, size);
+			x.size = t.capacity = size;
+		}
+		--ctx.depth;
+		return;
 	}
-	for (UInt i = 0; i < x.size; i++) {
-		x.value[i].readTag(bytes, index, x.tagid);
+	ctx.account(size, sizeof(Tag));
+	if (size > 0) {
+		x.value = allocateTags(ctx, ctx.batch(size));
+		x.size = t.capacity = ctx.batch(size);
 	}
-	return x;
+	for (UInt i = 0; i < size; i++) {
+		if (i == t.capacity) {
+			// The next batch of a stream
+			UInt cap = std::min<ULong>((ULong) i * 2, size);
+			Tag *items = allocateTags(ctx, cap);
+			for (UInt j = 0; j < i; j++)
+				items[j] = std::move(x.value[j]);
+			if (ctx.opts.arena) {
+				for (UInt j = 0; j < i; j++)
+					x.value[j].~Tag();
+			} else {
+				delete [] x.value;
+			}
+			x.value = items;
+			x.size = t.capacity = cap;
+		}
+		x.value[i].readTag<Format>(ctx, x.tagid);
+	}
+	--ctx.depth;
 }
 
 
@@ -399,44 +767,89 @@ List readList(const UByte *bytes, ULong &index)
  * TagType entrytype = TagType::End
  */
 
-Compound *readCompound(const UByte *bytes, ULong &index)
+template <typename Format>
+void readCompound(ReadContext &ctx, Compound &x)
 {
-	Compound *x = new Compound;
+	if (++ctx.depth > ctx.opts.max_depth)
+		ctx.fail(ReadError::TooDeep);
 	TagType tag;
 	while (true) {
-		tag = (TagType) readByte(bytes + index);
-		index += sizeof(Byte);
+		tag = (TagType) readByte(ctx.take(sizeof(Byte)));
 		if (tag == TagType::End)
 			break;
 
-		String name = readString(bytes, index);
-		std::string name_str;
-		if (name.size)
-			name_str.assign(name.value, name.size);
+		UShort name_size = Format::readLength(ctx);
+		const char *name = reinterpret_cast<const char *>(
+				ctx.take(name_size));
+
+		ctx.account(1, sizeof(Compound::value_type));
+		if (x.size() >= ctx.opts.max_elements)
+			ctx.fail(ReadError::TooManyElements);
+
+		// Interning usually finds the key without allocating
+		Tag &t = x.findOrInsert(Key(name, name_size));
+		t.free();  // In case of duplicate keys
+		// Lazy subtrees are decoded as BigEndian
+		if (std::is_same<Format, BigEndian>::value && ctx.opts.lazy &&
+				(tag == TagType::Compound || tag == TagType::List))
+			t.readLazy(ctx, tag);
+		else
+			t.readTag<Format>(ctx, tag);
+	}
+	--ctx.depth;
+}
 
-		(*x)[name_str].readTag(bytes, index, tag);
 
-		if (name.size)
-			delete [] name.value;
-	}
+template <typename Format>
+IntArray readIntArray(ReadContext &ctx)
+{
+	IntArray x;
+	x.size = Format::readSize(ctx);
+	if (x.size > ctx.left() / Format::minSize(TagType::Int))
+		ctx.fail(ReadError::Truncated);
+	ctx.account(x.size, sizeof(Int));
+	if (x.size > 0)
+		x.value = readScalars<Format, Int>(ctx, TagType::Int, x.size);
 	return x;
 }
 
 
-IntArray readIntArray(const UByte *bytes, ULong &index)
+template <typename Format>
+LongArray readLongArray(ReadContext &ctx)
 {
-	IntArray x;
-	x.size = readInt(bytes + index);
-	index += sizeof(Int);
-	if (x.size > 0) {
-		x.value = new Int[x.size];
-	}
-	for (UInt i = 0; i < x.size; i++) {
-		x.value[i] = readInt(bytes + index);
-		index += sizeof(Int);
-	}
+	LongArray x;
+	x.size = Format::readSize(ctx);
+	if (x.size > ctx.left() / Format::minSize(TagType::Long))
+		ctx.fail(ReadError::Truncated);
+	ctx.account(x.size, sizeof(Long));
+	if (x.size > 0)
+		x.value = readScalars<Format, Long>(ctx, TagType::Long, x.size);
 	return x;
 }
 
-} // namespace NBT
 
+#define NBT_INSTANTIATE(Format) \
+	template ReadResult Tag::read<Format>(const UByte *, size_t, bool, \
+			const ReadOptions &); \
+	template std::string Tag::write<Format>(bool) const; \
+	template void Tag::write<Format>(std::string &, bool) const; \
+	template void Tag::writePayload<Format>(std::string &) const; \
+	template void Tag::readTag<Format>(ReadContext &, TagType); \
+	template ReadResult Document::read<Format>(const UByte *, size_t, bool, \
+			ReadOptions); \
+	template ReadResult Tag::readAt<Format>(const UByte *, size_t, size_t, \
+			RootName, const ReadOptions &); \
+	template size_t Tag::writeAt<Format>(std::string &, size_t, \
+			RootName) const; \
+	template ReadResult Document::readAt<Format>(const UByte *, size_t, \
+			size_t, RootName, ReadOptions); \
+	template ReadResult Tag::read<Format>(Source &, RootName, \
+			const ReadOptions &); \
+	template ReadResult Document::read<Format>(Source &, RootName, \
+			ReadOptions);
+
+NBT_INSTANTIATE(BigEndian)
+NBT_INSTANTIATE(LittleEndian)
+NBT_INSTANTIATE(NetworkLittleEndian)
+
+} // namespace NBT
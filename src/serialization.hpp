@@ -1,38 +1,458 @@
 #ifndef NBT_SERIALIZATION_HEADER
 #define NBT_SERIALIZATION_HEADER
 
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "byteswap.hpp"
 #include "endian.hpp"
 
 namespace NBT {
 
-#define NBT_WRITER(name, type, func) \
-	inline void write##name(UByte * bytes, type i) \
-		{ *reinterpret_cast<type *>(bytes) = func(i); }
+class Source;
+
+// The conversions go through an integer of the same width so that floats
+// are byte-swapped rather than numerically converted, and through memcpy
+// since the buffers aren't necessarily aligned.
+#define NBT_WRITER(name, type, itype, func) \
+	inline void write##name(UByte * bytes, type x) \
+	{ \
+		itype i; \
+		memcpy(&i, &x, sizeof(i)); \
+		i = func(i); \
+		memcpy(bytes, &i, sizeof(i)); \
+	}
 
-NBT_WRITER(Short,  UShort, htobe16)
-NBT_WRITER(Int,    UInt,   htobe32)
-NBT_WRITER(Long,   ULong,  htobe64)
-NBT_WRITER(Float,  float,  htobe32)
-NBT_WRITER(Double, double, htobe64)
+NBT_WRITER(Short,  UShort, UShort, htobe16)
+NBT_WRITER(Int,    UInt,   UInt,   htobe32)
+NBT_WRITER(Long,   ULong,  ULong,  htobe64)
+NBT_WRITER(Float,  float,  UInt,   htobe32)
+NBT_WRITER(Double, double, ULong,  htobe64)
 
+NBT_WRITER(ShortLE,  UShort, UShort, htole16)
+NBT_WRITER(IntLE,    UInt,   UInt,   htole32)
+NBT_WRITER(LongLE,   ULong,  ULong,  htole64)
+NBT_WRITER(FloatLE,  float,  UInt,   htole32)
+NBT_WRITER(DoubleLE, double, ULong,  htole64)
 
-#define NBT_READER(name, type, func) \
+
+#define NBT_READER(name, type, itype, func) \
 	inline type read##name(const UByte * bytes) \
-		{ return func(*reinterpret_cast<const type *>(bytes)); }
-
-NBT_READER(Short,  UShort, be16toh)
-NBT_READER(Int,    UInt,   be32toh)
-NBT_READER(Long,   ULong,  be64toh)
-NBT_READER(Float,  float,  be32toh)
-NBT_READER(Double, double, be64toh)
-
-// The following take a reference to the index becuase they can read a
-// variable amount of data and have to update the main index appropriately.
-extern ByteArray  readByteArray(const UByte * bytes, ULong & index);
-extern String     readString   (const UByte * bytes, ULong & index);
-extern List       readList     (const UByte * bytes, ULong & index);
-extern Compound * readCompound (const UByte * bytes, ULong & index);
-extern IntArray   readIntArray (const UByte * bytes, ULong & index);
+	{ \
+		itype i; \
+		memcpy(&i, bytes, sizeof(i)); \
+		i = func(i); \
+		type x; \
+		memcpy(&x, &i, sizeof(x)); \
+		return x; \
+	}
+
+NBT_READER(Short,  UShort, UShort, be16toh)
+NBT_READER(Int,    UInt,   UInt,   be32toh)
+NBT_READER(Long,   ULong,  ULong,  be64toh)
+NBT_READER(Float,  float,  UInt,   be32toh)
+NBT_READER(Double, double, ULong,  be64toh)
+
+NBT_READER(ShortLE,  UShort, UShort, le16toh)
+NBT_READER(IntLE,    UInt,   UInt,   le32toh)
+NBT_READER(LongLE,   ULong,  ULong,  le64toh)
+NBT_READER(FloatLE,  float,  UInt,   le32toh)
+NBT_READER(DoubleLE, double, ULong,  le64toh)
+
+
+// Appenders grow the output buffer as they go, so a whole tree can be
+// serialized in a single pass without sizing it first.
+#define NBT_APPENDER(name, type) \
+	inline void append##name(std::string & out, type x) \
+	{ \
+		UByte bytes[sizeof(type)]; \
+		write##name(bytes, x); \
+		out.append(reinterpret_cast<const char *>(bytes), sizeof(bytes)); \
+	}
+
+NBT_APPENDER(Short,  UShort)
+NBT_APPENDER(Int,    UInt)
+NBT_APPENDER(Long,   ULong)
+NBT_APPENDER(Float,  float)
+NBT_APPENDER(Double, double)
+
+NBT_APPENDER(ShortLE,  UShort)
+NBT_APPENDER(IntLE,    UInt)
+NBT_APPENDER(LongLE,   ULong)
+NBT_APPENDER(FloatLE,  float)
+NBT_APPENDER(DoubleLE, double)
+
+inline void appendByte(std::string & out, UByte b)
+	{ out.push_back(static_cast<char>(b)); }
+
+inline void appendBytes(std::string & out, const void * bytes, size_t size)
+	{ out.append(static_cast<const char *>(bytes), size); }
+
+inline void appendString(std::string & out, const char * str, UShort size)
+{
+	appendShort(out, size);
+	appendBytes(out, str, size);
+}
+
+// Tracks the position and the resource limits of a single read.  Any
+// failure throws a ParseError carrying the offset of the offending field.
+struct ReadContext {
+	ReadContext(const UByte * bytes, ULong size, const ReadOptions & opts) :
+		bytes(bytes), size(size), index(0), depth(0), allocated(0),
+		opts(opts), source(nullptr), base(0)
+	{}
+
+	// Reads from a stream instead, through a window of its data that
+	// only grows if a single field doesn't fit in it.  Borrowed and lazy
+	// reads need the whole input to stay put, so they're turned off.
+	ReadContext(Source & src, const ReadOptions & opts);
+
+	void fail(ReadError error) const
+		{ throw ParseError(error, base + index); }
+
+	// Checks that at least n more bytes are available
+	void need(ULong n)
+		{ if (n > size - index) more(n); }
+
+	// Returns the next n bytes, and moves past them
+	const UByte * take(ULong n)
+	{
+		need(n);
+		const UByte *p = bytes + index;
+		index += n;
+		return p;
+	}
+
+	void skip(ULong n) { take(n); }
+	ULong offset() const { return base + index; }
+
+	// An upper bound of the bytes left, for checking lengths before
+	// allocating for them.  A stream's length isn't known.
+	ULong left() const
+		{ return source ? std::numeric_limits<ULong>::max() : size - index; }
+
+	// How many of count items to allocate before reading any.  A stream
+	// can't be checked with left(), so its items are allocated in batches
+	// as they arrive, and a forged length runs out of data first.
+	UInt batch(UInt count) const
+		{ return source && count > stream_batch ? stream_batch : count; }
+
+	// Accounts for count elements of elem_size bytes each, which will
+	// have to be stored in memory.
+	void account(ULong count, ULong elem_size)
+	{
+		if (count > opts.max_elements)
+			fail(ReadError::TooManyElements);
+		allocated += count * elem_size;
+		if (allocated > opts.max_alloc)
+			fail(ReadError::TooLarge);
+	}
+
+	const UByte * bytes;
+	ULong size;
+	ULong index;
+	UInt depth;
+	ULong allocated;
+	ReadOptions opts;
+
+private:
+	static const UInt stream_batch = 64 * 1024;
+
+	// Refills the window so that it holds n bytes, or fails
+	void more(ULong n);
+
+	Source * source;
+	std::vector<UByte> window;
+	ULong base;  // Offset of the start of the window in the stream
+};
+
+/***********
+ * VarInts *
+ ***********/
+
+// LEB128, as used by Bedrock's network format, with signed values
+// zigzag-encoded so that small negative numbers stay short.
+
+template <typename In>
+inline ULong readVarInt(In & in, UInt max_bytes)
+{
+	ULong start = in.offset();
+	ULong x = 0;
+	for (UInt i = 0; i < max_bytes; i++) {
+		UByte b = *in.take(1);
+		x |= (ULong) (b & 0x7F) << (7 * i);
+		if (!(b & 0x80))
+			return x;
+	}
+	throw ParseError(ReadError::Syntax, start);
+}
+
+// Writes up to 10 bytes, and returns how many
+inline size_t writeVarInt(char * dst, ULong x)
+{
+	size_t n = 0;
+	for (; x >= 0x80; x >>= 7)
+		dst[n++] = (char) (x | 0x80);
+	dst[n++] = (char) x;
+	return n;
+}
+
+inline void appendVarInt(std::string & out, ULong x)
+{
+	char bytes[10];
+	out.append(bytes, writeVarInt(bytes, x));
+}
+
+inline UInt  zigzag32(Int x)    { return ((UInt) x << 1) ^ (UInt) (x >> 31); }
+inline ULong zigzag64(Long x)   { return ((ULong) x << 1) ^ (ULong) (x >> 63); }
+inline Int   unzigzag32(UInt x) { return (Int) (x >> 1) ^ -(Int) (x & 1); }
+inline Long  unzigzag64(ULong x) { return (Long) (x >> 1) ^ -(Long) (x & 1); }
+
+
+/****************
+ * Wire formats *
+ ****************/
+
+// A format supplies the encoding of numbers and length prefixes; the
+// structure around them is the same in all of them.  Readers take any
+// input with take(n), which returns the next n bytes or throws a
+// ParseError, skip(n) and offset().  The codecs are templates over the
+// format, so each format gets its own code, with no branching on it at
+// run time.
+
+// Converts count items of a scalar List between big-endian and host
+// order (either way, since it's just a swap).
+inline void copyItemsBE(void * dst, const void * src, TagType tag, UInt count)
+{
+	switch (Tag::itemSize(tag)) {
+	case 1: memcpy(dst, src, count); break;
+	case 2: copyBE16(dst, src, count); break;
+	case 4: copyBE32(dst, src, count); break;
+	case 8: copyBE64(dst, src, count); break;
+	}
+}
+
+inline void copyItemsLE(void * dst, const void * src, TagType tag, UInt count)
+{
+	switch (Tag::itemSize(tag)) {
+	case 1: memcpy(dst, src, count); break;
+	case 2: copyLE16(dst, src, count); break;
+	case 4: copyLE32(dst, src, count); break;
+	case 8: copyLE64(dst, src, count); break;
+	}
+}
+
+// Smallest possible encoding of a payload in the fixed-width formats, used
+// to reject length prefixes that can't possibly fit in the remaining data
+// before allocating anything for them.
+inline ULong fixedPayloadSize(TagType tag)
+{
+	switch (tag) {
+	case TagType::End: return 0;
+	case TagType::Byte: return sizeof(Byte);
+	case TagType::Short: return sizeof(Short);
+	case TagType::Int: return sizeof(Int);
+	case TagType::Long: return sizeof(Long);
+	case TagType::Float: return sizeof(float);
+	case TagType::Double: return sizeof(double);
+	case TagType::ByteArray: return sizeof(UInt);
+	case TagType::String: return sizeof(UShort);
+	case TagType::List: return sizeof(UByte) + sizeof(UInt);
+	case TagType::Compound: return sizeof(UByte);
+	case TagType::IntArray: return sizeof(UInt);
+	case TagType::LongArray: return sizeof(UInt);
+	}
+	return 0;
+}
+
+// Every number at its full width, in one byte order
+template <bool big>
+struct FixedWidth {
+	template <typename In> static Short readShort(In & in)
+		{ return big ? NBT::readShort(in.take(2)) : readShortLE(in.take(2)); }
+	template <typename In> static Int readInt(In & in)
+		{ return big ? NBT::readInt(in.take(4)) : readIntLE(in.take(4)); }
+	template <typename In> static Long readLong(In & in)
+		{ return big ? NBT::readLong(in.take(8)) : readLongLE(in.take(8)); }
+	template <typename In> static float readFloat(In & in)
+		{ return big ? NBT::readFloat(in.take(4)) : readFloatLE(in.take(4)); }
+	template <typename In> static double readDouble(In & in)
+		{ return big ? NBT::readDouble(in.take(8)) : readDoubleLE(in.take(8)); }
+
+	// String lengths, and array and List lengths
+	template <typename In> static UShort readLength(In & in)
+		{ return readShort(in); }
+	template <typename In> static UInt readSize(In & in)
+		{ return readInt(in); }
+
+	// Reads count numbers of the given type into host order
+	template <typename In>
+	static void readItems(In & in, void * dst, TagType tag, UInt count)
+	{
+		const UByte *src = in.take((ULong) count * Tag::itemSize(tag));
+		if (big)
+			copyItemsBE(dst, src, tag, count);
+		else
+			copyItemsLE(dst, src, tag, count);
+	}
+
+	template <typename In>
+	static void skipItems(In & in, TagType tag, UInt count)
+		{ in.skip((ULong) count * Tag::itemSize(tag)); }
+
+	static void appendShort(std::string & out, Short x)
+		{ big ? NBT::appendShort(out, x) : appendShortLE(out, x); }
+	static void appendInt(std::string & out, Int x)
+		{ big ? NBT::appendInt(out, x) : appendIntLE(out, x); }
+	static void appendLong(std::string & out, Long x)
+		{ big ? NBT::appendLong(out, x) : appendLongLE(out, x); }
+	static void appendFloat(std::string & out, float x)
+		{ big ? NBT::appendFloat(out, x) : appendFloatLE(out, x); }
+	static void appendDouble(std::string & out, double x)
+		{ big ? NBT::appendDouble(out, x) : appendDoubleLE(out, x); }
+	static void appendLength(std::string & out, UShort x)
+		{ appendShort(out, x); }
+	static void appendSize(std::string & out, UInt x)
+		{ appendInt(out, x); }
+
+	static void appendItems(std::string & out, const void * src, TagType tag,
+			UInt count)
+	{
+		size_t index = out.size();
+		out.resize(index + (size_t) count * Tag::itemSize(tag));
+		if (big)
+			copyItemsBE(&out[index], src, tag, count);
+		else
+			copyItemsLE(&out[index], src, tag, count);
+	}
+
+	static ULong minSize(TagType tag) { return fixedPayloadSize(tag); }
+};
+
+struct BigEndian : FixedWidth<true> {};
+struct LittleEndian : FixedWidth<false> {};
+
+// Little-endian, except that Ints, Longs and all lengths are varints
+struct NetworkLittleEndian {
+	template <typename In> static Short readShort(In & in)
+		{ return readShortLE(in.take(2)); }
+	template <typename In> static Int readInt(In & in)
+		{ return unzigzag32(readVarInt(in, 5)); }
+	template <typename In> static Long readLong(In & in)
+		{ return unzigzag64(readVarInt(in, 10)); }
+	template <typename In> static float readFloat(In & in)
+		{ return readFloatLE(in.take(4)); }
+	template <typename In> static double readDouble(In & in)
+		{ return readDoubleLE(in.take(8)); }
+
+	template <typename In> static UShort readLength(In & in)
+	{
+		ULong start = in.offset();
+		ULong len = readVarInt(in, 5);
+		if (len > 0xFFFF)
+			throw ParseError(ReadError::TooLarge, start);
+		return len;
+	}
+
+	// Negative sizes become huge, and fail the callers' limits
+	template <typename In> static UInt readSize(In & in)
+		{ return readInt(in); }
+
+	template <typename In>
+	static void readItems(In & in, void * dst, TagType tag, UInt count)
+	{
+		if (tag == TagType::Int) {
+			Int *ints = static_cast<Int *>(dst);
+			for (UInt i = 0; i < count; i++)
+				ints[i] = readInt(in);
+		} else if (tag == TagType::Long) {
+			Long *longs = static_cast<Long *>(dst);
+			for (UInt i = 0; i < count; i++)
+				longs[i] = readLong(in);
+		} else {
+			copyItemsLE(dst, in.take((ULong) count * Tag::itemSize(tag)),
+					tag, count);
+		}
+	}
+
+	template <typename In>
+	static void skipItems(In & in, TagType tag, UInt count)
+	{
+		if (tag == TagType::Int || tag == TagType::Long) {
+			for (UInt i = 0; i < count; i++)
+				readVarInt(in, 10);
+		} else {
+			in.skip((ULong) count * Tag::itemSize(tag));
+		}
+	}
+
+	static void appendShort(std::string & out, Short x)
+		{ appendShortLE(out, x); }
+	static void appendInt(std::string & out, Int x)
+		{ appendVarInt(out, zigzag32(x)); }
+	static void appendLong(std::string & out, Long x)
+		{ appendVarInt(out, zigzag64(x)); }
+	static void appendFloat(std::string & out, float x)
+		{ appendFloatLE(out, x); }
+	static void appendDouble(std::string & out, double x)
+		{ appendDoubleLE(out, x); }
+	static void appendLength(std::string & out, UShort x)
+		{ appendVarInt(out, x); }
+	static void appendSize(std::string & out, UInt x)
+		{ appendInt(out, x); }
+
+	static void appendItems(std::string & out, const void * src, TagType tag,
+			UInt count)
+	{
+		size_t index = out.size();
+		// Room for the longest encodings, trimmed afterwards
+		if (tag == TagType::Int) {
+			const Int *ints = static_cast<const Int *>(src);
+			out.resize(index + (size_t) count * 5);
+			for (UInt i = 0; i < count; i++)
+				index += writeVarInt(&out[index], zigzag32(ints[i]));
+			out.resize(index);
+		} else if (tag == TagType::Long) {
+			const Long *longs = static_cast<const Long *>(src);
+			out.resize(index + (size_t) count * 10);
+			for (UInt i = 0; i < count; i++)
+				index += writeVarInt(&out[index], zigzag64(longs[i]));
+			out.resize(index);
+		} else {
+			out.resize(index + (size_t) count * Tag::itemSize(tag));
+			copyItemsLE(&out[index], src, tag, count);
+		}
+	}
+
+	static ULong minSize(TagType tag)
+	{
+		switch (tag) {
+		case TagType::Int:
+		case TagType::Long:
+		case TagType::ByteArray:
+		case TagType::String:
+		case TagType::IntArray:
+		case TagType::LongArray:
+			return 1;
+		case TagType::List:
+			return 2;
+		default:
+			return fixedPayloadSize(tag);
+		}
+	}
+};
+
+
+// The following read a variable amount of data, so they advance the
+// context's index themselves.
+template <typename Format> ByteArray readByteArray(ReadContext & ctx);
+template <typename Format> String    readString   (ReadContext & ctx);
+template <typename Format> void      readList     (ReadContext & ctx, Tag & t);
+template <typename Format> void      readCompound (ReadContext & ctx, Compound & x);
+template <typename Format> IntArray  readIntArray (ReadContext & ctx);
+template <typename Format> LongArray readLongArray(ReadContext & ctx);
 
 } // namespace NBT
 
@@ -0,0 +1,749 @@
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <locale.h>
+#include <type_traits>
+#include <vector>
+
+#include "snbt.hpp"
+
+namespace NBT {
+
+// snprintf() and strtod() follow LC_NUMERIC, which may want a decimal
+// comma, while SNBT always has a point.  This puts the calling thread in the
+// C locale for as long as it's in scope, and leaves other threads alone.
+class ClassicNumbers {
+public:
+	ClassicNumbers() : saved(uselocale(classic())) {}
+	~ClassicNumbers() { uselocale(saved); }
+
+private:
+	static locale_t classic()
+	{
+		static const locale_t c = newlocale(LC_NUMERIC_MASK, "C",
+				(locale_t) 0);
+		return c;
+	}
+
+	locale_t saved;
+};
+
+
+/**********
+ * Writer *
+ **********/
+
+static const char digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// Writes x at p, and returns the end
+static char *formatInteger(char *p, Long x)
+{
+	ULong u = x < 0 ? 0 - (ULong) x : x;
+	if (x < 0)
+		*p++ = '-';
+	int digits = 1;
+	for (ULong limit = 10; digits < 19 && u >= limit; limit *= 10)
+		digits++;
+	char *end = p + digits;
+	// Two digits at a time, from the end
+	char *q = end;
+	while (u >= 100) {
+		UInt i = u % 100 * 2;
+		u /= 100;
+		*--q = digit_pairs[i + 1];
+		*--q = digit_pairs[i];
+	}
+	if (u >= 10) {
+		*--q = digit_pairs[u * 2 + 1];
+		*--q = digit_pairs[u * 2];
+	} else {
+		*--q = '0' + u;
+	}
+	return end;
+}
+
+
+static void appendInteger(std::string &out, Long x)
+{
+	char buf[24];
+	out.append(buf, formatInteger(buf, x) - buf);
+}
+
+
+// Uses the fewest digits that read back as the same value.  Whole numbers,
+// which are common, skip the search.  Non-finite values are an extension,
+// and only this library reads them back.
+static void appendFloat(std::string &out, double x, bool single)
+{
+	if (std::isnan(x)) {
+		out += "NaN";
+		return;
+	} else if (std::isinf(x)) {
+		out += x < 0 ? "-Infinity" : "Infinity";
+		return;
+	} else if (x == std::floor(x) && std::fabs(x) < 1e15) {
+		if (x == 0 && std::signbit(x))
+			out += '-';
+		appendInteger(out, (Long) x);
+		out += ".0";
+		return;
+	}
+	char buf[32];
+	int len = 0;
+	int max_precision = single ? 9 : 17;
+	for (int precision = single ? 6 : 15; precision <= max_precision; precision++) {
+		len = snprintf(buf, sizeof(buf), "%.*g", precision, x);
+		if (single ? strtof(buf, nullptr) == (float) x : strtod(buf, nullptr) == x)
+			break;
+	}
+	out.append(buf, len);
+}
+
+
+// Plain comparisons, as the <cctype> functions depend on the locale
+static bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+
+static char lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+
+// Characters allowed in unquoted strings and keys
+static const struct UnquotedChars {
+	UnquotedChars()
+	{
+		for (int c = 0; c < 256; c++)
+			allowed[c] = isDigit(c) || (c >= 'a' && c <= 'z') ||
+					(c >= 'A' && c <= 'Z') || c == '_' || c == '-' ||
+					c == '.' || c == '+';
+	}
+
+	bool allowed[256];
+} unquoted_chars;
+
+
+static bool unquotedChar(char c)
+{
+	return unquoted_chars.allowed[(UByte) c];
+}
+
+
+namespace {
+
+class Writer {
+public:
+	Writer(std::string &out, const std::string &indent) :
+		out(out), indent(indent), level(0)
+	{}
+
+	void value(const Tag &t);
+
+private:
+	// Before each compound entry or list item
+	void item(bool first)
+	{
+		if (!first)
+			out += ',';
+		newline();
+	}
+
+	void newline()
+	{
+		if (indent.empty())
+			return;
+		out += '\n';
+		for (int i = 0; i < level; i++)
+			out += indent;
+	}
+
+	void close(char c, bool empty)
+	{
+		level--;
+		if (!empty)
+			newline();
+		out += c;
+	}
+
+	void string(const char *s, size_t len);
+	void list(const Tag &t);
+	void compound(const Tag &t);
+
+	template <typename T>
+	void numbers(const T *data, UInt size, const char *suffix, bool lines);
+
+	std::string &out;
+	const std::string &indent;
+	int level;
+};
+
+
+void Writer::value(const Tag &t)
+{
+	switch (t.type) {
+	case TagType::End:
+		break;
+	case TagType::Byte: appendInteger(out, t.as<Byte>()); out += 'b'; break;
+	case TagType::Short: appendInteger(out, t.as<Short>()); out += 's'; break;
+	case TagType::Int: appendInteger(out, t.as<Int>()); break;
+	case TagType::Long: appendInteger(out, t.as<Long>()); out += 'L'; break;
+	case TagType::Float: appendFloat(out, t.as<float>(), true); out += 'f'; break;
+	case TagType::Double: appendFloat(out, t.as<double>(), false); out += 'd'; break;
+	case TagType::ByteArray: {
+		ByteArray a = t;
+		out += "[B;";
+		numbers(a.value, a.size, "b", false);
+		break;
+	}
+	case TagType::String: {
+		String s = t;
+		string(s.value, s.size);
+		break;
+	}
+	case TagType::List:
+		list(t);
+		break;
+	case TagType::Compound:
+		compound(t);
+		break;
+	case TagType::IntArray: {
+		IntArray a = t;
+		out += "[I;";
+		numbers(a.value, a.size, "", false);
+		break;
+	}
+	case TagType::LongArray: {
+		LongArray a = t;
+		out += "[L;";
+		numbers(a.value, a.size, "L", false);
+		break;
+	}
+	}
+}
+
+
+// Double quotes, unless the string contains some and no single ones
+void Writer::string(const char *s, size_t len)
+{
+	char quote = len && memchr(s, '"', len) && !memchr(s, '\'', len) ?
+			'\'' : '"';
+	out += quote;
+	size_t start = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == quote || s[i] == '\\') {
+			out.append(s + start, i - start);
+			out += '\\';
+			start = i;
+		}
+	}
+	out.append(s + start, len - start);
+	out += quote;
+}
+
+
+// Arrays stay on one line; packed lists are written item by item
+template <typename T>
+void Writer::numbers(const T *data, UInt size, const char *suffix, bool lines)
+{
+	level++;
+	if (!lines && !std::is_floating_point<T>::value) {
+		// Sized for the longest numbers, then trimmed
+		size_t suffix_size = strlen(suffix), start = out.size();
+		out.resize(start + size * (21 + suffix_size));
+		char *p = &out[start];
+		for (UInt i = 0; i < size; i++) {
+			if (i)
+				*p++ = ',';
+			p = formatInteger(p, (Long) data[i]);
+			memcpy(p, suffix, suffix_size);
+			p += suffix_size;
+		}
+		out.resize(p - out.data());
+	} else {
+		for (UInt i = 0; i < size; i++) {
+			if (lines)
+				item(i == 0);
+			else if (i)
+				out += ',';
+			if (std::is_floating_point<T>::value)
+				appendFloat(out, data[i], sizeof(T) == sizeof(float));
+			else
+				appendInteger(out, (Long) data[i]);
+			out += suffix;
+		}
+	}
+	close(']', !lines || size == 0);
+}
+
+
+void Writer::list(const Tag &t)
+{
+	out += '[';
+	if (t.packed()) {
+		UInt size = t.listSize();
+		switch (t.listType()) {
+		case TagType::Byte: numbers(t.span<Byte>().data, size, "b", true); break;
+		case TagType::Short: numbers(t.span<Short>().data, size, "s", true); break;
+		case TagType::Int: numbers(t.span<Int>().data, size, "", true); break;
+		case TagType::Long: numbers(t.span<Long>().data, size, "L", true); break;
+		case TagType::Float: numbers(t.span<float>().data, size, "f", true); break;
+		case TagType::Double: numbers(t.span<double>().data, size, "d", true); break;
+		default: break;
+		}
+		return;
+	}
+	List l = t;
+	level++;
+	for (UInt i = 0; i < l.size; i++) {
+		item(i == 0);
+		value(l.value[i]);
+	}
+	close(']', l.size == 0);
+}
+
+
+void Writer::compound(const Tag &t)
+{
+	const Compound &c = t;
+	out += '{';
+	level++;
+	bool first = true;
+	for (const Compound::Entry &e : c) {
+		item(first);
+		first = false;
+		const char *k = e.first.data();
+		size_t len = e.first.size();
+		bool plain = len > 0;
+		for (size_t i = 0; i < len && plain; i++)
+			plain = unquotedChar(k[i]);
+		if (plain)
+			out.append(k, len);
+		else
+			string(k, len);
+		out += indent.empty() ? ":" : ": ";
+		value(e.second);
+	}
+	close('}', c.empty());
+}
+
+} // namespace
+
+
+void writeSNBT(std::string &out, const Tag &t, const std::string &indent)
+{
+	ClassicNumbers numbers;
+	Writer(out, indent).value(t);
+}
+
+
+std::string toSNBT(const Tag &t, const std::string &indent)
+{
+	std::string out;
+	writeSNBT(out, t, indent);
+	return out;
+}
+
+
+/**********
+ * Parser *
+ **********/
+
+namespace {
+
+class Parser {
+public:
+	Parser(const char *text, size_t len, const ReadOptions &opts) :
+		begin(text), p(text), end(text + len), opts(opts), depth(0)
+	{}
+
+	void value(Tag &t);
+
+	void finish()
+	{
+		skipSpace();
+		if (p != end)
+			fail();
+	}
+
+	ULong offset() const { return p - begin; }
+
+private:
+	[[noreturn]] void fail(ReadError error = ReadError::Syntax)
+		{ throw ParseError(error, p - begin); }
+
+	void skipSpace()
+	{
+		while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r'))
+			p++;
+	}
+
+	bool accept(char c)
+	{
+		skipSpace();
+		if (p < end && *p == c) {
+			p++;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char c)
+	{
+		if (!accept(c))
+			fail(p == end ? ReadError::Truncated : ReadError::Syntax);
+	}
+
+	void enter()
+	{
+		if (++depth > opts.max_depth)
+			fail(ReadError::TooDeep);
+	}
+
+	// A run of unquoted characters, which may be empty
+	size_t token(const char **start)
+	{
+		*start = p;
+		while (p < end && unquotedChar(*p))
+			p++;
+		return p - *start;
+	}
+
+	void quoted(std::string &s);
+	void compound(Tag &t);
+	void list(Tag &t);
+	void array(Tag &t, char kind);
+	void scalar(Tag &t, const char *s, size_t len);
+
+	const char *begin;
+	const char *p;
+	const char *end;
+	const ReadOptions &opts;
+	UInt depth;
+};
+
+
+void Parser::value(Tag &t)
+{
+	skipSpace();
+	if (p == end)
+		fail(ReadError::Truncated);
+	switch (*p) {
+	case '{':
+		compound(t);
+		break;
+	case '[':
+		list(t);
+		break;
+	case '"':
+	case '\'': {
+		std::string s;
+		quoted(s);
+		t = Tag(s);
+		break;
+	}
+	default: {
+		const char *start;
+		size_t len = token(&start);
+		if (!len)
+			fail();
+		scalar(t, start, len);
+	}
+	}
+}
+
+
+void Parser::quoted(std::string &s)
+{
+	char quote = *p++;
+	const char *start = p;
+	while (true) {
+		if (p == end)
+			fail(ReadError::Truncated);
+		if (*p == quote)
+			break;
+		if (*p != '\\') {
+			p++;
+			continue;
+		}
+		s.append(start, p - start);
+		if (++p == end)
+			fail(ReadError::Truncated);
+		switch (*p) {
+		case '\\': case '"': case '\'': s += *p; break;
+		case 'n': s += '\n'; break;
+		case 't': s += '\t'; break;
+		case 'r': s += '\r'; break;
+		default: fail();
+		}
+		start = ++p;
+	}
+	s.append(start, p - start);
+	p++;
+	if (s.size() > std::numeric_limits<UShort>::max())
+		fail(ReadError::TooLarge);
+}
+
+
+void Parser::compound(Tag &t)
+{
+	enter();
+	p++;
+	t.setTag(TagType::Compound);
+	Compound &c = t;
+	if (!accept('}')) {
+		do {
+			skipSpace();
+			Key key;
+			if (p < end && (*p == '"' || *p == '\'')) {
+				std::string s;
+				quoted(s);
+				key = Key(s);
+			} else {
+				const char *start;
+				size_t len = token(&start);
+				if (!len)
+					fail(p == end ? ReadError::Truncated : ReadError::Syntax);
+				key = Key(start, len);
+			}
+			expect(':');
+			if (c.size() >= opts.max_elements)
+				fail(ReadError::TooManyElements);
+			value(c.findOrInsert(std::move(key)));
+		} while (accept(','));
+		expect('}');
+	}
+	depth--;
+}
+
+
+void Parser::list(Tag &t)
+{
+	if (end - p >= 3 && p[2] == ';' &&
+			(p[1] == 'B' || p[1] == 'I' || p[1] == 'L')) {
+		char kind = p[1];
+		p += 3;
+		array(t, kind);
+		return;
+	}
+	enter();
+	p++;
+	t.setTag(TagType::List);
+	UInt size = 0;
+	if (!accept(']')) {
+		TagType type = TagType::End;
+		do {
+			if (size >= opts.max_elements)
+				fail(ReadError::TooManyElements);
+			skipSpace();
+			const char *start = p;
+			Tag item;
+			value(item);
+			if (size && item.type != type) {
+				p = start;
+				fail(ReadError::TypeMismatch);
+			}
+			type = item.type;
+			t += std::move(item);
+			size++;
+		} while (accept(','));
+		expect(']');
+		// Stored as Tag::read stores them
+		if (Tag::itemSize(type))
+			t.pack();
+	}
+	depth--;
+}
+
+
+// Parses an integer with an optional suffix, which must be one of the
+// given ones (in lower case).  Returns false if the text isn't one, or if
+// it doesn't fit in a Long.
+static bool parseInteger(const char *s, size_t len, const char *suffixes,
+		Long *value, char *suffix)
+{
+	*suffix = 0;
+	if (len && strchr(suffixes, lower(s[len - 1]))) {
+		*suffix = lower(s[len - 1]);
+		len--;
+	}
+	bool negative = len && s[0] == '-';
+	size_t i = len && (s[0] == '-' || s[0] == '+') ? 1 : 0;
+	if (i == len)
+		return false;
+	ULong limit = (ULong) std::numeric_limits<Long>::max() + negative;
+	ULong u = 0;
+	for (; i < len; i++) {
+		if (!isDigit(s[i]))
+			return false;
+		UInt digit = s[i] - '0';
+		if (u > (limit - digit) / 10)
+			return false;
+		u = u * 10 + digit;
+	}
+	*value = negative ? (Long) (0 - u) : (Long) u;
+	return true;
+}
+
+
+template <typename T>
+static bool inRange(Long x)
+{
+	return x >= std::numeric_limits<T>::min() && x <= std::numeric_limits<T>::max();
+}
+
+
+void Parser::array(Tag &t, char kind)
+{
+	const char *suffixes = kind == 'B' ? "b" : kind == 'L' ? "l" : "";
+	std::vector<Long> values;
+	if (!accept(']')) {
+		do {
+			if (values.size() >= opts.max_elements)
+				fail(ReadError::TooManyElements);
+			skipSpace();
+			const char *start;
+			size_t len = token(&start);
+			Long x;
+			char suffix;
+			bool ok = parseInteger(start, len, suffixes, &x, &suffix) &&
+				(kind != 'B' || inRange<Byte>(x)) && (kind != 'I' || inRange<Int>(x));
+			if (!ok) {
+				p = start;
+				fail(len ? ReadError::TypeMismatch : ReadError::Syntax);
+			}
+			values.push_back(x);
+		} while (accept(','));
+		expect(']');
+	}
+
+	UInt size = values.size();
+	switch (kind) {
+	case 'B': {
+		t.setTag(TagType::ByteArray, size);
+		ByteArray a = t;
+		for (UInt i = 0; i < size; i++)
+			a.value[i] = values[i];
+		break;
+	}
+	case 'I': {
+		t.setTag(TagType::IntArray, size);
+		IntArray a = t;
+		for (UInt i = 0; i < size; i++)
+			a.value[i] = values[i];
+		break;
+	}
+	default:
+		t.setTag(TagType::LongArray);
+		if (size)
+			t.append(values.data(), size);
+	}
+}
+
+
+static bool isFloat(const char *s, size_t len)
+{
+	size_t i = 0, digits = 0;
+	if (i < len && (s[i] == '-' || s[i] == '+'))
+		i++;
+	for (; i < len && isDigit(s[i]); i++)
+		digits++;
+	if (i < len && s[i] == '.')
+		for (i++; i < len && isDigit(s[i]); i++)
+			digits++;
+	if (!digits)
+		return false;
+	if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+		i++;
+		if (i < len && (s[i] == '-' || s[i] == '+'))
+			i++;
+		if (i == len || !isDigit(s[i]))
+			return false;
+		while (i < len && isDigit(s[i]))
+			i++;
+	}
+	return i == len;
+}
+
+
+// Numbers and booleans; anything else is an unquoted string
+void Parser::scalar(Tag &t, const char *s, size_t len)
+{
+	if (len == 4 && !memcmp(s, "true", 4)) {
+		t = Tag((Byte) 1);
+		return;
+	} else if (len == 5 && !memcmp(s, "false", 5)) {
+		t = Tag((Byte) 0);
+		return;
+	}
+
+	Long x;
+	char suffix;
+	if (parseInteger(s, len, "bsl", &x, &suffix)) {
+		switch (suffix) {
+		case 'b': if (inRange<Byte>(x)) { t = Tag((Byte) x); return; } break;
+		case 's': if (inRange<Short>(x)) { t = Tag((Short) x); return; } break;
+		case 'l': t = Tag((Long) x); return;
+		default: if (inRange<Int>(x)) { t = Tag((Int) x); return; } break;
+		}
+	}
+
+	char last = lower(s[len - 1]);
+	bool single = last == 'f';
+	size_t body = last == 'f' || last == 'd' ? len - 1 : len;
+	std::string number(s, body);
+	if (body < len || number.find_first_of(".eE") != std::string::npos) {
+		if (isFloat(s, body)) {
+			if (single)
+				t = Tag(strtof(number.c_str(), nullptr));
+			else
+				t = Tag(strtod(number.c_str(), nullptr));
+			return;
+		}
+		// The extension appendFloat() writes for values SNBT has no
+		// syntax for; see snbt.hpp
+		double special = 0;
+		if (number == "NaN")
+			special = std::numeric_limits<double>::quiet_NaN();
+		else if (number == "Infinity" || number == "+Infinity")
+			special = std::numeric_limits<double>::infinity();
+		else if (number == "-Infinity")
+			special = -std::numeric_limits<double>::infinity();
+		if (body < len && special != 0) {
+			t = single ? Tag((float) special) : Tag(special);
+			return;
+		}
+	}
+	t = Tag(std::string(s, len));
+}
+
+} // namespace
+
+
+ReadResult readSNBT(const char *text, size_t len, Tag &out,
+		const ReadOptions &opts)
+{
+	ClassicNumbers numbers;
+	Parser parser(text, len, opts);
+	try {
+		parser.value(out);
+		parser.finish();
+	} catch (const ParseError &e) {
+		out.free();
+		return ReadResult{e.error, e.offset};
+	}
+	return ReadResult{ReadError::None, parser.offset()};
+}
+
+} // namespace NBT
@@ -0,0 +1,46 @@
+#ifndef NBT_SNBT_HEADER
+#define NBT_SNBT_HEADER
+
+#include <string>
+
+#include "nbt.hpp"
+
+namespace NBT {
+
+// Stringified NBT, as used by commands and data packs:
+//
+//   {name:"Steve",Health:20.0f,Pos:[1.5d,64.0d,-3.0d],Ids:[I;1,2,3]}
+//
+// Unlike Tag::dump(), the output can be parsed back into the same tree.
+// Floats and doubles are written with as few digits as still read back
+// exactly, always with a decimal point, whatever the locale.  An End tag
+// can't be represented, and is written as nothing.
+//
+// SNBT has no syntax for NaN or infinities.  As an extension they're
+// written NaNf, Infinityd, -Infinityd and so on, and read back from the
+// same forms, with +Infinity also accepted.  Minecraft reads these as
+// unquoted strings, so trees holding them don't survive a trip through
+// the game.  Without a suffix, as in Minecraft, they're strings here too.
+
+// Appends t to out.  With an indent, each compound entry and list item
+// goes on its own line.
+extern void writeSNBT(std::string &out, const Tag &t,
+		const std::string &indent="");
+extern std::string toSNBT(const Tag &t, const std::string &indent="");
+
+// Parses one value, which may be surrounded by whitespace.  On success the
+// result's offset is the length of the text; on failure it's the offset
+// of the offending character.  Text that ends early is
+// ReadError::Truncated, other syntax errors are ReadError::Syntax, and lists
+// mixing item types are ReadError::TypeMismatch.  max_depth and
+// max_elements are enforced.  As in Minecraft, numbers out of range for
+// their type are read as unquoted strings.
+extern ReadResult readSNBT(const char *text, size_t len, Tag &out,
+		const ReadOptions &opts=ReadOptions());
+inline ReadResult readSNBT(const std::string &text, Tag &out,
+		const ReadOptions &opts=ReadOptions())
+	{ return readSNBT(text.data(), text.size(), out, opts); }
+
+} // namespace NBT
+
+#endif // NBT_SNBT_HEADER
@@ -7,14 +7,92 @@
 #include <sstream>
 #include <iomanip>
 #include <cassert>
-#include <chrono>
+#include <clocale>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <map>
+#include <atomic>
 
 #include "nbt.hpp"
 #include "compression.hpp"
+#include "reader.hpp"
+#include "region.hpp"
+#include "region_loader.hpp"
+#include "save_pipeline.hpp"
+#include "bitfield.hpp"
+#include "schema.hpp"
+#include "diff.hpp"
+#include "snbt.hpp"
 
 
 std::string hexdump(const std::string &s);
 
+
+// Records visitor events, skipping entries whose key starts with '_'
+struct EventRecorder : public NBT::Visitor {
+	NBT::VisitResult key(NBT::TagType, const char *name, NBT::UShort len) override {
+		if (len && name[0] == '_')
+			return NBT::VisitResult::Skip;
+		os << std::string(name, len) << '=';
+		return NBT::VisitResult::Continue;
+	}
+	NBT::VisitResult beginCompound() override { os << '{'; return NBT::VisitResult::Continue; }
+	void endCompound() override { os << '}'; }
+	NBT::VisitResult beginList(NBT::TagType, NBT::UInt size) override {
+		os << '[' << size << ':';
+		return NBT::VisitResult::Continue;
+	}
+	void endList() override { os << ']'; }
+	void value(NBT::Byte x) override { os << (int) x << ','; }
+	void value(NBT::Int x) override { os << x << ','; }
+	void value(const char *str, NBT::UShort len) override { os << std::string(str, len) << ','; }
+	void intArray(const NBT::Int *data, NBT::UInt size) override { os << "i" << size << ":" << data[size - 1] << ','; }
+	void longArray(const NBT::Long *data, NBT::UInt size) override { os << "l" << size << ":" << data[size - 1] << ','; }
+	std::ostringstream os;
+};
+
+// Hands out the data a few bytes at a time
+struct TrickleSource : public NBT::Source {
+	TrickleSource(const std::string &data) : data(data), pos(0) {}
+	size_t read(NBT::UByte *buf, size_t size) override {
+		size_t n = std::min<size_t>(std::min<size_t>(size, 3), data.size() - pos);
+		memcpy(buf, data.data() + pos, n);
+		pos += n;
+		return n;
+	}
+	std::string data;
+	size_t pos;
+};
+
+struct Enchantment {
+	std::string id;
+	NBT::Short level = 0;
+};
+
+struct ItemStack {
+	std::string id;
+	NBT::Byte count = 1;
+	bool glint = false;
+	std::vector<Enchantment> enchantments;
+	std::vector<float> motion;
+	std::vector<NBT::Int> uuid;
+	NBT::Tag extra;
+};
+
+NBT_SCHEMA(Enchantment,
+	NBT_FIELD(id, "id"),
+	NBT_FIELD(level, "lvl"))
+
+NBT_SCHEMA(ItemStack,
+	NBT_FIELD(id, "id"),
+	NBT_FIELD(count, "Count"),
+	NBT_FIELD(glint, "Glint"),
+	NBT_FIELD(enchantments, "Enchantments"),
+	NBT_FIELD(motion, "Motion"),
+	NBT_FIELD(uuid, "UUID"),
+	NBT_FIELD(extra, "tag"))
+
 int main()
 {
 	std::string data(
@@ -44,7 +122,55 @@ int main()
 	NBT::String foobar = root["foobar"];
 	assert(std::string(foobar.value, foobar.size) == "<3 C++ 11");
 
-	//assert(root.write() == data); // Data is unordered
+	assert(root.write() == data); // Compounds keep their input order
+
+	NBT::ReadOptions opts;
+
+	// Length-checked reads report how much they consumed...
+	NBT::ReadResult res = root.read((NBT::UByte *) data.data(), data.size());
+	assert(res && res.offset == data.size());
+	// ...and reject truncated data
+	for (size_t len = 0; len < data.size(); len++) {
+		NBT::Tag t;
+		res = t.read((NBT::UByte *) data.data(), len);
+		assert(res.error == NBT::ReadError::Truncated);
+		assert(t.type == NBT::TagType::End);
+	}
+	// A forged list size is rejected without allocating it
+	std::string forged("\x09\x00\x01L\x0A\xFF\xFF\xFF\xF0\x00", 10);
+	res = NBT::Tag().read((NBT::UByte *) forged.data(), forged.size());
+	assert(res.error == NBT::ReadError::Truncated && res.offset == 9);
+	// Borrowed reads point into the input until they're modified
+	opts.borrow = true;
+	res = root.read((NBT::UByte *) data.data(), data.size(), true, opts);
+	assert(res);
+	foobar = root["foobar"];
+	assert(foobar.value == data.data() + 16);
+	NBT::Tag foobar_copy = root["foobar"];
+	assert(foobar_copy.as<std::string>() == "<3 C++ 11");
+	assert(((NBT::String) foobar_copy).value != foobar.value);
+	root["foobar"].detach();
+	assert(((NBT::String) root["foobar"]).value != foobar.value);
+	assert(root["foobar"].as<std::string>() == "<3 C++ 11");
+	NBT::Tag bytes_tag(NBT::TagType::ByteArray, 4);
+	std::string bytes_data = bytes_tag.write(true);
+	const std::string bytes_orig = bytes_data;
+	bytes_tag.read((NBT::UByte *) bytes_data.data(), bytes_data.size(), false, opts);
+	assert(bytes_tag.borrowed());
+	bytes_tag.insert(0, (NBT::Byte) 7);
+	bytes_tag += (NBT::Byte) 8;
+	assert(!bytes_tag.borrowed() && bytes_data == bytes_orig);
+	opts = NBT::ReadOptions();
+
+	std::string nested;
+	for (int i = 0; i < 10; i++)
+		nested += std::string("\x0A\x00\x00", 3);
+	nested += std::string(11, '\x00');
+	res = NBT::Tag().read((NBT::UByte *) nested.data(), nested.size());
+	assert(res && res.offset == nested.size());
+	opts.max_depth = 2;
+	res = NBT::Tag().read((NBT::UByte *) nested.data(), nested.size(), true, opts);
+	assert(res.error == NBT::ReadError::TooDeep);
 
 	root["foo"] = NBT::TagType::List;
 
@@ -61,34 +187,261 @@ int main()
 	root["test"] = (NBT::Int) 0x12345678;
 	root["foobar"] = std::string("<3 C++ 11");
 	std::cout << "Manual:   " << hexdump(root.write()) << std::endl;
+
+	// Writing into an existing buffer appends to it
+	std::string buf("\xFF", 1);
+	root.write(buf, true);
+	assert(buf == std::string("\xFF\x0A", 2) + root.write());
 	std::cout << "Manual dump: " << root.dump() << std::endl;
 
-	std::cout << "Testing reading performance..." << std::endl;
-	// Generate big list
-	root = NBT::TagType::IntArray;
-	// In reverse order to minimize reallocations
-	for (int32_t i = 999; i >= 0; i--) {
-		root.insert(i, (const NBT::Int) (i - 10));
+	// Arena-backed documents behave like ordinary trees
+	root["list"] = NBT::Tag(NBT::TagType::List, 3, NBT::TagType::Compound);
+	for (int i = 0; i < 3; i++) {
+		root["list"][i] = NBT::TagType::Compound;
+		root["list"][i]["name"] = std::string(40, 'a' + i);
+		root["list"][i]["ints"] = NBT::Tag(NBT::TagType::IntArray, 2);
+		root["list"][i]["ints"].insert(1, (NBT::Int) i);
+	}
+	data = root.write();
+	NBT::Tag copy;
+	{
+		NBT::Document doc;
+		assert(doc.read((NBT::UByte *) data.data(), data.size()));
+		assert(doc.root.write() == data);
+		assert(doc["list"][2]["name"].as<std::string>() == std::string(40, 'c'));
+		doc["list"][1]["ints"] += (NBT::Int) 5;
+		doc["list"] += NBT::Tag(NBT::TagType::Compound);
+		doc["list"][3]["x"] = std::string("heap");
+		doc["new"] = std::string(100, 'x');
+		copy = doc.root;
+	}
+	assert(copy["list"][1]["ints"].as<NBT::IntArray>().size == 3);
+	assert(copy["list"][3]["x"].as<std::string>() == "heap");
+	assert(copy["list"][2]["name"].as<std::string>() == std::string(40, 'c'));
+	{
+		// A detached root moves off the arena, so the heap frees it
+		NBT::Document doc;
+		assert(doc.read((NBT::UByte *) data.data(), data.size()));
+		doc.root.detach();
+		assert(!doc.root.borrowed() && doc.root.write() == data);
+		doc["more"] = std::string(100, 'y');
 	}
-	data = root.write(true);
 
-	using namespace std::chrono;
-	high_resolution_clock::time_point start = high_resolution_clock::now();
-	for (uint32_t i = 0; i < 1000; i++) {
-		root.read((NBT::UByte*) data.c_str(), false);
+	// Streaming reads report the same events from either kind of input
+	root = NBT::TagType::Compound;
+	root["A"] = (NBT::Byte) 1;
+	root["_skipped"] = NBT::Tag(NBT::TagType::List, 2, NBT::TagType::Compound);
+	root["_skipped"][0] = NBT::TagType::Compound;
+	root["_skipped"][1] = NBT::TagType::Compound;
+	root["_skipped"][1]["x"] = std::string("y");
+	root["list"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::String);
+	root["list"] += NBT::Tag(std::string("x"));
+	root["ints"] = NBT::Tag(NBT::TagType::IntArray);
+	const NBT::Int three_ints[] = {1, 2, 3};
+	root["ints"].append(three_ints, 3);
+	root["c"] = NBT::TagType::Compound;
+	root["c"]["i"] = (NBT::Int) 5;
+	data = root.write();
+	const char *events = "{A=1,list=[1:x,]ints=i3:3,c={i=5,}}";
+	EventRecorder rec;
+	assert(NBT::visit((NBT::UByte *) data.data(), data.size(), rec));
+	assert(rec.os.str() == events);
+	EventRecorder stream_rec;
+	TrickleSource src(data);
+	res = NBT::visit(src, stream_rec);
+	assert(res && res.offset == data.size());
+	assert(stream_rec.os.str() == events);
+	EventRecorder short_rec;
+	res = NBT::visit((NBT::UByte *) data.data(), data.size() - 1, short_rec);
+	assert(res.error == NBT::ReadError::Truncated);
+	// Forged array lengths fail at the end of the data, without allocating
+	// for them first
+	for (char type : {'\x07', '\x0B', '\x0C'}) {
+		std::string forged = std::string(1, type) +
+				std::string("\x00\x00\x7F\xFF\xFF\xFF\x00\x00\x00\x01", 10);
+		res = NBT::visit((NBT::UByte *) forged.data(), forged.size(),
+				short_rec, true, NBT::ReadOptions::unlimited());
+		assert(res.error == NBT::ReadError::Truncated && res.offset == 7);
+		TrickleSource forged_src(forged);
+		res = NBT::visit(forged_src, short_rec, true,
+				NBT::ReadOptions::unlimited());
+		assert(res.error == NBT::ReadError::Truncated && res.offset == 7);
 	}
-	std::cout << "Completed 1,000 reads of 1,000 integers in " <<
-			duration_cast<duration<double>>(high_resolution_clock::now() - start).count()
-			<< " seconds." << std::endl;
 
-	std::cout << "Testing writing performance..." << std::endl;
-	start = high_resolution_clock::now();
-	for (uint32_t i = 0; i < 1000; i++) {
-		root.write(true);
+	// Lazy reads only decode what's used, and write the rest back as-is
+	root = NBT::TagType::Compound;
+	root["Level"] = NBT::TagType::Compound;
+	root["Level"]["Status"] = std::string("full");
+	root["Level"]["Sections"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+	for (int i = 0; i < 4; i++) {
+		NBT::Tag section(NBT::TagType::Compound);
+		section["Y"] = (NBT::Byte) i;
+		section["Blocks"] = NBT::Tag(NBT::TagType::ByteArray, 16);
+		memset(section["Blocks"].as<NBT::ByteArray>().value, i, 16);
+		root["Level"]["Sections"] += std::move(section);
+	}
+	root["DataVersion"] = (NBT::Int) 1343;
+	data = root.write();
+	opts = NBT::ReadOptions();
+	opts.lazy = true;
+	NBT::Tag lazy;
+	assert(lazy.read((NBT::UByte *) data.data(), data.size(), true, opts));
+	assert(lazy.write() == data);
+	assert((NBT::Int) lazy["DataVersion"] == 1343);
+	NBT::Tag lazy_copy = lazy;
+	assert(lazy["Level"]["Status"].as<std::string>() == "full");
+	assert(lazy.write() == data);
+	lazy["Level"]["Sections"][2]["Y"] = (NBT::Byte) 7;
+	root["Level"]["Sections"][2]["Y"] = (NBT::Byte) 7;
+	assert(lazy.write() == root.write());
+	assert(lazy_copy.dump() == NBT::Tag((NBT::UByte *) data.data()).dump());
+	lazy_copy.detach();
+	assert(lazy_copy.write() == data);
+	// Broken subtrees are still caught
+	res = lazy.read((NBT::UByte *) data.data(), data.size() - 2, true, opts);
+	assert(res.error == NBT::ReadError::Truncated);
+	opts = NBT::ReadOptions();
+
+	// Large compounds switch to a hash index
+	root = NBT::TagType::Compound;
+	for (NBT::Int i = 0; i < 100; i++)
+		root[std::to_string(i)] = i;
+	root.as<NBT::Compound&>().erase("50");
+	assert(root.as<NBT::Compound&>().size() == 99);
+	assert(root.as<NBT::Compound&>().count("50") == 0);
+	for (NBT::Int i = 0; i < 100; i++)
+		assert(i == 50 || (NBT::Int) root[std::to_string(i)] == i);
+	root.as<NBT::Compound&>().sort();
+	assert(root.as<NBT::Compound&>().begin()->first == "0");
+	assert((NBT::Int) root["99"] == 99);
+	// Copies are indexed as they're made, so const lookups never write
+	const NBT::Compound frozen = root.as<NBT::Compound&>();
+	for (NBT::Int i = 0; i < 100; i++)
+		assert(i == 50 || (NBT::Int) frozen.at(std::to_string(i)) == i);
+	assert(frozen.find("50") == frozen.end());
+
+	// Appends grow geometrically
+	root = NBT::TagType::List;
+	for (NBT::Int i = 0; i < 4096; i++)
+		root += NBT::Tag(i);
+	assert((NBT::Int) root[4095] == 4095);
+	root.shrink_to_fit();
+	root += NBT::Tag(4096);
+	assert(root.as<NBT::List>().size == 4097);
+	assert(root.as<NBT::List>().tagid == NBT::TagType::Int);
+	const NBT::Int ints[] = {1, 2, 3};
+	const NBT::Byte bytes[] = {4, 5};
+	root = NBT::Tag(NBT::TagType::IntArray);
+	root.reserve(100);
+	root.append(ints, 3).append(ints, 2);
+	assert(root.as<NBT::IntArray>().size == 5);
+	assert(root.as<NBT::IntArray>().value[4] == 2);
+	root = NBT::Tag(NBT::TagType::ByteArray, 1);
+	root.insert(-1, (NBT::Byte) 3);
+	root.append(bytes, 2);
+	root.shrink_to_fit();
+	assert(root.write() == std::string("\0\0\0\3\3\4\5", 7));
+	bool threw = false;
+	try {
+		root.append(bytes, std::numeric_limits<NBT::UInt>::max());
+	} catch (const std::length_error &) {
+		threw = true;
+	}
+	assert(threw && root.as<NBT::ByteArray>().size == 3);
+
+	// Long arrays
+	const NBT::Long longs[] = {-2, 0x0102030405060708LL, 3};
+	root = NBT::TagType::Compound;
+	root["longs"] = NBT::Tag(NBT::TagType::LongArray);
+	root["longs"].append(longs, 3);
+	root["list"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::LongArray);
+	root["list"] += root["longs"];
+	data = root.write();
+	assert(data.find(std::string("\x0C\x00\x05longs\x00\x00\x00\x03"
+			"\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFE\x01\x02\x03\x04\x05\x06\x07\x08", 28))
+			!= std::string::npos);
+	NBT::Tag long_copy;
+	assert(long_copy.read((NBT::UByte *) data.data(), data.size()));
+	assert(long_copy.write() == data);
+	assert(long_copy["list"][0].as<NBT::LongArray>().value[1] == longs[1]);
+	assert(long_copy.dump("", 0) == "{\"longs\" = long[-2, 72623859790382856, 3], "
+			"\"list\" = [long[-2, 72623859790382856, 3]]}");
+	EventRecorder long_rec;
+	assert(NBT::visit((NBT::UByte *) data.data(), data.size(), long_rec));
+	assert(long_rec.os.str() == "{longs=l3:3,list=[1:l3:3,]}");
+	assert(NBT::skip((NBT::UByte *) data.data(), data.size(),
+			NBT::TagType::Compound).offset == data.size());
+
+	// Packed bitfields, checked against a bit-by-bit reference
+	for (int spanning = 0; spanning < 2; spanning++) {
+		for (NBT::UInt bits = 4; bits <= 15; bits++) {
+			const size_t count = 4096 + 37;
+			std::vector<NBT::UShort> entries(count), unpacked(count);
+			for (size_t i = 0; i < count; i++)
+				entries[i] = (i * 2654435761u >> 7) & ((1 << bits) - 1);
+			size_t size = NBT::packedSize(count, bits, spanning);
+			std::vector<NBT::Long> packed(size);
+			assert(NBT::packBits(entries.data(), count, bits, spanning,
+					packed.data(), size));
+			size_t per = 64 / bits;
+			for (size_t i = 0; i < count; i++) {
+				for (NBT::UInt b = 0; b < bits; b++) {
+					size_t bit = spanning ? i * bits + b :
+						i / per * 64 + i % per * bits + b;
+					bool set = (NBT::ULong) packed[bit / 64] >> (bit % 64) & 1;
+					assert(set == ((entries[i] >> b) & 1));
+				}
+			}
+			assert(NBT::unpackBits(packed.data(), size, bits, spanning,
+					unpacked.data(), count));
+			assert(unpacked == entries);
+			assert(!NBT::unpackBits(packed.data(), size - 1, bits, spanning,
+					unpacked.data(), count));
+		}
+	}
+
+	// Compound lookups and iteration agree with std::map
+	const char *keys[] = {"x", "y", "z", "id", "Count", "Slot", "Damage", "tag"};
+	const size_t num_keys = sizeof(keys) / sizeof(keys[0]);
+	std::map<std::string, NBT::Tag> map;
+	NBT::Compound flat;
+	for (size_t i = 0; i < num_keys; i++) {
+		map[keys[i]] = (NBT::Int) i;
+		flat[keys[i]] = (NBT::Int) i;
+	}
+	NBT::Long sum = 0;
+	for (size_t i = 0; i < num_keys; i++) {
+		sum += (NBT::Int) map.find(keys[i])->second;
+		sum -= (NBT::Int) flat.find(keys[i])->second;
+	}
+	for (auto &it : map)
+		sum += it.second.type == NBT::TagType::Int;
+	for (auto &it : flat)
+		sum -= it.second.type == NBT::TagType::Int;
+	assert(sum == 0);
+
+	// A big integer array
+	root = NBT::TagType::IntArray;
+	for (int32_t i = 0; i < 1000; i++) {
+		root += (NBT::Int) (i - 10);
+	}
+	data = root.write(true);
+	root.read((NBT::UByte*) data.c_str(), false);
+	assert(root.write(true) == data);
+
+	// Check the bulk conversion against the scalar one for every tail length
+	for (NBT::Int n = 0; n < 40; n++) {
+		NBT::Tag ints(NBT::TagType::IntArray, n);
+		for (NBT::Int i = 0; i < n; i++)
+			ints.insert(i, (NBT::Int) (i * 0x01020304));
+		std::string bytes = ints.write(true);
+		for (NBT::Int i = 0; i < n; i++)
+			assert(bytes.substr(5 + i * 4, 4) ==
+					NBT::Tag((NBT::Int) (i * 0x01020304)).write());
+		NBT::Tag back;
+		assert(back.read((NBT::UByte *) bytes.data(), bytes.size(), false));
+		assert(back.write(true) == bytes);
 	}
-	std::cout << "Completed 1,000 writes of 1,000 integers in " <<
-			duration_cast<duration<double>>(high_resolution_clock::now() - start).count()
-			<< " seconds." << std::endl;
 
 	std::cout << "Integer array write: " << hexdump(root.write(true)).substr(0, 100) << "..." << std::endl;
 	std::cout << "Integer array dump: "  << root.dump("").substr(0, 100) << "..." << std::endl;
@@ -98,22 +451,51 @@ int main()
 		root.insert(i, NBT::Tag((float) (i / 2)));
 	}
 	data = root.write(true);
-	start = high_resolution_clock::now();
-	for (uint32_t i = 0; i < 1000; i++) {
-		root.read((NBT::UByte *) data.c_str(), false);
-	}
-	std::cout << "Completed 1,000 reads of 1,000 floats in " <<
-			duration_cast<duration<double>>(high_resolution_clock::now() - start).count()
-			<< " seconds." << std::endl;
+	root.read((NBT::UByte *) data.c_str(), false);
+	assert(root.packed() && root.span<float>()[999] == 499.0f);
+	assert(root.write(true) == data);
 
-	std::cout << "Testing writing performance..." << std::endl;
-	start = high_resolution_clock::now();
-	for (uint32_t i = 0; i < 1000; i++) {
-		root.write(true);
+	// Packed lists act like ordinary ones
+	float sum_floats = 0;
+	for (float f : root.span<float>())
+		sum_floats += f;
+	assert(sum_floats == 249500.0f);
+	NBT::Tag packed_copy = root;
+	assert(packed_copy.packed() && packed_copy.write(true) == data);
+	assert((float) root[999] == 499.0f && !root.packed());
+	assert(root.write(true) == data);
+	root.pack();
+	root.span<float>()[0] = 2.5f;
+	root += NBT::Tag(7.0f);
+	assert(!root.packed() && root.as<NBT::List>().size == 1001);
+	assert((float) root[0] == 2.5f && (float) root[1000] == 7.0f);
+	root = NBT::Tag(NBT::TagType::List);
+	root.span<NBT::Short>();
+	assert(root.as<NBT::List>().tagid == NBT::TagType::Short);
+	root += NBT::Tag((NBT::Short) -3);
+	data = root.write(true);
+	{
+		NBT::Document doc;
+		assert(doc.read((NBT::UByte *) data.data(), data.size(), false));
+		assert(doc.root.packed() && doc.root.borrowed());
+		assert(doc.root.span<NBT::Short>()[0] == -3);
+		doc.root.detach();
+		packed_copy = std::move(doc.root);
 	}
-	std::cout << "Completed 1,000 writes of 1,000 floats in " <<
-			duration_cast<duration<double>>(high_resolution_clock::now() - start).count()
-			<< " seconds." << std::endl;
+	assert(packed_copy.packed() && packed_copy.write(true) == data);
+	assert(packed_copy.dump("") == "[-3]");
+	// Reading through a const reference leaves the list packed
+	const NBT::Tag &shared = packed_copy;
+	assert(shared.span<NBT::Short>()[0] == -3);
+	assert((NBT::Short) shared.listItem(0) == -3 && shared.packed());
+	// Spans of the wrong type are empty, and only scalars are packed
+	assert(shared.span<NBT::Long>().size == 0);
+	assert(packed_copy.span<NBT::Long>().size == 0 && packed_copy.packed());
+	NBT::Tag strings(NBT::TagType::List, 0, NBT::TagType::String);
+	strings += NBT::Tag(std::string("a"));
+	strings.pack();
+	assert(!strings.packed() && strings.span<NBT::Int>().size == 0);
+	assert((std::string) strings[0] == "a");
 
 	std::string long_str(256*1024, '*');
 	std::string comp, decomp;
@@ -121,6 +503,789 @@ int main()
 	assert(NBT::decompress(&decomp, comp.data(), comp.size()));
 	assert(decomp == long_str);
 
+	// Reused contexts, streaming, and caller-supplied buffers
+	NBT::Compressor compressor(Z_DEFAULT_COMPRESSION, NBT::CompressionFormat::GZip);
+	NBT::Decompressor decompressor;
+	std::string chunk(4096, 'x');
+	for (int i = 0; i < 3; i++) {
+		comp.clear();
+		NBT::Sink to_comp = [&comp] (const char *p, size_t n) {
+			comp.append(p, n);
+			return true;
+		};
+		// Feed the input in uneven pieces
+		assert(compressor.write(long_str.data(), 1000, to_comp));
+		assert(compressor.write(long_str.data() + 1000,
+				long_str.size() - 1000, to_comp, true));
+		decomp.clear();
+		for (size_t pos = 0; pos < comp.size(); pos += 7) {
+			size_t n = std::min<size_t>(7, comp.size() - pos);
+			assert(decompressor.write(comp.data() + pos, n,
+				[&decomp] (const char *p, size_t n) {
+					decomp.append(p, n);
+					return true;
+				}));
+		}
+		assert(decompressor.finished());
+		assert(decomp == long_str);
+		decompressor.reset();
+
+		std::vector<char> small(compressor.bound(chunk.size()));
+		size_t written, got;
+		assert(compressor.compress(small.data(), small.size(), &written,
+				chunk.data(), chunk.size()));
+		std::vector<char> out(chunk.size());
+		assert(decompressor.decompress(out.data(), out.size(), &got,
+				small.data(), written));
+		assert(got == chunk.size() && std::string(out.data(), got) == chunk);
+		// Known lengths that are too small are reported
+		assert(!decompressor.decompress(out.data(), 100, &got,
+				small.data(), written));
+		// So is truncated input
+		decomp.clear();
+		assert(!decompressor.decompress(&decomp, small.data(), written / 2));
+	}
+	assert(compressor.reset(9, NBT::CompressionFormat::ZLib));
+	comp.clear();
+	assert(compressor.compress(&comp, long_str.data(), long_str.size()));
+	decomp.clear();
+	assert(decompressor.decompress(&decomp, comp.data(), comp.size(),
+			long_str.size()));
+	assert(decomp == long_str);
+
+	// Every format that's built in, with input that spans several LZ4
+	// blocks, one of which doesn't compress
+	std::string mixed(70000, '\0');
+	for (size_t i = 0, x = 1; i < mixed.size(); i++) {
+		x = x * 1103515245 + 12345;
+		mixed[i] = x >> 16;
+	}
+	mixed += long_str;
+	const NBT::CompressionFormat formats[] = {NBT::CompressionFormat::ZLib,
+			NBT::CompressionFormat::GZip, NBT::CompressionFormat::Zstd,
+			NBT::CompressionFormat::LZ4};
+	for (NBT::CompressionFormat format : formats) {
+		if (!NBT::compressionSupported(format)) {
+			assert(!compressor.reset(Z_DEFAULT_COMPRESSION, format));
+			assert(!compressor.error().empty());
+			continue;
+		}
+		assert(compressor.reset(Z_DEFAULT_COMPRESSION, format));
+		comp.clear();
+		assert(compressor.compress(&comp, mixed.data(), mixed.size()));
+		assert(comp.size() < mixed.size());
+		decomp.clear();
+		assert(decompressor.decompress(&decomp, comp.data(), comp.size()));
+		assert(decomp == mixed);
+
+		std::vector<char> out(mixed.size());
+		size_t got;
+		assert(decompressor.decompress(out.data(), out.size(), &got,
+				comp.data(), comp.size()));
+		assert(std::string(out.data(), got) == mixed);
+		assert(!decompressor.decompress(out.data(), 100, &got,
+				comp.data(), comp.size()));
+		decomp.clear();
+		assert(!decompressor.decompress(&decomp, comp.data(), comp.size() / 2));
+
+		// Streamed in, and pulled back out a piece at a time
+		std::string streamed;
+		NBT::Sink to_streamed = [&streamed] (const char *p, size_t n) {
+			streamed.append(p, n);
+			return true;
+		};
+		assert(compressor.write(mixed.data(), 1000, to_streamed));
+		assert(compressor.write(mixed.data() + 1000, mixed.size() - 1000,
+				to_streamed, true));
+		assert(decompressor.start(streamed.data(), streamed.size()));
+		decomp.clear();
+		char piece[1000];
+		while (size_t n = decompressor.read(piece, sizeof(piece)))
+			decomp.append(piece, n);
+		assert(decompressor.finished() && decomp == mixed);
+	}
+	if (NBT::compressionSupported(NBT::CompressionFormat::LZ4)) {
+		// lz4-java's framing: a stored block and the end mark, with
+		// the checksum's top four bits dropped
+		const char block[] = "LZ4Block\x16\x14\0\0\0\x14\0\0\0"
+				"\x5F\xD2\xF8\x0E" "0123456789abcdefghij"
+				"LZ4Block\x16\0\0\0\0\0\0\0\0\0\0\0\0";
+		decomp.clear();
+		assert(decompressor.decompress(&decomp, block, sizeof(block) - 1));
+		assert(decomp == "0123456789abcdefghij");
+		std::string corrupt(block, sizeof(block) - 1);
+		corrupt[17] ^= 1;
+		assert(!decompressor.decompress(&decomp, corrupt.data(),
+				corrupt.size()));
+	}
+
+	// Region files
+	const char *region_path = "nbt-test-region.mca";
+	std::remove(region_path);
+	{
+		NBT::Region region;
+		assert(region.open(region_path));
+		assert(region.sectorCount() == 2 && !region.hasChunk(3, 4));
+		NBT::Tag chunk = NBT::TagType::Compound;
+		chunk["xPos"] = (NBT::Int) 3;
+		chunk["data"] = NBT::Tag(NBT::TagType::ByteArray, 6000);
+		assert(region.writeChunk(3, 4, chunk, NBT::ChunkCompression::None, 1234));
+		assert(region.sectorCount() == 4);
+		chunk["xPos"] = (NBT::Int) 35;  // World coordinates map to the same slot
+		assert(region.writeChunk(35, -28, chunk, NBT::ChunkCompression::GZip));
+		assert(region.sectorCount() == 4 && region.timestamp(3, 4) != 1234);
+		assert(region.writeChunk(0, 0, long_str.data(), 10000,
+				NBT::ChunkCompression::None));
+		// The freed sector is reused
+		assert(region.writeChunk(1, 0, chunk));
+		assert(region.sectorCount() == 7);
+		assert(region.removeChunk(0, 0));
+	}
+	{
+		NBT::Region region;
+		assert(region.open(region_path, false));
+		NBT::Tag chunk;
+		assert(region.readChunk(3, 4, chunk));
+		assert((NBT::Int) chunk["xPos"] == 35);
+		assert(chunk["data"].as<NBT::ByteArray>().size == 6000);
+		assert(region.hasChunk(1, 0) && !region.hasChunk(0, 0));
+		assert(!region.readChunk(0, 0, chunk));
+		assert(region.compact());
+		assert(region.sectorCount() == 4);
+		assert(region.readChunk(1, 0, chunk) && (NBT::Int) chunk["xPos"] == 35);
+	}
+	{
+		// Mapped regions read the same chunks, but can't be written
+		NBT::Region region;
+		assert(region.openMapped(region_path));
+		NBT::Tag chunk;
+		assert(region.readChunk(3, 4, chunk) && (NBT::Int) chunk["xPos"] == 35);
+		assert(region.readChunk(1, 0, chunk));
+		assert(!region.writeChunk(1, 0, chunk));
+	}
+	if (NBT::compressionSupported(NBT::CompressionFormat::LZ4)) {
+		// Compression type 4, as newer servers can write
+		NBT::Region region;
+		assert(region.open(region_path));
+		NBT::Tag chunk;
+		assert(region.readChunk(1, 0, chunk));
+		chunk["xPos"] = (NBT::Int) 36;
+		assert(region.writeChunk(2, 0, chunk, NBT::ChunkCompression::LZ4));
+		assert(region.readChunk(2, 0, chunk) && (NBT::Int) chunk["xPos"] == 36);
+	}
+	std::remove(region_path);
+
+	// Thread pool, with tasks that queue more tasks
+	{
+		NBT::ThreadPool pool(4);
+		std::atomic<int> ran(0);
+		for (int i = 0; i < 100; i++) {
+			pool.submit([&pool, &ran] (unsigned) {
+				ran++;
+				pool.submit([&ran] (unsigned) { ran++; });
+			});
+		}
+		pool.wait();
+		assert(ran == 200);
+	}
+
+	// Parallel region loading
+	{
+		NBT::Region region;
+		assert(region.open(region_path));
+		NBT::Tag chunk = NBT::TagType::Compound;
+		chunk["data"] = NBT::Tag(NBT::TagType::ByteArray, 3000);
+		for (int i = 0; i < 40; i++) {
+			chunk["xPos"] = (NBT::Int) (i % 32);
+			chunk["zPos"] = (NBT::Int) (i / 32);
+			assert(region.writeChunk(i % 32, i / 32, chunk, i % 2 ?
+					NBT::ChunkCompression::GZip : NBT::ChunkCompression::ZLib));
+		}
+	}
+	{
+		NBT::ThreadPool pool(4);
+		NBT::RegionLoader loader(pool);
+		std::atomic<int> loaded(0), failed(0);
+		std::vector<std::string> paths(2, region_path);
+		assert(loader.load(paths, [&] (NBT::LoadedChunk &c) {
+			assert(c.tag && c.error.empty());
+			assert((NBT::Int) (*c.tag)["xPos"] == c.x);
+			assert((NBT::Int) (*c.tag)["zPos"] == c.z);
+			loaded++;
+		}));
+		assert(loaded == 80);
+		std::vector<std::pair<int, int>> wanted = {{1, 0}, {7, 1}, {20, 20}};
+		loaded = 0;
+		assert(loader.load(region_path, wanted, [&] (NBT::LoadedChunk &c) {
+			if (c.tag)
+				loaded++;
+			else
+				failed++;
+		}));
+		assert(loaded == 2 && failed == 1);
+		paths.push_back("nbt-test-missing.mca");
+		assert(!loader.load(paths, [] (NBT::LoadedChunk &) {}));
+	}
+	std::remove(region_path);
+
+	// Pipelined saves, with a small limit to exercise backpressure
+	{
+		NBT::Region region;
+		assert(region.open(region_path));
+		NBT::ThreadPool pool(3);
+		NBT::SavePipeline pipeline(region, pool, NBT::CompressionFormat::GZip,
+				1, 20000);
+		NBT::Tag chunk = NBT::TagType::Compound;
+		chunk["data"] = NBT::Tag(NBT::TagType::ByteArray, 5000);
+		for (int i = 0; i < 64; i++) {
+			chunk["i"] = (NBT::Int) i;
+			pipeline.save(i % 32, i / 32, chunk);
+		}
+		pipeline.save(5, 5, NBT::Tag((NBT::Int) 1));
+		std::vector<NBT::SaveError> errors = pipeline.flush();
+		assert(errors.size() == 1 && errors[0].x == 5 && errors[0].z == 5);
+		assert(pipeline.flush().empty());
+		for (int i = 0; i < 64; i++) {
+			assert(region.readChunk(i % 32, i / 32, chunk));
+			assert((NBT::Int) chunk["i"] == i);
+		}
+		assert(!region.hasChunk(5, 5));
+
+		bool threw = false;
+		try {
+			NBT::SavePipeline zstd(region, pool, NBT::CompressionFormat::Zstd);
+		} catch (const std::invalid_argument &) {
+			threw = true;
+		}
+		assert(threw);
+	}
+	std::remove(region_path);
+
+	// Uncompressed files are parsed straight from the mapping
+	const char *nbt_path = "nbt-test-file.nbt";
+	{
+		NBT::Tag file_root = NBT::TagType::Compound;
+		file_root["name"] = std::string("mapped");
+		file_root["ints"] = NBT::Tag(NBT::TagType::IntArray, 100);
+		data = file_root.write();
+		std::FILE *f = std::fopen(nbt_path, "wb");
+		assert(f && std::fwrite(data.data(), 1, data.size(), f) == data.size());
+		std::fclose(f);
+		NBT::MappedFile file;
+		assert(file.open(nbt_path, NBT::AccessPattern::Sequential));
+		assert(file.size() == data.size());
+		NBT::Tag mapped;
+		opts.borrow = true;
+		assert(mapped.read(file.data(), file.size(), true, opts));
+		opts = NBT::ReadOptions();
+		assert(mapped.write() == data);
+	}
+	std::remove(nbt_path);
+	assert(!NBT::MappedFile().open(nbt_path));
+
+	// Interned keys
+	{
+		NBT::Key a("Count"), b(std::string("Count"));
+		assert(a.interned() && a.data() == b.data() && a == b);
+		assert(a == "Count" && a != "Slot" && a.str() == "Count");
+		std::string long_name(NBT::Key::max_interned_length + 1, 'x');
+		NBT::Key c(long_name), d(long_name);
+		assert(!c.interned() && c.data() != d.data() && c == d);
+		NBT::Key e = c;
+		assert(e == long_name && NBT::Key() == NBT::Key(""));
+		assert(NBT::Key("a") < NBT::Key("ab") && NBT::Key("ab") < NBT::Key("b"));
+
+		// Every thread gets the same symbols
+		std::vector<std::string> names;
+		for (int i = 0; i < 100; i++)
+			names.push_back("thread-key-" + std::to_string(i));
+		std::atomic<int> mismatches(0);
+		{
+			NBT::ThreadPool pool(4);
+			for (int t = 0; t < 8; t++) {
+				pool.submit([&] (unsigned) {
+					for (size_t i = 0; i < names.size(); i++) {
+						NBT::Key k(names[i]);
+						const char *expected = NBT::Key(names[i]).data();
+						if (k.data() != expected)
+							mismatches++;
+					}
+				});
+			}
+		}
+		assert(mismatches == 0);
+
+		NBT::Tag t = NBT::TagType::Compound;
+		for (int i = 0; i < 40; i++)
+			t[std::to_string(i)] = (NBT::Int) i;
+		NBT::Compound &comp = t;
+		assert(comp.find(NBT::Key("17"))->second.as<NBT::Int>() == 17);
+		assert(comp.find(NBT::Key(long_name)) == comp.end());
+		comp[c] = (NBT::Int) 40;
+		assert(comp.find(d)->second.as<NBT::Int>() == 40);
+		assert(comp.at(long_name).as<NBT::Int>() == 40);
+	}
+
+	// Structural diff and patch
+	{
+		NBT::Tag a = NBT::TagType::Compound;
+		a["name"] = std::string("chunk");
+		a["removed"] = (NBT::Int) 1;
+		a["blocks"] = NBT::Tag(NBT::TagType::ByteArray, 4096);
+		NBT::ByteArray blocks = a["blocks"];
+		for (NBT::UInt i = 0; i < blocks.size; i++)
+			blocks.value[i] = i % 7;
+		a["heights"] = NBT::Tag(NBT::TagType::IntArray);
+		NBT::Int heights[] = {1, 2, 3, 4};
+		a["heights"].append(heights, 4);
+		a["pos"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Double);
+		for (int i = 0; i < 3; i++)
+			a["pos"] += NBT::Tag((double) i);
+		a["entities"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+		for (int i = 0; i < 5; i++) {
+			NBT::Tag e = NBT::TagType::Compound;
+			e["id"] = (NBT::Int) i;
+			e["health"] = 20.0f;
+			a["entities"] += e;
+		}
+		NBT::Tag b = a;
+		assert(NBT::structuralHash(a) == NBT::structuralHash(b));
+		assert(NBT::diff(a, b).empty());
+
+		static_cast<NBT::Compound &>(b).erase("removed");
+		b["added"] = std::string("new");
+		blocks = b["blocks"];
+		blocks.value[10] = 100;
+		blocks.value[4000] = 100;
+		b["heights"].append(heights, 2);
+		b["pos"].span<double>()[1] = 5.5;
+		b["entities"][2]["health"] = 3.0f;
+
+		NBT::HashCache from_hashes;
+		NBT::Patch patch = NBT::diff(a, b, &from_hashes);
+		assert(patch.entries.size() == 7);
+		std::string encoded = patch.write();
+		assert(encoded.size() < 200);
+		NBT::Patch decoded;
+		NBT::ReadResult res = decoded.read((const NBT::UByte *) encoded.data(),
+				encoded.size());
+		assert(res && res.offset == encoded.size());
+		NBT::Tag c = a;
+		assert(decoded.apply(c));
+		// The patch's packed lists are left alone, so it can be shared
+		for (const NBT::PatchEntry &e : decoded.entries)
+			assert(e.value.type != NBT::TagType::List || e.value.packed());
+		assert(NBT::structuralHash(c) == NBT::structuralHash(b));
+		assert(c.write() == b.write());
+		NBT::Tag empty = NBT::TagType::Compound;
+		empty["p"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Float);
+		std::string empty_data = empty.write();
+		NBT::Tag read_empty;
+		assert(read_empty.read((const NBT::UByte *) empty_data.data(),
+				empty_data.size()));
+		assert(read_empty["p"].packed());
+		assert(NBT::structuralHash(read_empty) == NBT::structuralHash(empty));
+		assert(read_empty["p"].packed());
+
+		// Lists that change length are spliced
+		NBT::Tag first = b["entities"][0];
+		b["entities"] += first;
+		static_cast<NBT::Compound &>(b["entities"][0]).erase("id");
+		patch = NBT::diff(c, b);
+		assert(patch.apply(c) && c.write() == b.write());
+
+		// The patch no longer fits
+		assert(!decoded.apply(c));
+		assert(!decoded.read((const NBT::UByte *) encoded.data(), 20));
+	}
+
+	// Schema binding
+	{
+		NBT::Tag item = NBT::TagType::Compound;
+		item["Unknown"] = NBT::TagType::Compound;
+		item["Unknown"]["x"] = (NBT::Int) 1;
+		item["Count"] = (NBT::Byte) 12;
+		item["id"] = std::string("minecraft:sword");
+		item["Enchantments"] = NBT::Tag(NBT::TagType::List, 0,
+				NBT::TagType::Compound);
+		NBT::Tag ench = NBT::TagType::Compound;
+		ench["id"] = std::string("sharpness");
+		ench["lvl"] = (NBT::Short) 5;
+		item["Enchantments"] += ench;
+		item["Motion"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Float);
+		item["Motion"] += NBT::Tag(0.5f);
+		item["Motion"] += NBT::Tag(-1.0f);
+		NBT::Int uuid[] = {1, 2, 3, 7};
+		item["UUID"] = NBT::Tag(NBT::TagType::IntArray);
+		item["UUID"].append(uuid, 4);
+		item["tag"] = NBT::TagType::Compound;
+		item["tag"]["Damage"] = (NBT::Int) 3;
+		data = item.write();
+
+		ItemStack stack;
+		const NBT::UByte *bytes = (const NBT::UByte *) data.data();
+		NBT::ReadResult res = NBT::decode(bytes, data.size(), stack);
+		assert(res && res.offset == data.size());
+		assert(stack.id == "minecraft:sword" && stack.count == 12);
+		assert(!stack.glint);
+		assert(stack.enchantments.size() == 1);
+		assert(stack.enchantments[0].id == "sharpness");
+		assert(stack.enchantments[0].level == 5);
+		assert(stack.motion.size() == 2 && stack.motion[1] == -1.0f);
+		assert(stack.uuid.size() == 4 && stack.uuid[3] == 7);
+		assert((NBT::Int) stack.extra["Damage"] == 3);
+
+		// Written in schema order, with every field
+		static_cast<NBT::Compound &>(item).erase("Unknown");
+		NBT::Tag expected = NBT::TagType::Compound;
+		for (const char *k : {"id", "Count", "Glint", "Enchantments",
+				"Motion", "UUID", "tag"})
+			expected[k] = k[0] == 'G' ? NBT::Tag((NBT::Byte) 0) : item[k];
+		assert(NBT::encode(stack) == expected.write());
+		assert(NBT::encode(stack, true) == expected.write(true));
+
+		res = NBT::decode(bytes, 20, stack);
+		assert(res.error == NBT::ReadError::Truncated);
+		item["Count"] = (NBT::Int) 12;
+		data = item.write();
+		bytes = (const NBT::UByte *) data.data();
+		res = NBT::decode(bytes, data.size(), stack);
+		assert(res.error == NBT::ReadError::TypeMismatch);
+	}
+
+	// Stringified NBT
+	{
+		NBT::Tag a = NBT::TagType::Compound;
+		a["byte"] = (NBT::Byte) -5;
+		a["short"] = (NBT::Short) 300;
+		a["int"] = (NBT::Int) -2147483647 - 1;
+		a["long"] = (NBT::Long) 9000000000LL;
+		a["float"] = 0.1f;
+		a["double"] = -1e300;
+		a["whole"] = 20.0f;
+		a["quotes"] = std::string("say \"hi\"");
+		a["both"] = std::string("it's \"\\\"");
+		a["odd key"] = std::string();
+		a["bytes"] = NBT::Tag(NBT::TagType::ByteArray, 2);
+		NBT::ByteArray bytes = a["bytes"];
+		bytes.value[0] = 1;
+		bytes.value[1] = -1;
+		a["ints"] = NBT::Tag(NBT::TagType::IntArray);
+		NBT::Int ints[] = {1, -2, 3};
+		a["ints"].append(ints, 3);
+		a["longs"] = NBT::Tag(NBT::TagType::LongArray);
+		a["pos"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Double);
+		for (int i = 0; i < 3; i++)
+			a["pos"] += NBT::Tag(i * 1.5);
+		a["pos"].pack();
+		a["empty"] = NBT::Tag(NBT::TagType::List);
+		a["items"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+		NBT::Tag item = NBT::TagType::Compound;
+		item["id"] = std::string("minecraft:stone");
+		a["items"] += item;
+
+		std::string text = NBT::toSNBT(a);
+		assert(text == "{byte:-5b,short:300s,int:-2147483648,long:9000000000L,"
+				"float:0.1f,double:-1e+300d,whole:20.0f,quotes:'say \"hi\"',"
+				"both:\"it's \\\"\\\\\\\"\",\"odd key\":\"\",bytes:[B;1b,-1b],"
+				"ints:[I;1,-2,3],longs:[L;],pos:[0.0d,1.5d,3.0d],empty:[],"
+				"items:[{id:\"minecraft:stone\"}]}");
+		NBT::Tag b;
+		NBT::ReadResult res = NBT::readSNBT(text, b);
+		assert(res && res.offset == text.size());
+		assert(b.write() == a.write());
+		assert(b["pos"].packed());
+		res = NBT::readSNBT(NBT::toSNBT(a, "  "), b);
+		assert(res && b.write() == a.write());
+
+		// Untyped numbers, booleans and unquoted strings
+		res = NBT::readSNBT(" { a : 1.5 , b:true, c:3e2f, d:stone_bricks,"
+				" e:2147483648, f:[B;1,2b], g:NaNd, h:'\\n' } ", b);
+		assert(res);
+		assert(b["a"].type == NBT::TagType::Double && (double) b["a"] == 1.5);
+		assert((NBT::Byte) b["b"] == 1);
+		assert((float) b["c"] == 300.0f);
+		assert((std::string) b["d"] == "stone_bricks");
+		assert((std::string) b["e"] == "2147483648");
+		assert(b["f"].type == NBT::TagType::ByteArray);
+		assert(std::isnan((double) b["g"]));
+		assert((std::string) b["h"] == "\n");
+
+		// Non-finite values need a suffix to read back as numbers
+		NBT::Tag special = NBT::TagType::Compound;
+		special["n"] = std::numeric_limits<float>::quiet_NaN();
+		special["i"] = std::numeric_limits<double>::infinity();
+		special["m"] = -std::numeric_limits<float>::infinity();
+		text = NBT::toSNBT(special);
+		assert(text == "{n:NaNf,i:Infinityd,m:-Infinityf}");
+		res = NBT::readSNBT(text, b);
+		assert(res && b["n"].type == NBT::TagType::Float);
+		assert(std::isnan((float) b["n"]));
+		assert((double) b["i"] == std::numeric_limits<double>::infinity());
+		assert((float) b["m"] == -std::numeric_limits<float>::infinity());
+		res = NBT::readSNBT("[Infinity,NaN]", b);
+		assert(res && (std::string) b[0] == "Infinity");
+
+		// Numbers keep their point under a locale with a decimal comma,
+		// where one is installed
+		for (const char *name : {"de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8"})
+			if (setlocale(LC_NUMERIC, name))
+				break;
+		assert(NBT::toSNBT(NBT::Tag(0.25f)) == "0.25f");
+		res = NBT::readSNBT("1.5d", b);
+		assert(res && b.type == NBT::TagType::Double && (double) b == 1.5);
+		setlocale(LC_NUMERIC, "C");
+
+		// Errors point at the offending character
+		struct { const char *text; NBT::ReadError error; NBT::ULong offset; } bad[] = {
+			{"{a:1,}", NBT::ReadError::Syntax, 5},
+			{"{a:1", NBT::ReadError::Truncated, 4},
+			{"[1,2b]", NBT::ReadError::TypeMismatch, 3},
+			{"[I;1,2b]", NBT::ReadError::TypeMismatch, 5},
+			{"'abc", NBT::ReadError::Truncated, 4},
+			{"1 2", NBT::ReadError::Syntax, 2},
+			{"[[[[1]]]]", NBT::ReadError::TooDeep, 3},
+		};
+		NBT::ReadOptions opts;
+		opts.max_depth = 3;
+		for (const auto &t : bad) {
+			b = NBT::Tag((NBT::Int) 1);
+			res = NBT::readSNBT(t.text, strlen(t.text), b, opts);
+			assert(res.error == t.error && res.offset == t.offset);
+			assert(b.type == NBT::TagType::End);
+		}
+	}
+
+	// Bedrock formats
+	{
+		NBT::Tag a = NBT::TagType::Compound;
+		a["byte"] = (NBT::Byte) -5;
+		a["short"] = (NBT::Short) 300;
+		a["int"] = (NBT::Int) -3;
+		a["long"] = (NBT::Long) 1 << 40;
+		a["float"] = 1.5f;
+		a["double"] = -2.25;
+		a["name"] = std::string("Steve");
+		a["bytes"] = NBT::Tag(NBT::TagType::ByteArray, 3);
+		a["ints"] = NBT::Tag(NBT::TagType::IntArray);
+		NBT::Int ints[] = {1, -70000, 3};
+		a["ints"].append(ints, 3);
+		a["longs"] = NBT::Tag(NBT::TagType::LongArray);
+		NBT::Long longs[] = {-1, 1LL << 62};
+		a["longs"].append(longs, 2);
+		a["pos"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Int);
+		for (int i = 0; i < 3; i++)
+			a["pos"] += NBT::Tag((NBT::Int) -i);
+		NBT::Tag item = a;
+		a["items"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+		a["items"] += item;
+
+		NBT::Tag small = NBT::TagType::Compound;
+		small["a"] = (NBT::Int) 1;
+		assert(hexdump(small.write<NBT::LittleEndian>()) ==
+				"03 01 00 61 01 00 00 00 00 ");
+		assert(hexdump(small.write<NBT::NetworkLittleEndian>()) ==
+				"03 01 61 02 00 ");
+
+		std::string java = a.write(true);
+		assert(a.write<NBT::BigEndian>(true) == java);
+		std::string le = a.write<NBT::LittleEndian>(true);
+		std::string net = a.write<NBT::NetworkLittleEndian>(true);
+		assert(le.size() == java.size() && le != java);
+		assert(net.size() < le.size());
+
+		NBT::Tag b;
+		NBT::ReadResult res = b.read<NBT::LittleEndian>(
+				(const NBT::UByte *) le.data(), le.size(), false);
+		assert(res && res.offset == le.size());
+		assert(b.write(true) == java);
+		res = b.read<NBT::NetworkLittleEndian>(
+				(const NBT::UByte *) net.data(), net.size(), false);
+		assert(res && res.offset == net.size());
+		assert(b.write(true) == java);
+
+		// Between any two formats without a tree
+		const std::string *encoded[] = {&java, &le, &net};
+		for (const std::string *from : encoded) {
+			const NBT::UByte *bytes = (const NBT::UByte *) from->data();
+			std::string out;
+			if (from == &java)
+				res = NBT::transcode<NBT::BigEndian, NBT::NetworkLittleEndian>(
+						bytes, from->size(), out, false);
+			else if (from == &le)
+				res = NBT::transcode<NBT::LittleEndian, NBT::BigEndian>(
+						bytes, from->size(), out, false);
+			else
+				res = NBT::transcode<NBT::NetworkLittleEndian, NBT::LittleEndian>(
+						bytes, from->size(), out, false);
+			assert(res && res.offset == from->size());
+			assert(out == (from == &java ? net : from == &le ? java : le));
+		}
+
+		// Lazy subtrees are decoded for other formats
+		NBT::ReadOptions lazy;
+		lazy.lazy = true;
+		res = b.read((const NBT::UByte *) java.data(), java.size(), false, lazy);
+		assert(res && b.write<NBT::NetworkLittleEndian>(true) == net);
+
+		// Varints longer than their type are rejected
+		const NBT::UByte overlong[] = {3, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01};
+		res = b.read<NBT::NetworkLittleEndian>(overlong, sizeof(overlong), false);
+		assert(res.error == NBT::ReadError::Syntax && res.offset == 1);
+		res = b.read<NBT::NetworkLittleEndian>(overlong, 3, false);
+		assert(res.error == NBT::ReadError::Truncated);
+	}
+
+	// Roots framed inside larger buffers
+	{
+		NBT::Tag a = NBT::TagType::Compound;
+		a["x"] = (NBT::Byte) 7;
+
+		// Spliced into a packet between its header and trailer
+		std::string packet = "\x10\x20\x30";
+		size_t n = a.writeAt(packet, 1, NBT::RootName::Nameless);
+		assert(n == 7 && packet.size() == 10);
+		assert(hexdump(packet) == "10 0A 01 00 01 78 07 00 20 30 ");
+		size_t m = a.writeAt(packet, packet.size(), NBT::RootName::Named);
+		assert(m == n + 2);
+		assert(hexdump(packet.substr(10)) == "0A 00 00 01 00 01 78 07 00 ");
+
+		const NBT::UByte *bytes = (const NBT::UByte *) packet.data();
+		NBT::Tag b;
+		NBT::ReadResult res = b.readAt(bytes, packet.size(), 1,
+				NBT::RootName::Nameless);
+		assert(res && res.offset == n && b.write() == a.write());
+		res = b.readAt(bytes, packet.size(), 10, NBT::RootName::Named);
+		assert(res && res.offset == m && b.write() == a.write());
+		NBT::Document doc;
+		res = doc.readAt(bytes, packet.size(), 10, NBT::RootName::Named);
+		assert(res && res.offset == m && doc.root.write() == a.write());
+
+		// Offsets of errors count from the start of the value
+		res = b.readAt(bytes, 10, 1, NBT::RootName::Named);
+		assert(res.error == NBT::ReadError::Truncated);
+		res = b.readAt(bytes, packet.size(), packet.size() + 1,
+				NBT::RootName::Nameless);
+		assert(res.error == NBT::ReadError::Truncated && res.offset == 0);
+
+		// An End root is just its type, even when named
+		NBT::Tag end;
+		std::string out;
+		assert(end.writeAt(out, 0, NBT::RootName::Named) == 1);
+		res = b.readAt((const NBT::UByte *) out.data(), out.size(), 0,
+				NBT::RootName::Named);
+		assert(res && res.offset == 1 && b.type == NBT::TagType::End);
+
+		// Network names are varints
+		out.clear();
+		a.writeAt<NBT::NetworkLittleEndian>(out, 0, NBT::RootName::Named);
+		assert(hexdump(out) == "0A 00 01 01 78 07 00 ");
+		res = b.readAt<NBT::NetworkLittleEndian>((const NBT::UByte *)
+				out.data(), out.size(), 0, NBT::RootName::Named);
+		assert(res && res.offset == out.size() && b.write() == a.write());
+	}
+
+	// Parsing straight from a stream
+	{
+		NBT::Tag a = NBT::TagType::Compound;
+		a["name"] = std::string("streamed");
+		std::vector<NBT::Long> longs(5000);  // Bigger than the window
+		for (size_t i = 0; i < longs.size(); i++)
+			longs[i] = (NBT::Long) i * 0x0101010101LL;
+		a["longs"] = NBT::Tag(NBT::TagType::LongArray);
+		a["longs"].append(longs.data(), longs.size());
+		a["list"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+		for (int i = 0; i < 100; i++) {
+			NBT::Tag item = NBT::TagType::Compound;
+			item["i"] = (NBT::Int) i;
+			a["list"] += item;
+		}
+		std::string raw;
+		a.writeAt(raw, 0, NBT::RootName::Named);
+
+		// A trickling source gives the same results as a buffer, down to
+		// the offsets of errors
+		for (size_t len : {raw.size(), raw.size() - 1, (size_t) 40, (size_t) 2}) {
+			NBT::Tag b, c;
+			TrickleSource src(raw.substr(0, len));
+			NBT::ReadResult res = b.read(src, NBT::RootName::Named);
+			NBT::ReadResult expected = c.readAt((const NBT::UByte *)
+					raw.data(), len, 0, NBT::RootName::Named);
+			assert(res.error == expected.error && res.offset == expected.offset);
+			assert(b.write() == c.write());
+		}
+
+		// Through a decompressor, with its checksum verified at the end
+		std::string packed;
+		assert(NBT::compress(&packed, raw.data(), raw.size()));
+		NBT::Decompressor d;
+		NBT::Document doc;
+		for (int i = 0; i < 2; i++) {
+			NBT::InflateSource src(d, packed.data(), packed.size());
+			NBT::ReadResult res = doc.read(src, NBT::RootName::Named);
+			assert(res && res.offset == raw.size() && src.finish());
+			assert(doc.root.write() == a.write());
+		}
+		std::string corrupt = packed;
+		corrupt[corrupt.size() - 1] ^= 1;
+		NBT::InflateSource bad(d, corrupt.data(), corrupt.size());
+		doc.read(bad, NBT::RootName::Named);
+		assert(!bad.finish() && !d.error().empty());
+		NBT::InflateSource cut(d, packed.data(), packed.size() / 2);
+		NBT::ReadResult res = doc.read(cut, NBT::RootName::Named);
+		assert(res.error == NBT::ReadError::Truncated);
+		assert(!cut.finish() && !d.error().empty());
+		// Data that can't even be started says why
+		NBT::InflateSource junk(d, "\x28\xB5\x2F\xFD junk", 9);
+		assert(!junk.ok() && !junk.finish() && !d.error().empty());
+
+		// A forged length fails at the end of the data without allocating
+		std::string forged("\x07\x00\x00\x7F\xFF\xFF\xFF" "abc", 10);
+		TrickleSource src(forged);
+		NBT::ReadOptions unlimited = NBT::ReadOptions::unlimited();
+		res = NBT::Tag().read(src, NBT::RootName::Named, unlimited);
+		assert(res.error == NBT::ReadError::Truncated && res.offset == 7);
+		// Limits are checked before any of the payload is buffered
+		TrickleSource big(std::string("\x07\x00\x00\x00\x10\x00\x00", 7) +
+				std::string(1 << 20, 'x'));
+		NBT::ReadOptions small;
+		small.max_alloc = 64 * 1024;
+		res = NBT::Tag().read(big, NBT::RootName::Named, small);
+		assert(res.error == NBT::ReadError::TooLarge && big.pos < 16);
+		// Arrays and Lists are allocated as their items arrive
+		std::string lists[] = {
+			std::string("\x0C\x00\x00\x7F\xFF\xFF\xFF\x01", 8),
+			std::string("\x09\x00\x00\x0A\x7F\xFF\xFF\xFF\x00", 9),
+			std::string("\x09\x00\x00\x04\x7F\xFF\xFF\xFF\x01", 9),
+		};
+		for (const std::string &l : lists) {
+			TrickleSource list_src(l);
+			res = NBT::Tag().read(list_src, NBT::RootName::Named, unlimited);
+			assert(res.error == NBT::ReadError::Truncated);
+		}
+		// Including ones that take several batches
+		NBT::Tag many = NBT::TagType::Compound;
+		many["ints"] = NBT::Tag(NBT::TagType::IntArray, 200000);
+		many["ints"].as<NBT::IntArray>().value[199999] = 7;
+		many["longs"] = NBT::Tag(NBT::TagType::LongArray, 100000);
+		many["floats"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Float);
+		for (int i = 0; i < 150000; i++)
+			many["floats"] += NBT::Tag((float) i);
+		many["items"] = NBT::Tag(NBT::TagType::List, 0, NBT::TagType::Compound);
+		for (int i = 0; i < 70000; i++)
+			many["items"] += NBT::Tag(NBT::TagType::Compound);
+		many["items"][69999]["x"] = (NBT::Int) 1;
+		raw.clear();
+		many.writeAt(raw, 0, NBT::RootName::Named);
+		TrickleSource many_src(raw);
+		NBT::Tag many_copy;
+		assert(many_copy.read(many_src, NBT::RootName::Named));
+		assert(many_copy.write() == many.write());
+		TrickleSource many_doc_src(raw);
+		assert(doc.read(many_doc_src, NBT::RootName::Named));
+		assert(doc.root.write() == many.write());
+	}
+
 	std::cout << "Success!" << std::endl;
 	return 0;
 }
@@ -0,0 +1,113 @@
+
+#include "thread_pool.hpp"
+
+namespace NBT {
+
+// The pool and queue that the current thread works for, if any
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local unsigned current_worker = 0;
+
+
+ThreadPool::ThreadPool(unsigned count) :
+	next_queue(0),
+	queued(0),
+	pending(0),
+	stopping(false)
+{
+	if (count == 0)
+		count = std::thread::hardware_concurrency();
+	if (count == 0)
+		count = 1;
+	for (unsigned i = 0; i < count; i++)
+		queues.emplace_back(new Queue);
+	for (unsigned i = 0; i < count; i++)
+		threads.emplace_back(&ThreadPool::run, this, i);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	wait();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread &t : threads)
+		t.join();
+}
+
+
+void ThreadPool::submit(Task task)
+{
+	unsigned index = current_pool == this ? current_worker :
+			next_queue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> guard(queues[index]->lock);
+		queues[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queued++;
+		pending++;
+	}
+	wake.notify_one();
+}
+
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	idle.wait(guard, [this] { return pending == 0; });
+}
+
+
+// Own queue from the back, then other queues from the front
+bool ThreadPool::take(unsigned index, Task &task)
+{
+	for (unsigned i = 0; i < queues.size(); i++) {
+		Queue &q = *queues[(index + i) % queues.size()];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.tasks.empty())
+			continue;
+		if (i == 0) {
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+		} else {
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+
+void ThreadPool::run(unsigned index)
+{
+	current_pool = this;
+	current_worker = index;
+	Task task;
+	while (true) {
+		if (take(index, task)) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				queued--;
+			}
+			task(index);
+			task = nullptr;
+			std::lock_guard<std::mutex> guard(lock);
+			if (--pending == 0)
+				idle.notify_all();
+			continue;
+		}
+		// queued can be briefly out of step with the queues, in which
+		// case this just goes around again.
+		std::unique_lock<std::mutex> guard(lock);
+		wake.wait(guard, [this] { return stopping || queued > 0; });
+		if (stopping && queued <= 0)
+			return;
+	}
+}
+
+} // namespace NBT
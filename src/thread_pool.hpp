@@ -0,0 +1,61 @@
+#ifndef NBT_THREAD_POOL_HEADER
+#define NBT_THREAD_POOL_HEADER
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace NBT {
+
+// Fixed set of worker threads, each with its own task queue.  Workers take
+// their newest task first and, when they run out, steal the oldest task of
+// another worker.  Tasks get the index of the worker running them, so that
+// they can use per-worker state without locking.  Tasks must not throw.
+class ThreadPool {
+public:
+	typedef std::function<void(unsigned worker)> Task;
+
+	// 0 threads means one per hardware thread
+	explicit ThreadPool(unsigned threads = 0);
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator = (const ThreadPool &) = delete;
+	// Finishes all queued tasks first
+	~ThreadPool();
+
+	// Tasks submitted from a worker go to that worker's own queue
+	void submit(Task task);
+	// Blocks until every submitted task has finished.  Must not be called
+	// from a task.
+	void wait();
+
+	unsigned size() const { return threads.size(); }
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	void run(unsigned index);
+	bool take(unsigned index, Task &task);
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+	std::atomic<unsigned> next_queue;
+
+	std::mutex lock;  // Guards the counters below
+	std::condition_variable wake;  // Signalled when tasks are queued
+	std::condition_variable idle;  // Signalled when pending drops to 0
+	long queued;  // Tasks waiting in a queue
+	size_t pending;  // Tasks queued or running
+	bool stopping;
+};
+
+} // namespace NBT
+
+#endif // NBT_THREAD_POOL_HEADER
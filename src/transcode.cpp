@@ -0,0 +1,155 @@
+#include <string>
+
+#include "walker.hpp"
+
+namespace NBT {
+
+/**************
+ * Transcoder *
+ **************/
+
+// Writes what it's given straight back out in another format
+template <typename Format>
+class Writer final : public Visitor {
+public:
+	Writer(std::string &out, bool write_type) :
+		out(out), untyped(write_type)
+	{}
+
+	// Writes the root's type if it hasn't been yet, which only happens if
+	// the root is End.
+	void finish() { begin(TagType::End); }
+
+	VisitResult key(TagType t, const char *name, UShort len) override
+	{
+		appendByte(out, (UByte) t);
+		Format::appendLength(out, len);
+		appendBytes(out, name, len);
+		return VisitResult::Continue;
+	}
+
+	VisitResult beginCompound() override
+	{
+		begin(TagType::Compound);
+		return VisitResult::Continue;
+	}
+
+	void endCompound() override { appendByte(out, (UByte) TagType::End); }
+
+	VisitResult beginList(TagType tagid, UInt size) override
+	{
+		begin(TagType::List);
+		appendByte(out, (UByte) tagid);
+		Format::appendSize(out, size);
+		return VisitResult::Continue;
+	}
+
+	void value(Byte x) override
+		{ begin(TagType::Byte); appendByte(out, x); }
+	void value(Short x) override
+		{ begin(TagType::Short); Format::appendShort(out, x); }
+	void value(Int x) override
+		{ begin(TagType::Int); Format::appendInt(out, x); }
+	void value(Long x) override
+		{ begin(TagType::Long); Format::appendLong(out, x); }
+	void value(float x) override
+		{ begin(TagType::Float); Format::appendFloat(out, x); }
+	void value(double x) override
+		{ begin(TagType::Double); Format::appendDouble(out, x); }
+
+	void value(const char *str, UShort len) override
+	{
+		begin(TagType::String);
+		Format::appendLength(out, len);
+		appendBytes(out, str, len);
+	}
+
+	void byteArray(const Byte *data, UInt size) override
+	{
+		begin(TagType::ByteArray);
+		Format::appendSize(out, size);
+		appendBytes(out, data, size);
+	}
+
+	void intArray(const Int *data, UInt size) override
+	{
+		begin(TagType::IntArray);
+		Format::appendSize(out, size);
+		Format::appendItems(out, data, TagType::Int, size);
+	}
+
+	void longArray(const Long *data, UInt size) override
+	{
+		begin(TagType::LongArray);
+		Format::appendSize(out, size);
+		Format::appendItems(out, data, TagType::Long, size);
+	}
+
+private:
+	// The walker doesn't report the root's type, so it's written along
+	// with the root's first event.
+	void begin(TagType t)
+	{
+		if (untyped) {
+			appendByte(out, (UByte) t);
+			untyped = false;
+		}
+	}
+
+	std::string &out;
+	bool untyped;
+};
+
+
+
+template <typename From, typename To, typename Input>
+static ReadResult convert(Input &in, std::string &out, bool compound,
+		const ReadOptions &opts)
+{
+	Writer<To> w(out, !compound);
+	ReadResult res = walk<From>(in, w, compound, opts);
+	if (res)
+		w.finish();
+	return res;
+}
+
+
+template <typename From, typename To>
+ReadResult transcode(const UByte *bytes, size_t len, std::string &out,
+		bool compound, const ReadOptions &opts)
+{
+	BufferInput in(bytes, len);
+	return convert<From, To>(in, out, compound, opts);
+}
+
+
+template <typename From, typename To>
+ReadResult transcode(Source &src, std::string &out, bool compound,
+		const ReadOptions &opts)
+{
+	StreamInput in(src);
+	return convert<From, To>(in, out, compound, opts);
+}
+
+
+// The Java walker is instantiated in reader.cpp
+NBT_INSTANTIATE_WALK(LittleEndian)
+NBT_INSTANTIATE_WALK(NetworkLittleEndian)
+
+#define NBT_INSTANTIATE_TRANSCODE(From, To) \
+	template ReadResult transcode<From, To>(const UByte *, size_t, \
+			std::string &, bool, const ReadOptions &); \
+	template ReadResult transcode<From, To>(Source &, std::string &, bool, \
+			const ReadOptions &);
+
+NBT_INSTANTIATE_TRANSCODE(BigEndian, BigEndian)
+NBT_INSTANTIATE_TRANSCODE(BigEndian, LittleEndian)
+NBT_INSTANTIATE_TRANSCODE(BigEndian, NetworkLittleEndian)
+NBT_INSTANTIATE_TRANSCODE(LittleEndian, BigEndian)
+NBT_INSTANTIATE_TRANSCODE(LittleEndian, LittleEndian)
+NBT_INSTANTIATE_TRANSCODE(LittleEndian, NetworkLittleEndian)
+NBT_INSTANTIATE_TRANSCODE(NetworkLittleEndian, BigEndian)
+NBT_INSTANTIATE_TRANSCODE(NetworkLittleEndian, LittleEndian)
+NBT_INSTANTIATE_TRANSCODE(NetworkLittleEndian, NetworkLittleEndian)
+
+} // namespace NBT
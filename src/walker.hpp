@@ -0,0 +1,435 @@
+#ifndef NBT_WALKER_HEADER
+#define NBT_WALKER_HEADER
+
+#include <cstring>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "reader.hpp"
+#include "serialization.hpp"
+
+// The walker behind visit(), skip() and transcode().  Each format's
+// instantiations live in their own file, so that the compiler's inlining
+// budget for one doesn't get spent on the others.
+
+namespace NBT {
+
+/**********
+ * Inputs *
+ **********/
+
+// Both inputs hand out pointers to contiguous runs of the data, and throw
+// a ParseError if it ends early.  The throw is kept out of line, so that
+// take() stays small enough to be inlined everywhere.
+
+[[noreturn]] extern void truncated(ULong offset);
+
+class BufferInput {
+public:
+	BufferInput(const UByte *bytes, size_t len) :
+		bytes(bytes), len(len), pos(0)
+	{}
+
+	const UByte *take(size_t n)
+	{
+		if (n > len - pos)
+			truncated(pos);
+		const UByte *p = bytes + pos;
+		pos += n;
+		return p;
+	}
+
+	void skip(size_t n) { take(n); }
+	ULong offset() const { return pos; }
+	ULong left() const { return len - pos; }
+
+private:
+	const UByte *bytes;
+	size_t len;
+	size_t pos;
+};
+
+
+// Keeps a window of the source's data, which only grows if a single field
+// (such as a large array) doesn't fit in it, and then only as the data
+// arrives, so that a forged length can't allocate for itself up front.
+class StreamInput {
+public:
+	StreamInput(Source &src) :
+		src(src), buf(64 * 1024), pos(0), end(0), base(0)
+	{}
+
+	const UByte *take(size_t n)
+	{
+		if (n > end - pos)
+			fill(n);
+		const UByte *p = &buf[pos];
+		pos += n;
+		return p;
+	}
+
+	void skip(size_t n)
+	{
+		while (n > end - pos) {
+			n -= end - pos;
+			base += end;
+			pos = end = 0;
+			size_t got = src.read(&buf[0], buf.size());
+			if (!got)
+				truncated(offset());
+			end = got;
+		}
+		pos += n;
+	}
+
+	ULong offset() const { return base + pos; }
+	// A stream's length isn't known
+	ULong left() const { return std::numeric_limits<ULong>::max(); }
+
+private:
+	void fill(size_t n)
+	{
+		// Move what's left to the front, then top it up
+		size_t left = end - pos;
+		memmove(&buf[0], &buf[pos], left);
+		base += pos;
+		pos = 0;
+		end = left;
+		while (end < n) {
+			if (end == buf.size())
+				buf.resize(std::min(buf.size() * 2, n));
+			size_t got = src.read(&buf[end], buf.size() - end);
+			if (!got)
+				truncated(offset());
+			end += got;
+		}
+	}
+
+	Source &src;
+	std::vector<UByte> buf;
+	size_t pos;
+	size_t end;
+	ULong base;  // Offset of the start of buf in the input
+};
+
+
+/**********
+ * Walker *
+ **********/
+
+struct StopWalk {};
+
+// The visitor's type is a parameter so that final visitors, such as the
+// transcoder's Writer, get their hooks inlined.
+template <typename Format, typename Input, typename V=Visitor>
+class Walker {
+public:
+	Walker(Input &in, V &v, const ReadOptions &opts) :
+		in(in), v(v), opts(opts), depth(0)
+	{}
+
+	void skipValue(TagType t) { skipTag(t); }
+
+	void root(bool compound)
+	{
+		if (compound) {
+			tag(TagType::Compound);
+		} else {
+			tag((TagType) *in.take(sizeof(Byte)));
+		}
+	}
+
+private:
+	void enter()
+	{
+		if (++depth > opts.max_depth)
+			throw ParseError(ReadError::TooDeep, in.offset());
+	}
+
+	// Array lengths are bounded, since a stream input has to buffer the
+	// whole array.
+	UInt arraySize()
+	{
+		UInt size = Format::readSize(in);
+		if (size > opts.max_elements)
+			throw ParseError(ReadError::TooManyElements, in.offset());
+		return size;
+	}
+
+	// Reads an array's items in batches, so that the conversion space
+	// only grows as far as the data really goes.  It's kept out of line,
+	// like truncated(), so as not to spend tag()'s inlining budget.
+	template <typename T>
+	__attribute__((noinline)) void readArray(std::vector<T> &items, TagType t, UInt size)
+	{
+		if (size > in.left() / Format::minSize(t))
+			truncated(in.offset());
+		for (UInt done = 0, n; done < size; done += n) {
+			n = std::min<UInt>(size - done, 64 * 1024);
+			if (done + n > items.size())
+				items.resize(done + n);
+			Format::readItems(in, &items[done], t, n);
+		}
+	}
+
+	void check(VisitResult res, bool &skip)
+	{
+		if (res == VisitResult::Stop)
+			throw StopWalk();
+		skip = res == VisitResult::Skip;
+	}
+
+	void tag(TagType t);
+	void compound();
+	void list();
+
+	void skipTag(TagType t);
+	void skipCompound();
+	void skipItems(TagType t, UInt size);
+
+	Input &in;
+	V &v;
+	ReadOptions opts;
+	UInt depth;
+	// Conversion space reused for every IntArray and LongArray
+	std::vector<Int> ints;
+	std::vector<Long> longs;
+};
+
+
+template <typename Format, typename Input, typename V>
+void Walker<Format, Input, V>::tag(TagType t)
+{
+	UInt size;
+	bool skip;
+	switch (t) {
+	case TagType::End:
+		break;
+	case TagType::Byte:
+		v.value((Byte) *in.take(sizeof(Byte)));
+		break;
+	case TagType::Short:
+		v.value(Format::readShort(in));
+		break;
+	case TagType::Int:
+		v.value(Format::readInt(in));
+		break;
+	case TagType::Long:
+		v.value(Format::readLong(in));
+		break;
+	case TagType::Float:
+		v.value(Format::readFloat(in));
+		break;
+	case TagType::Double:
+		v.value(Format::readDouble(in));
+		break;
+	case TagType::ByteArray:
+		size = arraySize();
+		v.byteArray((const Byte *) in.take(size), size);
+		break;
+	case TagType::String:
+		size = Format::readLength(in);
+		v.value((const char *) in.take(size), size);
+		break;
+	case TagType::List:
+		enter();
+		list();
+		--depth;
+		break;
+	case TagType::Compound:
+		enter();
+		check(v.beginCompound(), skip);
+		if (skip) {
+			skipCompound();
+		} else {
+			compound();
+			v.endCompound();
+		}
+		--depth;
+		break;
+	case TagType::IntArray:
+		size = arraySize();
+		readArray(ints, TagType::Int, size);
+		v.intArray(ints.data(), size);
+		break;
+	case TagType::LongArray:
+		size = arraySize();
+		readArray(longs, TagType::Long, size);
+		v.longArray(longs.data(), size);
+		break;
+	default:
+		throw ParseError(ReadError::InvalidType, in.offset());
+	}
+}
+
+
+template <typename Format, typename Input, typename V>
+void Walker<Format, Input, V>::compound()
+{
+	while (true) {
+		TagType t = (TagType) *in.take(sizeof(Byte));
+		if (t == TagType::End)
+			return;
+		UShort len = Format::readLength(in);
+		const char *name = (const char *) in.take(len);
+		bool skip;
+		check(v.key(t, name, len), skip);
+		if (skip)
+			skipTag(t);
+		else
+			tag(t);
+	}
+}
+
+
+template <typename Format, typename Input, typename V>
+void Walker<Format, Input, V>::list()
+{
+	TagType t = (TagType) *in.take(sizeof(Byte));
+	UInt size = Format::readSize(in);
+	if (t > TagType::LongArray || (size > 0 && t == TagType::End))
+		throw ParseError(ReadError::InvalidType, in.offset());
+	bool skip;
+	check(v.beginList(t, size), skip);
+	if (skip) {
+		skipItems(t, size);
+		return;
+	}
+	for (UInt i = 0; i < size; i++)
+		tag(t);
+	v.endList();
+}
+
+
+// Advances past a value without reporting anything.  Only the headers
+// needed to find the value's end are parsed.
+template <typename Format, typename Input, typename V>
+void Walker<Format, Input, V>::skipTag(TagType t)
+{
+	TagType sub;
+	UInt size;
+	switch (t) {
+	case TagType::End: break;
+	case TagType::Byte:
+	case TagType::Short:
+	case TagType::Int:
+	case TagType::Long:
+	case TagType::Float:
+	case TagType::Double:
+		Format::skipItems(in, t, 1);
+		break;
+	case TagType::ByteArray:
+		in.skip(Format::readSize(in));
+		break;
+	case TagType::String:
+		in.skip(Format::readLength(in));
+		break;
+	case TagType::IntArray:
+		Format::skipItems(in, TagType::Int, Format::readSize(in));
+		break;
+	case TagType::LongArray:
+		Format::skipItems(in, TagType::Long, Format::readSize(in));
+		break;
+	case TagType::List:
+		enter();
+		sub = (TagType) *in.take(sizeof(Byte));
+		size = Format::readSize(in);
+		if (sub > TagType::LongArray || (size > 0 && sub == TagType::End))
+			throw ParseError(ReadError::InvalidType, in.offset());
+		skipItems(sub, size);
+		--depth;
+		break;
+	case TagType::Compound:
+		enter();
+		skipCompound();
+		--depth;
+		break;
+	default:
+		throw ParseError(ReadError::InvalidType, in.offset());
+	}
+}
+
+
+template <typename Format, typename Input, typename V>
+void Walker<Format, Input, V>::skipCompound()
+{
+	TagType t;
+	while ((t = (TagType) *in.take(sizeof(Byte))) != TagType::End) {
+		in.skip(Format::readLength(in));
+		skipTag(t);
+	}
+}
+
+
+template <typename Format, typename Input, typename V>
+void Walker<Format, Input, V>::skipItems(TagType t, UInt size)
+{
+	// Numbers are skipped all at once where the format allows
+	if (Tag::itemSize(t)) {
+		Format::skipItems(in, t, size);
+		return;
+	}
+	for (UInt i = 0; i < size; i++)
+		skipTag(t);
+}
+
+template <typename Format, typename Input, typename V>
+ReadResult walk(Input &in, V &v, bool compound, const ReadOptions &opts)
+{
+	Walker<Format, Input, V> w(in, v, opts);
+	try {
+		w.root(compound);
+	} catch (const ParseError &e) {
+		return ReadResult{e.error, e.offset};
+	} catch (const StopWalk &) {
+	}
+	return ReadResult{ReadError::None, in.offset()};
+}
+
+
+template <typename Format>
+ReadResult skip(const UByte *bytes, size_t len, TagType tag,
+		const ReadOptions &opts)
+{
+	BufferInput in(bytes, len);
+	Visitor v;
+	Walker<Format, BufferInput> w(in, v, opts);
+	try {
+		w.skipValue(tag);
+	} catch (const ParseError &e) {
+		return ReadResult{e.error, e.offset};
+	}
+	return ReadResult{ReadError::None, in.offset()};
+}
+
+
+template <typename Format>
+ReadResult visit(const UByte *bytes, size_t len, Visitor &v, bool compound,
+		const ReadOptions &opts)
+{
+	BufferInput in(bytes, len);
+	return walk<Format>(in, v, compound, opts);
+}
+
+
+template <typename Format>
+ReadResult visit(Source &src, Visitor &v, bool compound,
+		const ReadOptions &opts)
+{
+	StreamInput in(src);
+	return walk<Format>(in, v, compound, opts);
+}
+
+
+#define NBT_INSTANTIATE_WALK(Format) \
+	template ReadResult skip<Format>(const UByte *, size_t, TagType, \
+			const ReadOptions &); \
+	template ReadResult visit<Format>(const UByte *, size_t, Visitor &, \
+			bool, const ReadOptions &); \
+	template ReadResult visit<Format>(Source &, Visitor &, bool, \
+			const ReadOptions &);
+
+} // namespace NBT
+
+#endif // NBT_WALKER_HEADER